@@ -1,182 +1,630 @@
 #include "audio.h"
+#include <pulse/pulseaudio.h>
+#include <math.h>
+#include <sys/mman.h>
 #include <libavutil/avassert.h>
 
-// Returns a pointer through reference and the number of devices through return value
+static int probe_audio_layout(AudioStream*);
+
+// Largest absolute sample value that still counts as silence, from `silence-threshold` in dBFS, relative to full scale
+static float configured_silence_level() {
+	return pow(10.0, cfg_getfloat(C_AUDIO_ROOT, "silence-threshold") / 20.0);
+}
+
+// Result of looking up a source through the introspection API
+typedef struct SourceLookup {
+	int done;
+	int found;
+	pa_sample_spec sampleSpec;
+	pa_channel_map channelMap;
+} SourceLookup;
+
+static void source_info_callback(pa_context *context, const pa_source_info *info, int eol, void *userdata) {
+	SourceLookup *lookup = userdata;
+	if(eol != 0) {
+		lookup->done = 1;
+		return;
+	}
+	lookup->sampleSpec = info->sample_spec;
+	lookup->channelMap = info->channel_map;
+	lookup->found = 1;
+}
+
+// Connects to the Pulse server on a mainloop that's only iterated while looking up devices
+static pa_context *connect_pulse(pa_mainloop *mainloop) {
+	pa_context *context = pa_context_new(pa_mainloop_get_api(mainloop), "Spotlight");
+	if(context == NULL)
+		return NULL;
+	if(pa_context_connect(context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+		printf("Error connecting to PulseAudio: %s\n", pa_strerror(pa_context_errno(context)));
+		pa_context_unref(context);
+		return NULL;
+	}
+	pa_context_state_t state;
+	while((state = pa_context_get_state(context)) != PA_CONTEXT_READY) {
+		if(!PA_CONTEXT_IS_GOOD(state) || pa_mainloop_iterate(mainloop, 1, NULL) < 0) {
+			printf("Error connecting to PulseAudio: %s\n", pa_strerror(pa_context_errno(context)));
+			pa_context_unref(context);
+			return NULL;
+		}
+	}
+	return context;
+}
+
+// Asks the server for the sample spec and channel map the source runs at
+static int lookup_source(pa_mainloop *mainloop, pa_context *context, const char *name, SourceLookup *lookup) {
+	memset(lookup, 0, sizeof(SourceLookup));
+	pa_operation *operation = pa_context_get_source_info_by_name(context, name, source_info_callback, lookup);
+	if(operation == NULL)
+		return 1;
+	while(!lookup->done && pa_operation_get_state(operation) == PA_OPERATION_RUNNING) {
+		if(pa_mainloop_iterate(mainloop, 1, NULL) < 0)
+			break;
+	}
+	pa_operation_unref(operation);
+	return !lookup->found;
+}
+
+// Sample format the device is read in. Formats ffmpeg has no equivalent for
+// (24 bit, a-law, µ-law, the other byte order) are read as float, which Pulse converts to without resampling.
+static enum AVSampleFormat capture_sample_format(pa_sample_format_t *format) {
+	switch(*format) {
+		case PA_SAMPLE_U8:
+			return AV_SAMPLE_FMT_U8;
+		case PA_SAMPLE_S16NE:
+			return AV_SAMPLE_FMT_S16;
+		case PA_SAMPLE_S32NE:
+			return AV_SAMPLE_FMT_S32;
+		case PA_SAMPLE_FLOAT32NE:
+			return AV_SAMPLE_FMT_FLT;
+		default:
+			*format = PA_SAMPLE_FLOAT32NE;
+			return AV_SAMPLE_FMT_FLT;
+	}
+}
+
+// Returns a pointer through reference and the number of devices through return value.
+// Every device is recorded at the rate, format and channels its source runs at, so the server doesn't resample.
 AudioDevice** init_pulse(size_t* numDevices) {
 	int nrDevices = cfg_size(C_AUDIO_ROOT, "device");
-	AudioDevice** devices = malloc(sizeof(AudioDevice*) * nrDevices);
+	// Devices that aren't set up yet stay NULL, so a failure can free the ones that are
+	AudioDevice** devices = calloc(nrDevices, sizeof(AudioDevice*));
 	*numDevices = nrDevices;
 
+	pa_mainloop *mainloop = pa_mainloop_new();
+	pa_context *context = connect_pulse(mainloop);
+	if(context == NULL)
+		goto fail;
+
 	int i;
 	for(i = 0; i < nrDevices; ++i) {
 		cfg_t *deviceSection = cfg_getnsec(C_AUDIO_ROOT, "device", i);
 		AudioDevice* device = malloc(sizeof(AudioDevice));
+		memset(device, 0, sizeof(AudioDevice));
+		devices[i] = device;
 
-		// Initialize the device with set parameters
-		//
-		pa_sample_spec deviceSpecification = {
-			.format = PA_SAMPLE_S16LE,
-			.rate = 44100,
-			.channels = 2
-		};
+		// Copy the strings, the config they belong to is replaced when it's reloaded
+		device->name = strdup(cfg_title(deviceSection));
+		device->pulseName = strdup(cfg_getstr(deviceSection, "name"));
+		device->num = i;
+
+		SourceLookup source;
+		if(lookup_source(mainloop, context, device->pulseName, &source)) {
+			printf("Error looking up PulseAudio source %s for device %s: %s\n", device->pulseName, device->name,
+					pa_strerror(pa_context_errno(context)));
+			goto fail;
+		}
+		pa_sample_spec deviceSpecification = source.sampleSpec;
+		const pa_channel_map *channelMap = &source.channelMap;
+		// The channels can still be mixed down or up by the server, which costs next to nothing
 		char* desiredChannelLayout = cfg_getstr(deviceSection, "channels");
 		if(strcmp(desiredChannelLayout, "mono") == 0) {
 			deviceSpecification.channels = 1;
+			channelMap = NULL;
 		} else if(strcmp(desiredChannelLayout, "stereo") == 0) {
 			deviceSpecification.channels = 2;
-		} else {
+			channelMap = NULL;
+		} else if(strcmp(desiredChannelLayout, "native") != 0) {
 			printf("Invalid channel layout %s\n", desiredChannelLayout);
-			return NULL;
+			goto fail;
 		}
-
-
-		device->name = (char*) cfg_title(deviceSection);
-		device->pulseName = cfg_getstr(deviceSection, "name");
-		device->num = i;
+		device->sampleFormat = capture_sample_format(&deviceSpecification.format);
 		device->sampleRate = deviceSpecification.rate;
 		device->channels = deviceSpecification.channels;
 		device->sampleSize = pa_sample_size_of_format(deviceSpecification.format);
 		device->sampleSpec = deviceSpecification;
 
-		
 		// Initialize PulseAudio simple on this device
 		int error;
-		device->handle = pa_simple_new(NULL, "Spotlight", PA_STREAM_RECORD, device->pulseName, "Spotlight Record", &deviceSpecification, NULL, NULL, &error);
+		device->handle = pa_simple_new(NULL, "Spotlight", PA_STREAM_RECORD, device->pulseName, "Spotlight Record", &deviceSpecification, channelMap, NULL, &error);
 		if(device->handle == NULL) {
 			printf("Error initializing PulseAudio on device %s: %s\n", device->name, pa_strerror(error));
-			return NULL;
+			goto fail;
 		}
-		devices[i] = device;
 	}
-	
+	pa_context_disconnect(context);
+	pa_context_unref(context);
+	pa_mainloop_free(mainloop);
+
 	for(int i = 0; i < nrDevices; ++i) {
 		AudioDevice* device = devices[i];
-		printf("Registered audio device %s: %s\n", device->name, device->pulseName);
+		printf("Registered audio device %s: %s (%s, %u Hz, %u channels)\n", device->name, device->pulseName,
+				av_get_sample_fmt_name(device->sampleFormat), device->sampleRate, device->channels);
 	}
 	return devices;
-}
 
-AudioStream* alloc_audio_stream(Capture* cap, AudioDevice* source) {
-	AudioStream* audioStream = malloc(sizeof(AudioStream));
-	memset(audioStream, 0, sizeof(AudioStream));
-	audioStream->root = cap;
-	audioStream->device = source;
-
-	open_audio_stream(cap, audioStream);
-	AVCodecContext* codecContext = audioStream->codecContext;
-
-
-	int *numSamples = &audioStream->numSamples;
-	if (codecContext->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
-		*numSamples = 10000;
-	else
-		*numSamples = codecContext->frame_size;
+fail:
+	// The device being set up and every device opened before it, along with their streams
+	for(i = 0; i < nrDevices; i++) {
+		if(devices[i] != NULL)
+			free_audio_device(devices[i]);
+	}
+	free(devices);
+	if(context != NULL) {
+		pa_context_disconnect(context);
+		pa_context_unref(context);
+	}
+	pa_mainloop_free(mainloop);
+	return NULL;
+}
 
-	// Calculate the number of frames we have to buffer to hold `windowSize` seconds of audio
-	int numFrames = codecContext->sample_rate / *numSamples * cap->windowSize;
-	audioStream->bufferSize = numFrames;
-	audioStream->frameBuffer = (AVFrame**)malloc(sizeof(AVFrame*) * numFrames);
-	if(!audioStream->frameBuffer) {
-		printf("Error allocating frame buffer\n");
-		exit(1);
+// Allocates a frame of `samples` samples in the ring's layout
+static AVFrame *alloc_audio_frame(AudioStream *audioStream, int samples) {
+	AVFrame* frame = av_frame_alloc();
+	if (!frame) {
+		return NULL;
 	}
-	
-	// Allocate resampling frame with original sample rate and sample format
+	frame->nb_samples = samples;
+	frame->format = audioStream->sampleFormat;
+	frame->sample_rate = audioStream->sampleRate;
+	av_channel_layout_copy(&frame->ch_layout, &audioStream->channelLayout);
+
+	// Allocate the data buffers
+	if (av_frame_get_buffer(frame, 0) < 0) {
+		av_frame_free(&frame);
+		return NULL;
+	}
+	return frame;
+}
+
+// Allocate resampling frame with original sample rate and sample format, and the frame it's converted into
+static int alloc_resample_frame(AudioStream *audioStream) {
+	AudioDevice *source = audioStream->device;
+	if(audioStream->resampleFrame)
+		av_frame_free(&audioStream->resampleFrame);
 	audioStream->resampleFrame = av_frame_alloc();
 	if(!audioStream->resampleFrame) {
 		printf("Error allocating resample frame\n");
-		exit(1);
-	}
-	audioStream->resampleFrame->nb_samples = *numSamples;
-	audioStream->resampleFrame->format = AV_SAMPLE_FMT_S16; // TODO: Make this configurable
-	// Configure the resampleFrame's channel layout based on the source->channels
-	switch(source->channels) {
-		case 1: // MONO
-			av_channel_layout_copy(&audioStream->resampleFrame->ch_layout, &(AVChannelLayout) AV_CHANNEL_LAYOUT_MONO);
-			break;
-		case 2: // STEREO
-			av_channel_layout_copy(&audioStream->resampleFrame->ch_layout, &(AVChannelLayout) AV_CHANNEL_LAYOUT_STEREO);
-			break;
-		default:
-			printf("Unsupported number of channels: %i on device %s\n", source->channels, source->name);
-			return NULL;
+		return 1;
 	}
+	audioStream->resampleFrame->nb_samples = audioStream->chunkSamples;
+	audioStream->resampleFrame->format = source->sampleFormat;
+	av_channel_layout_default(&audioStream->resampleFrame->ch_layout, source->channels);
 	audioStream->resampleFrame->sample_rate = source->sampleRate;
 
 	if(av_frame_get_buffer(audioStream->resampleFrame, 0) < 0) {
 		printf("Error allocating resample frame buffer\n");
-		exit(1);
+		return 1;
 	}
-	for (int i = 0; i < numFrames; i++) {
-		AVFrame* frame = audioStream->frameBuffer[i] = av_frame_alloc();
-		if (!frame) {
-			fprintf(stderr, "Failed to allocate frame %i of audio frame buffer\n", i);
-			exit(1);
-		}
-		frame->nb_samples = *numSamples;
-		frame->format = audioStream->codecContext->sample_fmt;
-		frame->sample_rate = audioStream->codecContext->sample_rate;
-		av_channel_layout_copy(&frame->ch_layout, &audioStream->codecContext->ch_layout);
-
-		// Allocate the data buffers
-		if (av_frame_get_buffer(frame, 0) < 0) {
-			fprintf(stderr, "Failed to allocate data buffers for frame %i of audio frame buffer\n", i);
-			exit(1);
+
+	// A resampled chunk can come out a few samples longer
+	av_frame_free(&audioStream->convertFrame);
+	int converted = av_rescale_rnd(audioStream->chunkSamples, audioStream->sampleRate, source->sampleRate, AV_ROUND_UP) + 32;
+	audioStream->convertFrame = alloc_audio_frame(audioStream, converted);
+	if(!audioStream->convertFrame) {
+		printf("Error allocating conversion frame\n");
+		return 1;
+	}
+	return 0;
+}
+
+// Sets up the conversion from the device's format into the encoder's format.
+// When the encoder takes the samples as they're read, there's nothing to convert and no resampler.
+static int init_resampler(AudioStream *audioStream) {
+	AudioDevice *source = audioStream->device;
+	if(audioStream->resampler != NULL)
+		swr_free(&audioStream->resampler);
+	int resampling = source->sampleRate != (unsigned int) audioStream->sampleRate;
+	if(!resampling && source->sampleFormat == audioStream->sampleFormat
+			&& source->channels == (unsigned int) audioStream->channelLayout.nb_channels) {
+		printf("[%s] Encoder takes %s at %u Hz as captured, no conversion\n", source->name,
+				av_get_sample_fmt_name(source->sampleFormat), source->sampleRate);
+		return 0;
+	}
+	printf("[%s] Converting %s at %u Hz to %s at %d Hz%s\n", source->name, av_get_sample_fmt_name(source->sampleFormat),
+			source->sampleRate, av_get_sample_fmt_name(audioStream->sampleFormat), audioStream->sampleRate,
+			resampling ? ", the encoder doesn't support the device's rate" : "");
+	audioStream->resampler = swr_alloc();
+	if (!audioStream->resampler) {
+		fprintf(stderr, "Could not allocate resampler context\n");
+		return 1;
+	}
+
+	av_opt_set_chlayout  (audioStream->resampler, "in_chlayout",       &audioStream->resampleFrame->ch_layout,      0);
+	av_opt_set_int       (audioStream->resampler, "in_sample_rate",     source->sampleRate,    0);
+	av_opt_set_sample_fmt(audioStream->resampler, "in_sample_fmt",      source->sampleFormat, 0);
+	av_opt_set_chlayout  (audioStream->resampler, "out_chlayout",      &audioStream->channelLayout,      0);
+	av_opt_set_int       (audioStream->resampler, "out_sample_rate",    audioStream->sampleRate,    0);
+	av_opt_set_sample_fmt(audioStream->resampler, "out_sample_fmt",     audioStream->sampleFormat,     0);
+
+	int ret;
+	if ((ret = swr_init(audioStream->resampler)) < 0) {
+		fprintf(stderr, "Failed to initialize the resampling context\n");
+		return 1;
+	}
+	return 0;
+}
+
+// Works out the planes of the ring from its sample format
+static void set_ring_layout(AudioStream *audio) {
+	int channels = audio->channelLayout.nb_channels;
+	int planar = av_sample_fmt_is_planar(audio->sampleFormat);
+	audio->planeCount = planar ? channels : 1;
+	audio->sampleStride = av_get_bytes_per_sample(audio->sampleFormat) * (planar ? 1 : channels);
+}
+
+static void free_sample_planes(uint8_t **planes, int planeCount, size_t size) {
+	for(int i = 0; i < planeCount && planes[i] != NULL; i++) {
+		munmap(planes[i], size);
+	}
+	free(planes);
+}
+
+// The planes are mapped directly, so pages handed back to the kernel read as zeroes, which is silence.
+// Returns NULL if they can't be allocated.
+static uint8_t **alloc_sample_planes(AudioStream *audio, size_t samples) {
+	uint8_t **planes = calloc(audio->planeCount, sizeof(uint8_t*));
+	if(planes == NULL)
+		return NULL;
+	for(int i = 0; i < audio->planeCount; i++) {
+		void *data = mmap(NULL, samples * audio->sampleStride, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(data == MAP_FAILED) {
+			printf("[%s] Error allocating %zu samples of audio buffer\n", audio->device->name, samples);
+			free_sample_planes(planes, audio->planeCount, samples * audio->sampleStride);
+			return NULL;
 		}
+		planes[i] = data;
 	}
-	// Allocate the packet
-	audioStream->packet = av_packet_alloc();
-	if(!audioStream->packet) {
-		printf("Error allocating packet\n");
-		exit(1);
+	return planes;
+}
+
+// Copies `count` samples, starting at sample `index` of the capture, out of the ring
+static void read_samples(AudioStream *audio, uint8_t **destination, size_t index, size_t count) {
+	size_t offset = index % audio->bufferSize;
+	size_t first = audio->bufferSize - offset < count ? audio->bufferSize - offset : count;
+	size_t stride = audio->sampleStride;
+	for(int i = 0; i < audio->planeCount; i++) {
+		memcpy(destination[i], audio->planes[i] + offset * stride, first * stride);
+		memcpy(destination[i] + first * stride, audio->planes[i], (count - first) * stride);
 	}
-	audioStream->packet->stream_index = audioStream->stream->index;
+}
 
-	// Allocate resampler
-	if(audioStream->resampler == NULL) {
-		audioStream->resampler = swr_alloc();
-		if (!audioStream->resampler) {
-			fprintf(stderr, "Could not allocate resampler context\n");
-			exit(1);
+// Appends `count` samples to the ring, NULL appends silence
+static void write_samples(AudioStream *audio, uint8_t **source, size_t count) {
+	size_t offset = audio->writeIndex;
+	size_t first = audio->bufferSize - offset < count ? audio->bufferSize - offset : count;
+	size_t stride = audio->sampleStride;
+	// Zero isn't silence for unsigned samples
+	int unsignedSamples = av_get_packed_sample_fmt(audio->sampleFormat) == AV_SAMPLE_FMT_U8;
+	if(source == NULL && unsignedSamples) {
+		av_samples_set_silence(audio->planes, offset, first, audio->channelLayout.nb_channels, audio->sampleFormat);
+		av_samples_set_silence(audio->planes, 0, count - first, audio->channelLayout.nb_channels, audio->sampleFormat);
+	} else {
+		// The silence since the last sound is zero already, chunks are a fraction of a page so their pages are released once the silence covers them
+		size_t silent = audio->sampleCount - audio->lastSound < offset ? audio->sampleCount - audio->lastSound : offset;
+		for(int i = 0; i < audio->planeCount; i++) {
+			if(source == NULL) {
+				clear_memory(audio->planes[i] + offset * stride, first * stride, silent * stride);
+				clear_memory(audio->planes[i], (count - first) * stride, 0);
+			} else {
+				memcpy(audio->planes[i] + offset * stride, source[i], first * stride);
+				memcpy(audio->planes[i], source[i] + first * stride, (count - first) * stride);
+			}
 		}
+	}
+	audio->writeIndex = (offset + count) % audio->bufferSize;
+	audio->sampleCount += count;
+}
 
-		av_opt_set_chlayout  (audioStream->resampler, "in_chlayout",       &audioStream->resampleFrame->ch_layout,      0);
-		av_opt_set_int       (audioStream->resampler, "in_sample_rate",     source->sampleRate,    0);
-		av_opt_set_sample_fmt(audioStream->resampler, "in_sample_fmt",      AV_SAMPLE_FMT_S16, 0);
-		av_opt_set_chlayout  (audioStream->resampler, "out_chlayout",      &audioStream->codecContext->ch_layout,      0);
-		av_opt_set_int       (audioStream->resampler, "out_sample_rate",    audioStream->codecContext->sample_rate,    0);
-		av_opt_set_sample_fmt(audioStream->resampler, "out_sample_fmt",     audioStream->codecContext->sample_fmt,     0);
-
-		int ret;
-		if ((ret = swr_init(audioStream->resampler)) < 0) {
-			fprintf(stderr, "Failed to initialize the resampling context\n");
-			exit(1);
+// Moves the `count` samples starting at `offset` of the ring to its front, oldest first
+static void linearize_samples(AudioStream *audio, size_t offset, size_t count) {
+	size_t first = audio->bufferSize - offset < count ? audio->bufferSize - offset : count;
+	size_t second = count - first;
+	size_t stride = audio->sampleStride;
+	for(int i = 0; i < audio->planeCount; i++) {
+		uint8_t *plane = audio->planes[i];
+		if(second == 0) {
+			memmove(plane, plane + offset * stride, first * stride);
+			continue;
+		}
+		// Both parts are in each other's way, the smaller one is parked while the larger one moves
+		if(first <= second) {
+			uint8_t *parked = malloc(first * stride);
+			memcpy(parked, plane + offset * stride, first * stride);
+			memmove(plane + first * stride, plane, second * stride);
+			memcpy(plane, parked, first * stride);
+			free(parked);
+		} else {
+			uint8_t *parked = malloc(second * stride);
+			memcpy(parked, plane, second * stride);
+			memmove(plane, plane + offset * stride, first * stride);
+			memcpy(plane + first * stride, parked, second * stride);
+			free(parked);
 		}
 	}
+}
+
+// Starts the sample indices over with the newest `kept` samples at the front of the ring
+static void restart_sample_count(AudioStream *audio, size_t kept) {
+	size_t dropped = audio->sampleCount - kept;
+	audio->lastSound = audio->lastSound > dropped ? audio->lastSound - dropped : 0;
+	audio->sampleCount = kept;
+	audio->writeIndex = kept % audio->bufferSize;
+}
+
+// Frees what the stream allocated for itself, everything but its device and thread
+static void free_stream_buffers(AudioStream *audio) {
+	av_frame_free(&audio->resampleFrame);
+	av_frame_free(&audio->convertFrame);
+	if(audio->resampler != NULL)
+		swr_free(&audio->resampler);
+	av_channel_layout_uninit(&audio->channelLayout);
+	if(audio->planes != NULL)
+		free_sample_planes(audio->planes, audio->planeCount, audio->capacity * audio->sampleStride);
+	free(audio);
+}
+
+// Creates the ring for `source`, which the stream owns from then on.
+// Returns NULL on errors, the device is still the caller's then.
+AudioStream* alloc_audio_stream(Capture* cap, AudioDevice* source) {
+	AudioStream* audioStream = malloc(sizeof(AudioStream));
+	memset(audioStream, 0, sizeof(AudioStream));
+	audioStream->root = cap;
+	audioStream->device = source;
+
+	if(probe_audio_layout(audioStream)) {
+		free_stream_buffers(audioStream);
+		return NULL;
+	}
+	audioStream->silenceLevel = configured_silence_level();
+	// 20 ms per read
+	audioStream->chunkSamples = source->sampleRate / 50;
+
+	// Hold exactly `windowSize` seconds of audio
+	set_ring_layout(audioStream);
+	audioStream->bufferSize = audioStream->sampleRate * cap->windowSize;
+	audioStream->capacity = audioStream->bufferSize;
+	audioStream->planes = alloc_sample_planes(audioStream, audioStream->capacity);
+
+	// Allocate resampler
+	if(audioStream->planes == NULL || alloc_resample_frame(audioStream) || init_resampler(audioStream)) {
+		free_stream_buffers(audioStream);
+		return NULL;
+	}
 	return audioStream;
 }
 
+// Creates a stream whose samples are pushed in by an embedding application through push_audio_samples(),
+// instead of read from Pulse. Takes the same packed formats Pulse is read in.
+AudioStream *injected_audio(Capture *cap, const char *name, enum AVSampleFormat format, int sampleRate, int channels) {
+	if(format != AV_SAMPLE_FMT_U8 && format != AV_SAMPLE_FMT_S16 && format != AV_SAMPLE_FMT_S32 && format != AV_SAMPLE_FMT_FLT) {
+		printf("[%s] Unsupported sample format %s\n", name, av_get_sample_fmt_name(format));
+		return NULL;
+	}
+	AudioDevice *device = malloc(sizeof(AudioDevice));
+	memset(device, 0, sizeof(AudioDevice));
+	device->name = strdup(name);
+	device->pulseName = strdup("");
+	device->num = cap->nb_audio_streams;
+	device->sampleRate = sampleRate;
+	device->channels = channels;
+	device->sampleFormat = format;
+	device->sampleSize = av_get_bytes_per_sample(format);
+	AudioStream *audio = alloc_audio_stream(cap, device);
+	if(audio == NULL)
+		free_audio_device(device);
+	return audio;
+}
 
+// Shrinks or grows the active part of the ring to `newSize` samples, at most its capacity.
+// The newest samples are moved to the front, the memory past the active part is released.
+// The capture has to be paused.
+void resize_sample_ring(AudioStream *audio, size_t newSize) {
+	if(newSize > audio->capacity)
+		newSize = audio->capacity;
+	if(newSize == 0 || newSize == audio->bufferSize)
+		return;
+
+	size_t oldSize = audio->bufferSize;
+	size_t valid = audio->sampleCount < oldSize ? audio->sampleCount : oldSize;
+	size_t kept = valid < newSize ? valid : newSize;
+	linearize_samples(audio, (audio->sampleCount - kept) % oldSize, kept);
+	for(int i = 0; oldSize > newSize && i < audio->planeCount; i++) {
+		release_memory(audio->planes[i] + newSize * audio->sampleStride, (oldSize - newSize) * audio->sampleStride);
+	}
+	audio->bufferSize = newSize;
+	restart_sample_count(audio, kept);
+}
 
-int resample(AudioStream *stream, AVFrame* inFrame, AVFrame* outFrame) {
-	// Convert audio data
-	const uint8_t** input = (const uint8_t**) inFrame->data;
-	uint8_t** output = outFrame->data;
-	int inSamples = inFrame->nb_samples;
-	int outsamples = outFrame->nb_samples;
-	int dstSamples = av_rescale_rnd(swr_get_delay(stream->resampler, outFrame->sample_rate) + inSamples, outFrame->sample_rate, outFrame->sample_rate, AV_ROUND_UP);
-	int result = swr_convert(stream->resampler, output, dstSamples, input, inSamples);
+// Resizes the ring to hold `windowSize` seconds for the configured encoder.
+// As long as the encoder's sample layout didn't change, the newest samples are kept.
+// Otherwise the buffered audio can't be carried over and the ring starts out empty.
+// The capture has to be paused.
+int resize_audio_stream(AudioStream *audio, size_t windowSize) {
+	enum AVSampleFormat oldFormat = audio->sampleFormat;
+	int oldRate = audio->sampleRate;
+	AVChannelLayout oldLayout;
+	av_channel_layout_copy(&oldLayout, &audio->channelLayout);
+	int failed = 0;
+	if(probe_audio_layout(audio)) {
+		av_channel_layout_uninit(&oldLayout);
+		return 1;
+	}
+	audio->silenceLevel = configured_silence_level();
+	size_t oldSize = audio->bufferSize;
+	size_t newSize = audio->sampleRate * windowSize;
+	int relayout = oldFormat != audio->sampleFormat
+		|| oldRate != audio->sampleRate
+		|| oldLayout.nb_channels != audio->channelLayout.nb_channels;
+	if(newSize == 0) {
+		printf("[%s] Invalid window size, keeping the current ring\n", audio->device->name);
+		failed = 1;
+		goto restore;
+	}
+	if(!relayout && newSize == oldSize && oldSize == audio->capacity) {
+		av_channel_layout_uninit(&oldLayout);
+		return 0;
+	}
 
-	if (result < 0) {
-		return -1;
+	uint8_t **oldPlanes = audio->planes;
+	int oldPlaneCount = audio->planeCount;
+	size_t oldStride = audio->sampleStride;
+	size_t oldBytes = audio->capacity * audio->sampleStride;
+	size_t kept = 0;
+	set_ring_layout(audio);
+	uint8_t **planes = alloc_sample_planes(audio, newSize);
+	if(planes != NULL && relayout && (alloc_resample_frame(audio) || init_resampler(audio))) {
+		free_sample_planes(planes, audio->planeCount, newSize * audio->sampleStride);
+		planes = NULL;
+	}
+	if(planes == NULL) {
+		printf("[%s] Error resizing the ring, keeping the current one\n", audio->device->name);
+		audio->planeCount = oldPlaneCount;
+		audio->sampleStride = oldStride;
+		failed = 1;
+		goto restore;
+	}
+	av_channel_layout_uninit(&oldLayout);
+	if(!relayout) {
+		// Carry over the newest samples, oldest first
+		size_t valid = audio->sampleCount < oldSize ? audio->sampleCount : oldSize;
+		kept = valid < newSize ? valid : newSize;
+		read_samples(audio, planes, audio->sampleCount - kept, kept);
+	}
+	free_sample_planes(oldPlanes, oldPlaneCount, oldBytes);
+
+	audio->planes = planes;
+	audio->bufferSize = newSize;
+	audio->capacity = newSize;
+	restart_sample_count(audio, kept);
+
+	if(relayout) {
+		printf("[%s] Encoder sample layout changed, re-allocated ring with %zu samples\n", audio->device->name, newSize);
+	} else {
+		printf("[%s] Resized ring from %zu to %zu samples, kept %zu samples\n", audio->device->name, oldSize, newSize, kept);
 	}
 	return 0;
+
+restore:
+	// The ring stays in the layout its samples were written in
+	if(relayout) {
+		audio->sampleFormat = oldFormat;
+		audio->sampleRate = oldRate;
+		av_channel_layout_uninit(&audio->channelLayout);
+		av_channel_layout_copy(&audio->channelLayout, &oldLayout);
+		if(alloc_resample_frame(audio) || init_resampler(audio))
+			printf("[%s] Error restoring the conversion into the ring\n", audio->device->name);
+	}
+	av_channel_layout_uninit(&oldLayout);
+	return failed;
+}
+
+
+
+// Converts `count` samples from the device's format into the ring's, returns the number of samples converted
+static int resample(AudioStream *stream, const uint8_t *samples, int count, AVFrame* outFrame) {
+	return swr_convert(stream->resampler, outFrame->extended_data, outFrame->nb_samples, &samples, count);
+}
+
+
+// Peak levels of blocks of samples. Kept free of branches so the compiler vectorizes them.
+static int peak_s16(const int16_t *samples, size_t count) {
+	int peak = 0;
+	for(size_t i = 0; i < count; i++) {
+		int value = samples[i];
+		value = value < 0 ? -value : value;
+		peak = value > peak ? value : peak;
+	}
+	return peak;
+}
+
+static int64_t peak_s32(const int32_t *samples, size_t count) {
+	int64_t peak = 0;
+	for(size_t i = 0; i < count; i++) {
+		int64_t value = samples[i];
+		value = value < 0 ? -value : value;
+		peak = value > peak ? value : peak;
+	}
+	return peak;
+}
+
+static float peak_flt(const float *samples, size_t count) {
+	float peak = 0.0f;
+	for(size_t i = 0; i < count; i++) {
+		float value = fabsf(samples[i]);
+		peak = value > peak ? value : peak;
+	}
+	return peak;
+}
+
+static int peak_u8(const uint8_t *samples, size_t count) {
+	int peak = 0;
+	for(size_t i = 0; i < count; i++) {
+		int value = samples[i] - 128;
+		value = value < 0 ? -value : value;
+		peak = value > peak ? value : peak;
+	}
+	return peak;
 }
 
+// Peak level of a chunk as read from the device, relative to full scale
+static float peak_level(AudioDevice *device, const uint8_t *samples, size_t count) {
+	switch(device->sampleFormat) {
+		case AV_SAMPLE_FMT_S16:
+			return peak_s16((const int16_t*) samples, count) / 32768.0f;
+		case AV_SAMPLE_FMT_S32:
+			return peak_s32((const int32_t*) samples, count) / 2147483648.0f;
+		case AV_SAMPLE_FMT_U8:
+			return peak_u8(samples, count) / 128.0f;
+		default:
+			return peak_flt((const float*) samples, count);
+	}
+}
+
+// Returns whether every sample in the ring is silent
+int is_silent_stream(AudioStream *audio) {
+	size_t valid = audio->sampleCount < audio->bufferSize ? audio->sampleCount : audio->bufferSize;
+	return audio->lastSound <= audio->sampleCount - valid;
+}
 
-// Takes stream->codecContext->frame_size samples from the device and puts them into the writeIndex
-void audio_encode(AudioStream* stream) {
-	AVFrame* frame = stream->frameBuffer[stream->writeIndex];
+// Appends up to chunkSamples samples in the device's format to the ring.
+// Silent chunks are zeroed, the ring's pages are handed back once the silence covers them whole.
+static void store_chunk(AudioStream *stream, const uint8_t *samples, int count) {
+	float peak = peak_level(stream->device, samples, count * stream->device->channels);
+	if(peak <= stream->silenceLevel) {
+		// Silence is counted in the ring's rate
+		write_samples(stream, NULL, av_rescale(count, stream->sampleRate, stream->device->sampleRate));
+	} else if(stream->resampler == NULL) {
+		write_samples(stream, (uint8_t**) &samples, count);
+		stream->lastSound = stream->sampleCount;
+	} else {
+		uint64_t span = trace_begin();
+		int converted = resample(stream, samples, count, stream->convertFrame);
+		trace_end("resample", span);
+		if(converted > 0) {
+			write_samples(stream, stream->convertFrame->extended_data, converted);
+			stream->lastSound = stream->sampleCount;
+		}
+	}
+}
+
+// Reads a chunk of stream->chunkSamples samples from the device and appends it to the ring.
+// Returns 1 if the device can't be read anymore.
+int audio_encode(AudioStream* stream) {
+	// The ring and resample frame may be re-allocated while the capture is paused
+	if(!begin_ring_write(stream->root)) {
+		return 0;
+	}
 	AVFrame* resampleFrame = stream->resampleFrame;
 
 	// Read the samples from the device
@@ -186,172 +634,293 @@ void audio_encode(AudioStream* stream) {
 	//    sample-size * channels
 	// We have to get the sample size from the pulse audio device, thus; it's specification
 	
-	byteNum = stream->device->sampleSize * stream->device->channels * stream->numSamples;
+	byteNum = stream->device->sampleSize * stream->device->channels * stream->chunkSamples;
+	uint64_t span = trace_begin();
 	if(pa_simple_read(stream->device->handle, *resampleFrame->data, byteNum, &error) < 0) {
 		printf("Error reading from device %s: %s\n", stream->device->name, pa_strerror(error));
-		exit(1);
+		end_ring_write(stream->root);
+		return 1;
 	}
+	trace_end("pa_simple_read", span);
 
-	resample(stream, resampleFrame, frame);
-
-	stream->writeIndex = (stream->writeIndex + 1) % stream->bufferSize;
-	stream->frameCount++;
+	store_chunk(stream, resampleFrame->data[0], stream->chunkSamples);
+	end_ring_write(stream->root);
+	return 0;
 }
 
-void flush_audio_stream(AudioStream *audio) {
-	int start_index;
-	int encoding = 1;
-
-	if (audio->frameCount > audio->bufferSize) {
-		start_index = audio->writeIndex;
-	} else {
-		start_index = 0;
+// Appends samples pushed in by an embedding application, in the format the stream was opened with.
+// Returns 0 if they were stored, 1 if they were dropped because the capture is paused.
+// Only one thread may push into a stream at a time.
+int push_audio_samples(AudioStream *stream, const uint8_t *samples, int count) {
+	if(!begin_ring_write(stream->root))
+		return 1;
+	size_t frameSize = stream->device->sampleSize * stream->device->channels;
+	// Chunked like the samples read from Pulse, so silence is detected at the same granularity
+	for(int offset = 0; offset < count; offset += stream->chunkSamples) {
+		int chunk = count - offset < stream->chunkSamples ? count - offset : stream->chunkSamples;
+		store_chunk(stream, samples + offset * frameSize, chunk);
 	}
+	end_ring_write(stream->root);
+	return 0;
+}
 
-	int n = 0;
-	int ret;
+static int encode_audio_frame(AudioEncoder *encoder, AVFrame *frame) {
+	uint64_t span = trace_begin();
+	int ret = avcodec_send_frame(encoder->codecContext, frame);
+	trace_end("send_frame", span);
+	if (ret < 0) {
+		printf("Error sending frame for encoding\n");
+		return ret;
+	}
+	while (ret >= 0) {
+		span = trace_begin();
+		ret = avcodec_receive_packet(encoder->codecContext, encoder->packet);
+		trace_end("receive_packet", span);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+			return 0;
+		} else if (ret < 0) {
+			printf("Error during encoding\n");
+			return ret;
+		}
 
-	do {
-		printf("\r[%s] Frame #%i (%i)/%i (PTS:%i)", audio->device->name, start_index, n, audio->frameCount, audio->pts);
-		AVFrame *frame = audio->frameBuffer[start_index];
-		frame->pts = frame->pkt_dts = audio->pts;
-		audio->pts += frame->nb_samples;
+		av_packet_rescale_ts(encoder->packet, encoder->codecContext->time_base, encoder->stream->time_base);
+		encoder->packet->stream_index = encoder->stream->index;
+		// Write packet to file
+		span = trace_begin();
+		export_write_packet(encoder->rendition->writer, encoder->packet);
+		trace_end("write_packet", span);
+		av_packet_unref(encoder->packet);
+	}
+	return 0;
+}
 
-		ret = avcodec_send_frame(audio->codecContext, frame);
-		if (ret < 0) {
-			printf("Error sending frame for encoding\n");
-			return;
+// Encodes the paused ring of the encoder's stream into its rendition, returns the number of samples encoded.
+// The ring is sliced into frames of the encoder's size, the first `skip` seconds are left out
+// to line up with a video track that starts later. A negative `skip` is a video track starting earlier,
+// with its history, the samples are then shifted back by as much.
+int64_t flush_audio_encoder(AudioEncoder *encoder, double skip) {
+	AudioStream *audio = encoder->source;
+	AVFrame *frame = encoder->frame;
+	size_t valid = audio->sampleCount < audio->bufferSize ? audio->sampleCount : audio->bufferSize;
+	int64_t lead = skip < 0 ? lround(-skip * audio->sampleRate) : 0;
+	size_t skipped = skip > 0 ? lround(skip * audio->sampleRate) : 0;
+	if(skipped > valid)
+		skipped = valid;
+	size_t start = audio->sampleCount - valid + skipped;
+	size_t total = valid - skipped;
+	// Codecs with a fixed frame size only take a short frame at the end if they say so
+	int padLast = !(encoder->codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE));
+
+	size_t position = 0;
+	while (position < total) {
+		int samples = total - position < (size_t) encoder->frameSamples ? total - position : (size_t) encoder->frameSamples;
+		// The encoder may still hold a reference to the previous frame
+		frame->nb_samples = encoder->frameSamples;
+		if (av_frame_make_writable(frame) < 0) {
+			return position;
 		}
-		while (ret >= 0) {
-			ret = avcodec_receive_packet(audio->codecContext, audio->packet);
-		
-			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-				goto outer;
-			} else if (ret < 0) {
-				printf("Error during encoding\n");
-				return;
-			}
-
-			// Calculate packet duration
-			av_packet_rescale_ts(audio->packet, audio->codecContext->time_base, audio->stream->time_base);
-			audio->packet->stream_index = audio->stream->index;
-			// Write packet to file
-			av_interleaved_write_frame(audio->root->formatContext, audio->packet);
-			av_packet_unref(audio->packet);
+		read_samples(audio, frame->extended_data, start + position, samples);
+		if (samples < encoder->frameSamples && padLast)
+			av_samples_set_silence(frame->extended_data, samples, encoder->frameSamples - samples,
+					frame->ch_layout.nb_channels, frame->format);
+		else
+			frame->nb_samples = samples;
+		frame->pts = lead + position;
+		position += samples;
+
+		if (encode_audio_frame(encoder, frame) < 0) {
+			return position;
 		}
+	}
 
-outer:
-		++n;
-		if (n == audio->bufferSize) {
-			encoding = 0;
-		}
-		start_index = (start_index + 1) % audio->bufferSize;
-	}while (encoding);
+	// Drain the samples the encoder is still holding on to
+	encode_audio_frame(encoder, NULL);
+	return position;
 }
 
 
+// Stops the stream's thread and frees the stream along with its device.
+// The capture has to be paused, so the thread isn't reading from the device.
 void free_audio_stream(AudioStream *audio) {
-	if(audio->resampler != NULL)
-		swr_free(&audio->resampler);
-	avcodec_free_context(&audio->codecContext);
-	av_packet_free(&audio->packet);
-	for(int i = 0; i < audio->bufferSize; i++) {
-		av_frame_free(&audio->frameBuffer[i]);
+	// Streams fed by an embedding application have no device and no thread reading from it
+	if(audio->device->handle != NULL) {
+		pthread_cancel(audio->thread);
+		pthread_join(audio->thread, NULL);
 	}
-	free(audio->frameBuffer);
-	free(audio);
+	free_audio_device(audio->device);
+	free_stream_buffers(audio);
 }
 
-// This function resets given stream by reallocating the
-// AVCodecContext and AVCodec
-int open_audio_stream(Capture *cap, AudioStream* audioStream) {
-	if(audioStream->codecContext != NULL)
-		avcodec_free_context(&audioStream->codecContext);
+// Frees a device returned by init_pulse() that no stream took over
+void free_audio_device(AudioDevice *device) {
+	if(device->handle != NULL)
+		pa_simple_free(device->handle);
+	free(device->name);
+	free(device->pulseName);
+	free(device);
+}
 
-	// Allocate the codec context
-	audioStream->codecContext = avcodec_alloc_context3(audioStream->codec);
-	if(!audioStream->codecContext) {
-		fprintf(stderr, "Could not allocate audio codec context\n");
-		return 1;
+// The encoder's sample format closest to the device's: the same one, the same one in planes, or the codec's default.
+// Anything but the first needs converting while capturing.
+static enum AVSampleFormat encoder_sample_format(const AVCodec *codec, enum AVSampleFormat native) {
+	if(!codec->sample_fmts)
+		return native;
+	enum AVSampleFormat planar = av_get_planar_sample_fmt(native);
+	for(const enum AVSampleFormat *format = codec->sample_fmts; *format != AV_SAMPLE_FMT_NONE; format++) {
+		if(*format == native)
+			return native;
 	}
-
-	// TODO: Don't pull the codec name from the config, save in AudioStream
-	audioStream->codec = avcodec_find_encoder_by_name(cfg_getstr(C_AUDIO_ROOT, "codec"));
-	if(!audioStream->codec) {
-		fprintf(stderr, "Could not find audio codec\n");
-		return 1;
-	}
-
-	audioStream->stream = avformat_new_stream(cap->formatContext, NULL);
-	if(!audioStream->stream) {
-		fprintf(stderr, "Error allocating audio stream\n");
-		return 1;
+	for(const enum AVSampleFormat *format = codec->sample_fmts; *format != AV_SAMPLE_FMT_NONE; format++) {
+		if(*format == planar)
+			return planar;
 	}
+	return codec->sample_fmts[0];
+}
 
-	audioStream->stream->index = cap->formatContext->nb_streams - 1;
-	audioStream->stream->time_base = (AVRational) { 1, audioStream->device->sampleRate };
-	if(audioStream->packet){
-		audioStream->packet->stream_index = audioStream->stream->index;
-		audioStream->packet->pts = 0;
-		audioStream->packet->dts = 0;
-		audioStream->packet->duration = 0;
+// The device's rate if the encoder supports it, the closest one it does otherwise
+static int encoder_sample_rate(const AVCodec *codec, int native) {
+	if(!codec->supported_samplerates)
+		return native;
+	int closest = 0;
+	for(const int *rate = codec->supported_samplerates; *rate != 0; rate++) {
+		if(*rate == native)
+			return native;
+		if(closest == 0 || abs(*rate - native) < abs(closest - native))
+			closest = *rate;
 	}
-	audioStream->pts = 0;
+	return closest;
+}
 
-	// Allocate codecContext
-	audioStream->codecContext = avcodec_alloc_context3(audioStream->codec);
-	if(!audioStream->codecContext) {
+// Allocates and opens an encoder for the device's samples
+static AVCodecContext *open_audio_codec(const AVCodec *codec, AudioDevice *device, int64_t bitrate, int flags) {
+	AVCodecContext *codecContext = avcodec_alloc_context3(codec);
+	if(!codecContext) {
 		fprintf(stderr, "Could not allocate audio codec context\n");
-		return 1;
+		return NULL;
 	}
 
 	// Set codec parameters
-	
-	
-	audioStream->codecContext->sample_fmt = audioStream->codec->sample_fmts ? audioStream->codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
-	audioStream->codecContext->bit_rate = 64000;
-	audioStream->codecContext->sample_rate = audioStream->device->sampleRate;
+	codecContext->sample_fmt = encoder_sample_format(codec, device->sampleFormat);
+	codecContext->bit_rate = bitrate;
+	codecContext->sample_rate = encoder_sample_rate(codec, device->sampleRate);
+	codecContext->flags |= flags;
+	av_channel_layout_default(&codecContext->ch_layout, device->channels);
 
+	// Open the codec
+	if(avcodec_open2(codecContext, codec, NULL) < 0) {
+		fprintf(stderr, "Could not open audio codec\n");
+		avcodec_free_context(&codecContext);
+		return NULL;
+	}
+	return codecContext;
+}
 
+// Number of samples handed to the encoder at once, codecs that take any size get 4096 at a time
+static int encoder_frame_samples(AVCodecContext *codecContext) {
+	if ((codecContext->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) || codecContext->frame_size <= 0)
+		return 4096;
+	return codecContext->frame_size;
+}
 
-	switch(audioStream->device->channels) {
-		case 1: // MONO
-			av_channel_layout_copy(&audioStream->codecContext->ch_layout, &(AVChannelLayout) AV_CHANNEL_LAYOUT_MONO);
-			break;
-		case 2: // STEREO
-			av_channel_layout_copy(&audioStream->codecContext->ch_layout, &(AVChannelLayout) AV_CHANNEL_LAYOUT_STEREO);
-			break;
-		default:
-			printf("Unsupported number of channels: %i on device %s\n", audioStream->device->channels, audioStream->device->name);
-			return 1;
+// Returns the bytes one second of the ring takes up for `device` with the configured codec
+size_t audio_bytes_per_second(AudioDevice *device) {
+	const AVCodec *codec = avcodec_find_encoder_by_name(cfg_getstr(C_AUDIO_ROOT, "codec"));
+	if(!codec) {
+		fprintf(stderr, "Could not find audio codec\n");
+		return 0;
+	}
+	AVCodecContext *codecContext = open_audio_codec(codec, device, cfg_getint(C_AUDIO_ROOT, "bitrate"), 0);
+	if(!codecContext) {
+		return 0;
 	}
+	size_t size = (size_t) codecContext->sample_rate * codecContext->ch_layout.nb_channels * av_get_bytes_per_sample(codecContext->sample_fmt);
+	avcodec_free_context(&codecContext);
+	return size;
+}
 
+// Opens a throwaway encoder with the configured codec to find out
+// the layout the ring has to be stored in.
+static int probe_audio_layout(AudioStream *audioStream) {
+	const AVCodec *codec = avcodec_find_encoder_by_name(cfg_getstr(C_AUDIO_ROOT, "codec"));
+	if(!codec) {
+		fprintf(stderr, "Could not find audio codec\n");
+		return 1;
+	}
+	AVCodecContext *codecContext = open_audio_codec(codec, audioStream->device, cfg_getint(C_AUDIO_ROOT, "bitrate"), 0);
+	if(!codecContext) {
+		return 1;
+	}
+	audioStream->sampleFormat = codecContext->sample_fmt;
+	audioStream->sampleRate = codecContext->sample_rate;
+	av_channel_layout_uninit(&audioStream->channelLayout);
+	av_channel_layout_copy(&audioStream->channelLayout, &codecContext->ch_layout);
+	avcodec_free_context(&codecContext);
+	return 0;
+}
 
-	AVCodecParameters *codecParams = audioStream->stream->codecpar;
-	codecParams->codec_type = AVMEDIA_TYPE_AUDIO;
-	codecParams->codec_id = audioStream->codec->id;
-	codecParams->bit_rate = audioStream->codecContext->bit_rate;
-	codecParams->sample_rate = audioStream->codecContext->sample_rate;
-	av_channel_layout_copy(&codecParams->ch_layout, &audioStream->codecContext->ch_layout);
+// Opens an encoder for `audio` with the rendition's settings and adds a track for it to the rendition's output
+AudioEncoder *open_audio_encoder(Rendition *rendition, AudioStream *audio) {
+	AudioEncoder *encoder = malloc(sizeof(AudioEncoder));
+	memset(encoder, 0, sizeof(AudioEncoder));
+	encoder->source = audio;
+	encoder->rendition = rendition;
 
+	// TODO: Don't pull the codec name from the config, save in AudioStream
+	encoder->codec = avcodec_find_encoder_by_name(cfg_getstr(C_AUDIO_ROOT, "codec"));
+	if(!encoder->codec) {
+		fprintf(stderr, "Could not find audio codec\n");
+		goto fail;
+	}
 
-	// Open the codec
-	if(avcodec_open2(audioStream->codecContext, audioStream->codec, NULL) < 0) {
-		fprintf(stderr, "Could not open audio codec\n");
-		return 1;
+	encoder->packet = av_packet_alloc();
+	if(!encoder->packet) {
+		printf("Error allocating packet\n");
+		goto fail;
 	}
 
-	int *numSamples = &audioStream->numSamples;
-	if (audioStream->codecContext->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
-		*numSamples = 10000;
-	else
-		*numSamples = audioStream->codecContext->frame_size;
+	int flags = rendition->formatContext->oformat->flags & AVFMT_GLOBALHEADER ? AV_CODEC_FLAG_GLOBAL_HEADER : 0;
+	encoder->codecContext = open_audio_codec(encoder->codec, audio->device, rendition->audioBitrate, flags);
+	if(!encoder->codecContext) {
+		goto fail;
+	}
 
+	// The ring is copied into this frame a slice at a time
+	encoder->frameSamples = encoder_frame_samples(encoder->codecContext);
+	encoder->frame = alloc_audio_frame(audio, encoder->frameSamples);
+	if(!encoder->frame) {
+		printf("Error allocating frame\n");
+		goto fail;
+	}
 
-	if(avcodec_parameters_from_context(codecParams, audioStream->codecContext) < 0) {
-		fprintf(stderr, "Could not copy the stream parameters\n");
-		return 1;
+	return encoder;
+
+fail:
+	free_audio_encoder(encoder);
+	return NULL;
+}
+
+// Adds the encoder's track to the rendition's output, which has to happen before the header is written.
+// Tracks are only added once it's known whether they're exported at all.
+int add_audio_track(AudioEncoder *encoder) {
+	AVFormatContext *formatContext = encoder->rendition->formatContext;
+	encoder->stream = avformat_new_stream(formatContext, NULL);
+	if(!encoder->stream) {
+		fprintf(stderr, "Error allocating audio stream\n");
+		return -1;
 	}
+	encoder->stream->id = formatContext->nb_streams - 1;
+	encoder->stream->time_base = (AVRational) { 1, encoder->source->sampleRate };
 
+	if(avcodec_parameters_from_context(encoder->stream->codecpar, encoder->codecContext) < 0) {
+		fprintf(stderr, "Could not copy the stream parameters\n");
+		return -1;
+	}
 	return 0;
 }
+
+void free_audio_encoder(AudioEncoder *encoder) {
+	avcodec_free_context(&encoder->codecContext);
+	av_packet_free(&encoder->packet);
+	av_frame_free(&encoder->frame);
+	free(encoder);
+}
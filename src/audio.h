@@ -11,9 +11,11 @@ typedef struct AudioDevice {
 	char* name;
 	char* pulseName;
 	int num;
+	// Native layout of the source, as it's read
 	unsigned int sampleRate;
 	unsigned int channels;
 	unsigned int sampleSize;
+	enum AVSampleFormat sampleFormat;
 	pa_simple *handle;
 	pa_sample_spec sampleSpec;
 	pa_buffer_attr *bufferAttr;
@@ -21,14 +23,35 @@ typedef struct AudioDevice {
 
 extern pa_sample_spec G_SAMPLE_SPEC;
 
+// Encodes an AudioStream's ring into one rendition
+typedef struct AudioEncoder {
+	AudioStream *source;
+	struct Rendition *rendition;
+
+	AVCodecContext *codecContext;
+	const AVCodec *codec;
+	AVStream *stream;
+	AVPacket *packet;
+	AVFrame *frame;
+	int frameSamples; // Samples per frame handed to the encoder
+} AudioEncoder;
+
 
 extern AudioDevice** init_pulse(size_t*);
 extern AudioStream* alloc_audio_stream(Capture*, AudioDevice*);
-extern void flush_audio_stream(AudioStream*);
+extern AudioStream *injected_audio(Capture*, const char*, enum AVSampleFormat, int, int);
+extern int push_audio_samples(AudioStream*, const uint8_t*, int);
 extern void free_audio_stream(AudioStream*);
-// TODO: Same as video.c, this function name is misleading
-extern int open_audio_stream(Capture*, AudioStream*);
+extern void free_audio_device(AudioDevice*);
+extern AudioEncoder *open_audio_encoder(struct Rendition*, AudioStream*);
+extern int add_audio_track(AudioEncoder*);
+extern int64_t flush_audio_encoder(AudioEncoder*, double);
+extern void free_audio_encoder(AudioEncoder*);
+extern int resize_audio_stream(AudioStream*, size_t);
+extern void resize_sample_ring(AudioStream*, size_t);
+extern size_t audio_bytes_per_second(AudioDevice*);
+extern int is_silent_stream(AudioStream*);
 extern void free_pulse();
-extern void audio_encode(AudioStream*);
+extern int audio_encode(AudioStream*);
 
 #endif
@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include "dump.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+static const uint8_t ZEROES[DUMP_ALIGNMENT];
+
+// Collects the pieces of a dump straight from the rings and writes them with as few writev() calls as possible.
+// Queued memory has to stay valid until the batch is flushed.
+typedef struct DumpBatch {
+	int fd;
+	struct iovec vectors[IOV_MAX];
+	int count;
+	uint64_t offset; // Bytes queued so far
+	int error;
+} DumpBatch;
+
+static void flush_batch(DumpBatch *batch) {
+	int first = 0;
+	while(first < batch->count && !batch->error) {
+		ssize_t written = writev(batch->fd, batch->vectors + first, batch->count - first);
+		if(written < 0) {
+			if(errno == EINTR)
+				continue;
+			batch->error = errno;
+			break;
+		}
+		// A short write can end in the middle of a vector
+		while(first < batch->count && (size_t) written >= batch->vectors[first].iov_len) {
+			written -= batch->vectors[first].iov_len;
+			first++;
+		}
+		if(first < batch->count) {
+			batch->vectors[first].iov_base = (uint8_t*) batch->vectors[first].iov_base + written;
+			batch->vectors[first].iov_len -= written;
+		}
+	}
+	batch->count = 0;
+}
+
+static void queue_bytes(DumpBatch *batch, const void *data, size_t size) {
+	if(size == 0)
+		return;
+	if(batch->count == IOV_MAX)
+		flush_batch(batch);
+	batch->vectors[batch->count++] = (struct iovec) { (void*) data, size };
+	batch->offset += size;
+}
+
+static uint64_t align(uint64_t offset) {
+	return (offset + DUMP_ALIGNMENT - 1) / DUMP_ALIGNMENT * DUMP_ALIGNMENT;
+}
+
+static void queue_padding(DumpBatch *batch) {
+	queue_bytes(batch, ZEROES, align(batch->offset) - batch->offset);
+}
+
+// Writes the paused rings to `dump-<date>.spd` in the export directory, without encoding anything.
+// Returns 0 on success.
+int dump_capture(Capture *cap, time_t timestamp) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	DumpHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+	header.version = DUMP_VERSION;
+	header.videoStreams = cap->nb_video_streams;
+	header.audioStreams = cap->nb_audio_streams;
+	header.timestamp = timestamp;
+	DumpVideo *videos = calloc(cap->nb_video_streams, sizeof(DumpVideo));
+	DumpAudio *audios = calloc(cap->nb_audio_streams, sizeof(DumpAudio));
+	int64_t **indices = calloc(cap->nb_video_streams, sizeof(int64_t*));
+
+	// Lay out the file first, so it can be allocated in one go
+	uint64_t offset = align(sizeof(DumpHeader) + sizeof(DumpVideo) * cap->nb_video_streams + sizeof(DumpAudio) * cap->nb_audio_streams);
+	int i;
+	for(i = 0; i < cap->nb_video_streams; i++) {
+		VideoStream *video = cap->video_streams[i];
+		DumpVideo *dumped = &videos[i];
+		size_t valid = video->frameCount < video->bufferSize ? video->frameCount : video->bufferSize;
+		size_t first = video->frameCount - valid;
+		AVFrame *frame = video->frameBuffer[0];
+		dumped->width = video->frameWidth;
+		dumped->height = video->frameHeight;
+		dumped->framerate = video->orchestrator->framerate;
+		dumped->frames = valid;
+		dumped->flags = video->orchestrator->feeder != NULL ? DUMP_VIDEO_CROP : 0;
+		dumped->pixelFormat = video->format;
+		for(int p = 0; p < 3; p++) {
+			dumped->linesize[p] = frame->linesize[p];
+			dumped->frameSize += (uint64_t) frame->linesize[p] * video_plane_height(video->format, dumped->height, p);
+		}
+		indices[i] = malloc(sizeof(int64_t) * (valid + 1));
+		for(size_t j = 0; j < valid; j++) {
+			indices[i][j] = video_frame_time(video, first + j);
+		}
+		dumped->indexOffset = offset;
+		offset = align(offset + sizeof(int64_t) * valid);
+		dumped->dataOffset = offset;
+		offset = align(offset + dumped->frameSize * valid);
+	}
+	for(i = 0; i < cap->nb_audio_streams; i++) {
+		AudioStream *audio = cap->audio_streams[i];
+		DumpAudio *dumped = &audios[i];
+		size_t valid = audio->sampleCount < audio->bufferSize ? audio->sampleCount : audio->bufferSize;
+		strncpy(dumped->name, audio->device->name, sizeof(dumped->name) - 1);
+		dumped->sampleFormat = audio->sampleFormat;
+		dumped->sampleRate = audio->sampleRate;
+		dumped->channels = audio->channelLayout.nb_channels;
+		dumped->silent = is_silent_stream(audio);
+		dumped->samples = valid;
+		dumped->planeSize = valid * audio->sampleStride;
+		dumped->dataOffset = offset;
+		offset += align(dumped->planeSize) * audio->planeCount;
+	}
+
+	char date[64];
+	strftime(date, sizeof(date), "%FT%T", localtime(&timestamp));
+	const char *directory = cfg_getstr(C_EXPORT_ROOT, "directory");
+	char *file = malloc(strlen(directory) + strlen(date) + sizeof("/dump-.spd.part"));
+	sprintf(file, "%s/dump-%s.spd.part", directory, date);
+
+	DumpBatch *batch = malloc(sizeof(DumpBatch));
+	memset(batch, 0, sizeof(DumpBatch));
+	batch->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(batch->fd < 0) {
+		printf("[DUMP] Error opening %s: %s\n", file, strerror(errno));
+		batch->error = errno;
+		goto end;
+	}
+	// The size is known exactly, the extents are allocated before anything is written
+	if(fallocate(batch->fd, 0, 0, offset) < 0 && errno != EOPNOTSUPP) {
+		printf("[DUMP] Error allocating %lu MiB for %s: %s\n", offset / (1024 * 1024), file, strerror(errno));
+		batch->error = errno;
+		goto end;
+	}
+
+	queue_bytes(batch, &header, sizeof(header));
+	queue_bytes(batch, videos, sizeof(DumpVideo) * cap->nb_video_streams);
+	queue_bytes(batch, audios, sizeof(DumpAudio) * cap->nb_audio_streams);
+	queue_padding(batch);
+	for(i = 0; i < cap->nb_video_streams; i++) {
+		VideoStream *video = cap->video_streams[i];
+		size_t first = video->frameCount - videos[i].frames;
+		queue_bytes(batch, indices[i], sizeof(int64_t) * videos[i].frames);
+		queue_padding(batch);
+		for(size_t j = 0; j < videos[i].frames; j++) {
+			AVFrame *frame = video->frameBuffer[(first + j) % video->bufferSize];
+			for(int p = 0; p < 3; p++) {
+				queue_bytes(batch, frame->data[p], (size_t) frame->linesize[p] * video_plane_height(video->format, frame->height, p));
+			}
+		}
+		queue_padding(batch);
+	}
+	for(i = 0; i < cap->nb_audio_streams; i++) {
+		AudioStream *audio = cap->audio_streams[i];
+		size_t samples = audios[i].samples;
+		size_t oldest = (audio->sampleCount - samples) % audio->bufferSize;
+		size_t head = samples < audio->bufferSize - oldest ? samples : audio->bufferSize - oldest;
+		// Oldest samples first, the ring wraps around at most once
+		for(int p = 0; p < audio->planeCount; p++) {
+			queue_bytes(batch, audio->planes[p] + oldest * audio->sampleStride, head * audio->sampleStride);
+			queue_bytes(batch, audio->planes[p], (samples - head) * audio->sampleStride);
+			queue_padding(batch);
+		}
+	}
+	flush_batch(batch);
+
+end:
+	if(batch->fd >= 0 && close(batch->fd) < 0 && !batch->error)
+		batch->error = errno;
+	int ret = 1;
+	if(batch->error) {
+		printf("[DUMP] Error writing %s: %s\n", file, strerror(batch->error));
+	} else {
+		char *final = strndup(file, strlen(file) - strlen(".part"));
+		if(rename(file, final) < 0) {
+			printf("[DUMP] Error moving %s into place: %s\n", file, strerror(errno));
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			double elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+			printf("[DUMP] Wrote %s, %lu MiB in %.0f ms (%.0f MiB/s)\n", final, offset / (1024 * 1024), elapsed,
+					offset / (1024.0 * 1024.0) / (elapsed / 1000.0));
+			ret = 0;
+		}
+		free(final);
+	}
+	for(i = 0; i < cap->nb_video_streams; i++) {
+		free(indices[i]);
+	}
+	free(indices);
+	free(videos);
+	free(audios);
+	free(batch);
+	free(file);
+	return ret;
+}
+
+// Rebuilds a video ring from the dump, its frames point straight into the mapped file
+static VideoStream *dumped_video(Capture *cap, const DumpVideo *dumped, uint8_t *data) {
+	VideoStream *video = malloc(sizeof(VideoStream));
+	memset(video, 0, sizeof(VideoStream));
+	video->root = cap;
+	video->frameWidth = video->sourceWidth = dumped->width;
+	video->frameHeight = video->sourceHeight = dumped->height;
+	video->format = dumped->pixelFormat;
+	video->bufferSize = video->capacity = dumped->frames;
+	video->frameCount = dumped->frames;
+	video->startTime = ((const int64_t*) (data + dumped->indexOffset))[0];
+	video->frameBuffer = malloc(sizeof(AVFrame*) * dumped->frames);
+	for(uint32_t j = 0; j < dumped->frames; j++) {
+		AVFrame *frame = av_frame_alloc();
+		frame->format = dumped->pixelFormat;
+		frame->width = dumped->width;
+		frame->height = dumped->height;
+		uint8_t *plane = data + dumped->dataOffset + j * dumped->frameSize;
+		// Semi-planar formats have fewer planes, their line size is 0
+		for(int p = 0; p < 3 && dumped->linesize[p] > 0; p++) {
+			frame->data[p] = plane;
+			frame->linesize[p] = dumped->linesize[p];
+			plane += (size_t) dumped->linesize[p] * video_plane_height(dumped->pixelFormat, dumped->height, p);
+		}
+		video->frameBuffer[j] = frame;
+	}
+	VideoThreadOrchestrator *orch = malloc(sizeof(VideoThreadOrchestrator));
+	memset(orch, 0, sizeof(VideoThreadOrchestrator));
+	orch->framerate = dumped->framerate;
+	orch->stream = video;
+	video->orchestrator = orch;
+	return video;
+}
+
+// Rebuilds an audio ring from the dump, every plane is mapped from the file on its own like the ring's planes are
+static AudioStream *dumped_audio(Capture *cap, const DumpAudio *dumped, int fd) {
+	AudioStream *audio = malloc(sizeof(AudioStream));
+	memset(audio, 0, sizeof(AudioStream));
+	audio->root = cap;
+	AudioDevice *device = malloc(sizeof(AudioDevice));
+	memset(device, 0, sizeof(AudioDevice));
+	device->name = strndup(dumped->name, sizeof(dumped->name));
+	device->pulseName = strdup("");
+	device->num = cap->nb_audio_streams;
+	// The encoders are opened for the ring's layout
+	device->sampleFormat = dumped->sampleFormat;
+	device->sampleRate = dumped->sampleRate;
+	device->channels = dumped->channels;
+	device->sampleSize = av_get_bytes_per_sample(dumped->sampleFormat);
+	audio->device = device;
+
+	audio->sampleFormat = dumped->sampleFormat;
+	audio->sampleRate = dumped->sampleRate;
+	av_channel_layout_default(&audio->channelLayout, dumped->channels);
+	int planar = av_sample_fmt_is_planar(audio->sampleFormat);
+	audio->planeCount = planar ? dumped->channels : 1;
+	audio->sampleStride = device->sampleSize * (planar ? 1 : dumped->channels);
+	audio->bufferSize = audio->capacity = dumped->samples;
+	audio->sampleCount = dumped->samples;
+	audio->lastSound = dumped->silent ? 0 : dumped->samples;
+	audio->planes = calloc(audio->planeCount, sizeof(uint8_t*));
+	for(int p = 0; p < audio->planeCount; p++) {
+		audio->planes[p] = mmap(NULL, dumped->planeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, dumped->dataOffset + p * align(dumped->planeSize));
+		if(audio->planes[p] == MAP_FAILED) {
+			printf("[DUMP] Error mapping %s: %s\n", device->name, strerror(errno));
+			audio->planes[p] = NULL;
+			free_audio_stream(audio);
+			return NULL;
+		}
+	}
+	return audio;
+}
+
+// Encodes a dump written by dump_capture() into the outputs set in the config, as a save would have.
+// Returns the number of outputs that failed, or 1 if the dump can't be read.
+int transcode_dump(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat info;
+	if(fd < 0 || fstat(fd, &info) < 0) {
+		printf("[DUMP] Error opening %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	size_t size = info.st_size;
+	uint8_t *data = size >= sizeof(DumpHeader) ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	const DumpHeader *header = (const DumpHeader*) data;
+	if(data == MAP_FAILED || memcmp(header->magic, DUMP_MAGIC, sizeof(header->magic)) != 0 || header->version != DUMP_VERSION
+			|| sizeof(DumpHeader) + sizeof(DumpVideo) * header->videoStreams + sizeof(DumpAudio) * header->audioStreams > size) {
+		printf("[DUMP] %s isn't a dump this version of Spotlight can read\n", path);
+		if(data != MAP_FAILED)
+			munmap(data, size);
+		close(fd);
+		return 1;
+	}
+	const DumpVideo *videos = (const DumpVideo*) (data + sizeof(DumpHeader));
+	const DumpAudio *audios = (const DumpAudio*) (videos + header->videoStreams);
+
+	// Everything mapped has to lie within the file, reading past its end would raise SIGBUS
+	int failed = 1;
+	Capture *cap = alloc_capture();
+	cap->pause = 1;
+	uint32_t i;
+	for(i = 0; i < header->videoStreams; i++) {
+		const DumpVideo *dumped = &videos[i];
+		if(dumped->frames == 0 || dumped->frameSize == 0
+				|| dumped->dataOffset > size || dumped->frames > (size - dumped->dataOffset) / dumped->frameSize
+				|| dumped->indexOffset > size || dumped->frames > (size - dumped->indexOffset) / sizeof(int64_t)) {
+			printf("[DUMP] Video stream %u of %s is truncated\n", i, path);
+			goto end;
+		}
+		if(!ring_format_supported(dumped->pixelFormat)) {
+			printf("[DUMP] Video stream %u of %s is in an unknown pixel format\n", i, path);
+			goto end;
+		}
+		cap->pixelFormat = videos[i].pixelFormat;
+		VideoStream *video = dumped_video(cap, &videos[i], data);
+		// Crops keep their size in every rendition
+		if((videos[i].flags & DUMP_VIDEO_CROP) && cap->nb_video_streams > 0)
+			video->orchestrator->feeder = cap->video_streams[cap->nb_video_streams - 1]->orchestrator;
+		add_video_stream(cap, video);
+	}
+	for(i = 0; i < header->audioStreams; i++) {
+		const DumpAudio *dumped = &audios[i];
+		if(dumped->samples == 0)
+			continue;
+		int sampleSize = av_get_bytes_per_sample(dumped->sampleFormat);
+		if(sampleSize <= 0 || dumped->channels == 0 || dumped->channels > AV_NUM_DATA_POINTERS) {
+			printf("[DUMP] Audio stream %u of %s is in an unknown sample format\n", i, path);
+			goto end;
+		}
+		uint64_t planeCount = av_sample_fmt_is_planar(dumped->sampleFormat) ? dumped->channels : 1;
+		uint64_t planeStride = align(dumped->planeSize);
+		if(dumped->planeSize / sampleSize / (dumped->channels / planeCount) < dumped->samples
+				|| dumped->dataOffset > size || planeCount > (size - dumped->dataOffset) / planeStride) {
+			printf("[DUMP] Audio stream %u of %s is truncated\n", i, path);
+			goto end;
+		}
+		AudioStream *audio = dumped_audio(cap, dumped, fd);
+		if(audio == NULL)
+			goto end;
+		add_audio_stream(cap, audio);
+	}
+	if(cap->nb_video_streams > 0) {
+		cap->framerate = videos[0].framerate;
+		cap->windowSize = cap->activeWindow = videos[0].frames / videos[0].framerate;
+	}
+
+	// The dump is encoded in one go, into files instead of another dump
+	cfg_setbool(C_EXPORT_ROOT, "pre-encode", cfg_false);
+	cfg_setbool(C_EXPORT_ROOT, "process", cfg_false);
+	cfg_setbool(C_EXPORT_ROOT, "dump", cfg_false);
+	if(reopen_capture_output(cap))
+		goto end;
+
+	// The ring is handed to the audio encoders as is, which only works with the codec it was captured for
+	failed = 0;
+	for(int r = 0; r < cap->nb_renditions; r++) {
+		Rendition *rendition = cap->renditions[r];
+		for(int a = 0; a < rendition->nb_audio_encoders; a++) {
+			AudioEncoder *encoder = rendition->audio_encoders[a];
+			AudioStream *audio = encoder->source;
+			if(encoder->codecContext->sample_fmt != audio->sampleFormat || encoder->codecContext->sample_rate != audio->sampleRate) {
+				printf("[DUMP] %s was captured as %s at %d Hz, which %s doesn't take, transcode it with the audio codec it was captured for\n",
+						audio->device->name, av_get_sample_fmt_name(audio->sampleFormat), audio->sampleRate, encoder->codec->name);
+				failed = 1;
+			}
+		}
+	}
+	if(!failed) {
+		printf("[DUMP] Transcoding %s\n", path);
+		failed = flush_capture(cap, header->timestamp);
+	}
+
+end:
+	pause_capture(cap);
+	free_capture(cap);
+	munmap(data, size);
+	close(fd);
+	return failed;
+}
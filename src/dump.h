@@ -0,0 +1,58 @@
+#ifndef DUMP_H_
+#define DUMP_H_
+
+#include <stdint.h>
+
+#include "spotlight.h"
+
+// Raw dump of the rings, written instead of encoding when `dump = true` in the export section,
+// and encoded later with `spotlight --transcode <dump>`. Native byte order, it's meant to be read on the same kind of machine.
+//
+// A DumpHeader, a DumpVideo for every video stream and a DumpAudio for every audio stream come first.
+// Every video stream's index (the capture time of each frame in microseconds, as int64_t) and data
+// (each frame's planes back to back, in the ring's pixel format and line sizes), and every audio plane
+// start on a multiple of DUMP_ALIGNMENT, so they can be mapped straight from the file.
+#define DUMP_MAGIC "SPOTDUMP"
+#define DUMP_VERSION 2
+#define DUMP_ALIGNMENT 4096
+
+// DumpVideo flags
+#define DUMP_VIDEO_CROP 1 // Focus crop of the video stream before it
+
+typedef struct DumpHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t videoStreams;
+	uint32_t audioStreams;
+	uint32_t reserved;
+	int64_t timestamp; // Time of the save, the transcoded files are named after it
+} DumpHeader;
+
+typedef struct DumpVideo {
+	uint32_t width, height;
+	uint32_t framerate;
+	uint32_t frames;
+	int32_t linesize[3];
+	uint32_t flags;
+	int32_t pixelFormat; // The ring's AVPixelFormat
+	uint32_t reserved;
+	uint64_t frameSize; // Bytes of one frame
+	uint64_t indexOffset; // From the start of the file
+	uint64_t dataOffset;
+} DumpVideo;
+
+typedef struct DumpAudio {
+	char name[64];
+	int32_t sampleFormat; // The ring's AVSampleFormat, the audio codec's at the time of the save
+	uint32_t sampleRate;
+	uint32_t channels;
+	uint32_t silent; // Nothing but silence, tracks like this can be left out
+	uint64_t samples;
+	uint64_t planeSize; // Bytes of the samples in one plane, planes are padded to DUMP_ALIGNMENT
+	uint64_t dataOffset;
+} DumpAudio;
+
+int dump_capture(Capture*, time_t);
+int transcode_dump(const char*);
+
+#endif
@@ -0,0 +1,706 @@
+#define _GNU_SOURCE
+#include "export.h"
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <libavutil/avstring.h>
+
+static void *export_writer_thread(void*);
+
+
+int init_packet_queue(PacketQueue *queue, size_t capacity) {
+	queue->packets = malloc(sizeof(AVPacket*) * capacity);
+	if(queue->packets == NULL) {
+		return 1;
+	}
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->notEmpty, NULL);
+	pthread_cond_init(&queue->notFull, NULL);
+	return 0;
+}
+
+void free_packet_queue(PacketQueue *queue) {
+	// Drop whatever hasn't been consumed
+	for(size_t i = 0; i < queue->count; i++) {
+		AVPacket *packet = queue->packets[(queue->head + i) % queue->capacity];
+		av_packet_free(&packet);
+	}
+	free(queue->packets);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->notEmpty);
+	pthread_cond_destroy(&queue->notFull);
+}
+
+void packet_queue_push(PacketQueue *queue, AVPacket *packet) {
+	pthread_mutex_lock(&queue->lock);
+	// Block the encoder while the disk is behind, this keeps the
+	// amount of packets held in memory bounded.
+	while(queue->count == queue->capacity)
+		pthread_cond_wait(&queue->notFull, &queue->lock);
+	queue->packets[(queue->head + queue->count) % queue->capacity] = packet;
+	queue->count++;
+	pthread_cond_signal(&queue->notEmpty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+// Waits for the next packet without taking it off the queue
+AVPacket *packet_queue_peek(PacketQueue *queue) {
+	pthread_mutex_lock(&queue->lock);
+	while(queue->count == 0)
+		pthread_cond_wait(&queue->notEmpty, &queue->lock);
+	AVPacket *packet = queue->packets[queue->head];
+	pthread_mutex_unlock(&queue->lock);
+	return packet;
+}
+
+AVPacket *packet_queue_pop(PacketQueue *queue) {
+	pthread_mutex_lock(&queue->lock);
+	while(queue->count == 0)
+		pthread_cond_wait(&queue->notEmpty, &queue->lock);
+	AVPacket *packet = queue->packets[queue->head];
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+	pthread_cond_signal(&queue->notFull);
+	pthread_mutex_unlock(&queue->lock);
+	return packet;
+}
+
+
+static int write_output(void *opaque, const uint8_t *buf, int size) {
+	ExportWriter *writer = opaque;
+	int remaining = size;
+	while(remaining > 0) {
+		ssize_t written = write(writer->fd, buf, remaining);
+		if(written < 0) {
+			if(errno == EINTR)
+				continue;
+			// SIGPIPE is ignored, a consumer that went away only fails this export
+			if(errno == EPIPE && !writer->error)
+				printf("[EXPORT] The consumer of %s closed its end\n", writer->path);
+			writer->error = 1;
+			return AVERROR(errno);
+		}
+		buf += written;
+		remaining -= written;
+	}
+	writer->position += size;
+	if(writer->position > writer->size)
+		writer->size = writer->position;
+	return size;
+}
+
+static int64_t seek_output(void *opaque, int64_t offset, int whence) {
+	ExportWriter *writer = opaque;
+	if(whence == AVSEEK_SIZE)
+		return writer->size;
+
+	off_t position = lseek(writer->fd, offset, whence);
+	if(position < 0)
+		return AVERROR(errno);
+	writer->position = position;
+	return position;
+}
+
+static int parse_sink(const char *type) {
+	if(strcmp(type, "file") == 0)
+		return SINK_FILE;
+	if(strcmp(type, "pipe") == 0)
+		return SINK_PIPE;
+	if(strcmp(type, "memfd") == 0)
+		return SINK_MEMFD;
+	if(strcmp(type, "socket") == 0)
+		return SINK_SOCKET;
+	return -1;
+}
+
+// Connects to the local consumer listening on the Unix socket at `address`
+static int connect_consumer(const char *address) {
+	struct sockaddr_un socketAddress = { .sun_family = AF_UNIX };
+	if(strlen(address) >= sizeof(socketAddress.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(socketAddress.sun_path, address);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+	if(connect(fd, (struct sockaddr*) &socketAddress, sizeof(socketAddress)) < 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+
+// Opens the FIFO at `address` for writing once a consumer has opened its end, giving up after PIPE_TIMEOUT_MS.
+// A blocking open() would hang the export forever if nobody ever reads.
+#define PIPE_TIMEOUT_MS 5000
+static int open_pipe(const char *address) {
+	for(int waited = 0; ; waited += 10) {
+		int fd = open(address, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if(fd >= 0) {
+			// The export is written like any other file once connected
+			int flags = fcntl(fd, F_GETFL);
+			if(flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+				int error = errno;
+				close(fd);
+				errno = error;
+				return -1;
+			}
+			return fd;
+		}
+		// ENXIO means there's no reader yet
+		if(errno != ENXIO)
+			return -1;
+		if(waited >= PIPE_TIMEOUT_MS) {
+			printf("[EXPORT] No consumer opened %s within %d ms\n", address, PIPE_TIMEOUT_MS);
+			errno = ENXIO;
+			return -1;
+		}
+		usleep(10000); // 10ms
+	}
+}
+
+// Writes all of `size` bytes, returns 0 on success
+static int write_fully(int fd, const void *data, size_t size) {
+	const uint8_t *bytes = data;
+	while(size > 0) {
+		ssize_t written = write(fd, bytes, size);
+		if(written < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		bytes += written;
+		size -= written;
+	}
+	return 0;
+}
+
+// Opens the descriptor the export is written into, returns 0 on success.
+// Streams to a socket start with the export's file name and a newline, so the consumer knows what it's getting.
+static int open_sink(ExportWriter *writer, const char *address) {
+	char *name = basename(writer->path);
+	switch(writer->sink) {
+		case SINK_FILE:
+			writer->fd = open(writer->tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			writer->seekable = 1;
+			break;
+		case SINK_PIPE:
+			writer->fd = open_pipe(address);
+			break;
+		case SINK_MEMFD:
+			writer->fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+			writer->seekable = 1;
+			break;
+		case SINK_SOCKET:
+			writer->fd = connect_consumer(address);
+			if(writer->fd >= 0 && (write_fully(writer->fd, name, strlen(name)) < 0 || write_fully(writer->fd, "\n", 1) < 0)) {
+				close(writer->fd);
+				writer->fd = -1;
+			}
+			break;
+	}
+	if(writer->fd < 0) {
+		printf("[EXPORT] Error opening %s: %s\n", writer->sink == SINK_FILE ? writer->tempPath : address, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+// Seals the finished memfd, so it can't change under the consumer, and passes it over the socket at `address`
+// along with the export's file name. The consumer gets its own reference, ours is closed right after.
+static int hand_over_memfd(ExportWriter *writer, const char *address) {
+	if(fcntl(writer->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		printf("[EXPORT] Error sealing %s: %s\n", writer->path, strerror(errno));
+		return 1;
+	}
+	int consumer = connect_consumer(address);
+	if(consumer < 0) {
+		printf("[EXPORT] Error connecting to %s: %s\n", address, strerror(errno));
+		return 1;
+	}
+	char *name = basename(writer->path);
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct iovec payload = { .iov_base = name, .iov_len = strlen(name) };
+	struct msghdr message = {
+		.msg_iov = &payload,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+	rights->cmsg_level = SOL_SOCKET;
+	rights->cmsg_type = SCM_RIGHTS;
+	rights->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(rights), &writer->fd, sizeof(int));
+	int ret = 0;
+	if(sendmsg(consumer, &message, MSG_NOSIGNAL) < 0) {
+		printf("[EXPORT] Error handing %s over to %s: %s\n", writer->path, address, strerror(errno));
+		ret = 1;
+	}
+	close(consumer);
+	return ret;
+}
+
+// MP4 and MOV normally write their index once all packets are known, at the end of the file.
+// Fragmented, every `fragment-duration` seconds of packets get their own index (moof) in front of them (mdat),
+// and the muxer flushes the output after each fragment, so readers see whole fragments as soon as they're done.
+static void fragment_options(AVFormatContext *formatContext, AVDictionary **options) {
+	if(!av_match_name(formatContext->oformat->name, "mp4,mov,ipod"))
+		return;
+	av_dict_set(options, "movflags", "empty_moov+default_base_moof", 0);
+	int64_t duration = llround(cfg_getfloat(C_EXPORT_ROOT, "fragment-duration") * 1000000);
+	if(duration > 0)
+		av_dict_set_int(options, "frag_duration", duration, 0);
+	else
+		av_dict_set(options, "movflags", "+frag_keyframe", AV_DICT_APPEND);
+}
+
+// Opens `file` for writing through a large buffered AVIOContext, writes the header
+// and starts the writer thread. `expectedSize` is used to preallocate the file,
+// pass 0 if unknown. Where it's written to depends on the `sink` section.
+// `rendition` is the rendition's name, NULL for the main output; every rendition streams into its own FIFO.
+ExportWriter *open_export_writer(AVFormatContext *formatContext, const char *file, const char *rendition, int64_t expectedSize) {
+	ExportWriter *writer = malloc(sizeof(ExportWriter));
+	memset(writer, 0, sizeof(ExportWriter));
+	writer->formatContext = formatContext;
+	writer->fd = -1;
+	writer->path = strdup(file);
+	// A fragmented file is playable up to its last fragment, so it's written in place where it can be picked up early
+	writer->fragmented = cfg_getbool(C_EXPORT_ROOT, "fragment");
+	writer->tempPath = malloc(strlen(file) + sizeof(".part"));
+	sprintf(writer->tempPath, writer->fragmented ? "%s" : "%s.part", file);
+
+	cfg_t *sink = cfg_getsec(C_EXPORT_ROOT, "sink");
+	const char *address = cfg_getstr(sink, "address");
+	int type = parse_sink(cfg_getstr(sink, "type"));
+	if(type < 0) {
+		printf("[EXPORT] Unknown sink %s\n", cfg_getstr(sink, "type"));
+		goto fail;
+	}
+	writer->sink = type;
+	if(writer->sink != SINK_FILE && address[0] == '\0') {
+		printf("[EXPORT] The %s sink needs an address\n", cfg_getstr(sink, "type"));
+		goto fail;
+	}
+	// The renditions are written at the same time, they'd interleave in a single FIFO: address-<rendition>
+	if(writer->sink == SINK_PIPE && rendition != NULL) {
+		writer->address = malloc(strlen(address) + strlen(rendition) + 2);
+		sprintf(writer->address, "%s-%s", address, rendition);
+	} else {
+		writer->address = strdup(address);
+	}
+	if(open_sink(writer, writer->address))
+		goto fail;
+	// Pipes and sockets can't go back to the header once the file is complete
+	if(!writer->seekable)
+		writer->fragmented = 1;
+
+	// Reserve the blocks up front so a slow disk doesn't have to
+	// allocate extents while we are writing. The size is only an estimate,
+	// anything we don't use is truncated when the writer is closed.
+	if(writer->seekable && expectedSize > 0 && cfg_getbool(C_EXPORT_ROOT, "preallocate")) {
+		if(fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, 0, expectedSize) < 0 && errno != EOPNOTSUPP) {
+			printf("[EXPORT] Could not preallocate %ld bytes: %s\n", expectedSize, strerror(errno));
+		}
+	}
+
+	size_t bufferSize = (size_t) cfg_getint(C_EXPORT_ROOT, "buffer-size") * 1024 * 1024;
+	unsigned char *buffer = av_malloc(bufferSize);
+	if(buffer == NULL) {
+		printf("[EXPORT] Error allocating %zu byte output buffer\n", bufferSize);
+		goto fail;
+	}
+	formatContext->pb = avio_alloc_context(buffer, bufferSize, 1, writer, NULL, write_output, writer->seekable ? seek_output : NULL);
+	if(formatContext->pb == NULL) {
+		printf("[EXPORT] Error allocating output context\n");
+		av_free(buffer);
+		goto fail;
+	}
+
+	AVDictionary *muxerOptions = NULL;
+	if(writer->fragmented)
+		fragment_options(formatContext, &muxerOptions);
+	int ret = avformat_write_header(formatContext, &muxerOptions);
+	av_dict_free(&muxerOptions);
+	if(ret < 0) {
+		printf("[EXPORT] Error writing header\n");
+		goto fail;
+	}
+
+	// One queue per track, so every track can be encoded on its own thread
+	size_t queueSize = cfg_getint(C_EXPORT_ROOT, "queue-size");
+	writer->queues = calloc(formatContext->nb_streams, sizeof(PacketQueue));
+	writer->finished = calloc(formatContext->nb_streams, sizeof(int));
+	for(; writer->nb_queues < formatContext->nb_streams; writer->nb_queues++) {
+		if(init_packet_queue(&writer->queues[writer->nb_queues], queueSize)) {
+			printf("[EXPORT] Error allocating packet queue\n");
+			goto fail;
+		}
+	}
+	pthread_create(&writer->thread, NULL, export_writer_thread, writer);
+	return writer;
+
+fail:
+	for(int i = 0; i < writer->nb_queues; i++) {
+		free_packet_queue(&writer->queues[i]);
+	}
+	free(writer->queues);
+	free(writer->finished);
+	if(formatContext->pb) {
+		av_freep(&formatContext->pb->buffer);
+		avio_context_free(&formatContext->pb);
+	}
+	if(writer->fd >= 0) {
+		close(writer->fd);
+		if(writer->sink == SINK_FILE)
+			unlink(writer->tempPath);
+	}
+	free(writer->address);
+	free(writer->path);
+	free(writer->tempPath);
+	free(writer);
+	return NULL;
+}
+
+// Hands the packet over to the writer thread, the packet is reset afterwards.
+// Packets of one track have to be passed in decoding order.
+int export_write_packet(ExportWriter *writer, AVPacket *packet) {
+	AVPacket *queued = av_packet_alloc();
+	if(queued == NULL) {
+		return AVERROR(ENOMEM);
+	}
+	av_packet_move_ref(queued, packet);
+	packet_queue_push(&writer->queues[queued->stream_index], queued);
+	return 0;
+}
+
+// Marks the end of a track, every track has to be finished before the writer is closed.
+void export_finish_track(ExportWriter *writer, int index) {
+	packet_queue_push(&writer->queues[index], NULL);
+}
+
+// Whether packet `a` goes into the file before `b`
+static int packet_before(AVFormatContext *formatContext, AVPacket *a, AVPacket *b) {
+	int64_t dtsA = a->dts != AV_NOPTS_VALUE ? a->dts : a->pts;
+	int64_t dtsB = b->dts != AV_NOPTS_VALUE ? b->dts : b->pts;
+	return av_compare_ts(dtsA, formatContext->streams[a->stream_index]->time_base,
+			dtsB, formatContext->streams[b->stream_index]->time_base) < 0;
+}
+
+// Merges the tracks' queues into the file. Waits until every unfinished track has a packet
+// and writes the one with the lowest DTS, so the packets are already interleaved and the muxer
+// doesn't have to hold on to a whole track. Memory stays bounded by the queue sizes.
+static void *export_writer_thread(void *arg) {
+	ExportWriter *writer = arg;
+	int active = writer->nb_queues;
+	trace_thread_name("writer", -1);
+	while(active > 0) {
+		int next = -1;
+		AVPacket *first = NULL;
+		uint64_t span = trace_begin();
+		for(int i = 0; i < writer->nb_queues; i++) {
+			if(writer->finished[i])
+				continue;
+			AVPacket *head = packet_queue_peek(&writer->queues[i]);
+			if(head == NULL) {
+				packet_queue_pop(&writer->queues[i]);
+				writer->finished[i] = 1;
+				active--;
+			} else if(first == NULL || packet_before(writer->formatContext, head, first)) {
+				first = head;
+				next = i;
+			}
+		}
+		trace_end("merge", span);
+		if(next < 0)
+			continue;
+
+		AVPacket *packet = packet_queue_pop(&writer->queues[next]);
+		// Keep draining the queues on errors, otherwise the encoders would block forever.
+		span = trace_begin();
+		if(!writer->error && av_write_frame(writer->formatContext, packet) < 0) {
+			printf("[EXPORT] Error writing packet to %s\n", writer->tempPath);
+			writer->error = 1;
+		}
+		trace_end("write_frame", span);
+		av_packet_free(&packet);
+	}
+	return NULL;
+}
+
+// Waits until every track is finished and written, finalizes the file and moves it into place,
+// or hands it over to the consumer. Returns 0 on success.
+int close_export_writer(ExportWriter *writer) {
+	pthread_join(writer->thread, NULL);
+	for(int i = 0; i < writer->nb_queues; i++) {
+		free_packet_queue(&writer->queues[i]);
+	}
+	free(writer->queues);
+	free(writer->finished);
+
+	AVFormatContext *formatContext = writer->formatContext;
+	if(av_write_trailer(formatContext) < 0)
+		writer->error = 1;
+	avio_flush(formatContext->pb);
+	if(formatContext->pb->error < 0)
+		writer->error = 1;
+	av_freep(&formatContext->pb->buffer);
+	avio_context_free(&formatContext->pb);
+
+	// Give back whatever part of the preallocation we didn't use
+	if(writer->seekable && ftruncate(writer->fd, writer->size) < 0)
+		writer->error = 1;
+	const char *address = writer->address;
+	if(writer->sink == SINK_MEMFD && !writer->error && hand_over_memfd(writer, address))
+		writer->error = 1;
+	if(close(writer->fd) < 0)
+		writer->error = 1;
+
+	if(writer->sink != SINK_FILE) {
+		if(writer->error)
+			printf("[EXPORT] Export of %s to %s failed\n", writer->path, address);
+	} else if(writer->error && writer->fragmented) {
+		printf("[EXPORT] Export failed, %s holds the fragments written so far\n", writer->tempPath);
+	} else if(writer->error) {
+		printf("[EXPORT] Export failed, partial output left at %s\n", writer->tempPath);
+	} else if(rename(writer->tempPath, writer->path) < 0) {
+		printf("[EXPORT] Error moving %s into place: %s\n", writer->tempPath, strerror(errno));
+		writer->error = 1;
+	}
+
+	int error = writer->error;
+	free(writer->address);
+	free(writer->path);
+	free(writer->tempPath);
+	free(writer);
+	return error;
+}
+
+
+// Opens a rendition and all of its encoders. `section` is either the `codec` section
+// for the main output, or one of the `rendition` sections in `export`.
+Rendition *open_rendition(Capture *cap, cfg_t *section) {
+	Rendition *rendition = malloc(sizeof(Rendition));
+	memset(rendition, 0, sizeof(Rendition));
+	rendition->root = cap;
+
+	int primary = section == C_CODEC_ROOT;
+	if(primary) {
+		rendition->codecName = strdup(cfg_getstr(section, "name"));
+		rendition->audioBitrate = cfg_getint(C_AUDIO_ROOT, "bitrate");
+	} else {
+		rendition->name = strdup(cfg_title(section));
+		rendition->codecName = strdup(cfg_getstr(section, "codec"));
+		rendition->audioBitrate = cfg_getint(section, "audio-bitrate");
+		if(rendition->audioBitrate == 0)
+			rendition->audioBitrate = cfg_getint(C_AUDIO_ROOT, "bitrate");
+		cfg_t *scale = cfg_getsec(section, "scale");
+		if(scale && cfg_getint(scale, "width") && cfg_getint(scale, "height")) {
+			rendition->frameWidth = cfg_getint(scale, "width");
+			rendition->frameHeight = cfg_getint(scale, "height");
+		}
+	}
+	rendition->container = strdup(cfg_getstr(section, "container"));
+	rendition->bitrate = cfg_getint(section, "bitrate");
+	rendition->options = parse_codec_options(section);
+
+	avformat_alloc_output_context2(&rendition->formatContext, NULL, rendition->container, NULL);
+	if(!rendition->formatContext) {
+		printf("Error allocating output context for %s\n", rendition->container);
+		goto fail;
+	}
+
+	int i;
+	rendition->video_encoders = malloc(sizeof(VideoEncoder*) * cap->nb_video_streams);
+	for(i = 0; i < cap->nb_video_streams; i++) {
+		if((rendition->video_encoders[i] = open_video_encoder(rendition, cap->video_streams[i])) == NULL) {
+			fprintf(stderr, "Error opening video stream\n");
+			goto fail;
+		}
+		rendition->nb_video_encoders++;
+	}
+	rendition->audio_encoders = malloc(sizeof(AudioEncoder*) * cap->nb_audio_streams);
+	for(i = 0; i < cap->nb_audio_streams; i++) {
+		if((rendition->audio_encoders[i] = open_audio_encoder(rendition, cap->audio_streams[i])) == NULL) {
+			fprintf(stderr, "Error opening audio stream\n");
+			goto fail;
+		}
+		rendition->nb_audio_encoders++;
+	}
+	return rendition;
+
+fail:
+	free_rendition(rendition);
+	return NULL;
+}
+
+// One track of a rendition, encoded on its own thread
+typedef struct TrackExport {
+	Rendition *rendition;
+	VideoEncoder *video;
+	AudioEncoder *audio;
+	int64_t encoded; // Frames for video, samples for audio
+	double skip; // Seconds at the start of the ring left out of the export
+	int started;
+	pthread_t thread;
+} TrackExport;
+
+static void *track_export_thread(void *arg) {
+	TrackExport *track = arg;
+	int index;
+	if(track->video) {
+		trace_thread_name("encode video", track->video->stream->index);
+		track->encoded = flush_video_encoder(track->video);
+		index = track->video->stream->index;
+	} else {
+		trace_thread_name(track->audio->source->device->name, -1);
+		track->encoded = flush_audio_encoder(track->audio, track->skip);
+		index = track->audio->stream->index;
+	}
+	// Always finish the track, even after an error, the writer waits for it
+	export_finish_track(track->rendition->writer, index);
+	return NULL;
+}
+
+static void *rendition_export_thread(void *arg) {
+	Rendition *rendition = arg;
+	Capture *cap = rendition->root;
+	// The writer and track threads are started from here and inherit the placement
+	place_thread(THREAD_EXPORT);
+	trace_thread_name(rendition->name ? rendition->name : "export", -1);
+
+	// Rough estimate of the output size, used to preallocate the file.
+	int64_t expectedSize = rendition->bitrate + rendition->audioBitrate * rendition->nb_audio_encoders;
+	expectedSize = expectedSize / 8 * cap->activeWindow;
+
+	// Audio tracks that were silent for the whole window can be left out
+	int i;
+	int dropSilent = strcmp(cfg_getstr(C_AUDIO_ROOT, "silent-tracks"), "drop") == 0;
+	for(i = 0; i < rendition->nb_audio_encoders; i++) {
+		AudioEncoder *encoder = rendition->audio_encoders[i];
+		if(dropSilent && is_silent_stream(encoder->source))
+			continue;
+		if(add_audio_track(encoder) < 0) {
+			rendition->error = 1;
+			return NULL;
+		}
+	}
+
+	// Packets are handed to a separate writer thread, so encoding
+	// doesn't have to wait for the disk.
+	rendition->writer = open_export_writer(rendition->formatContext, rendition->file, rendition->name, expectedSize);
+	if(rendition->writer == NULL) {
+		printf("Error opening output file %s\n", rendition->file);
+		rendition->error = 1;
+		return NULL;
+	}
+
+	// Pre-encoded video starts at a keyframe, possibly after the start of the ring.
+	// The audio leaves out as much, so the tracks stay in sync.
+	// Video with a history starts before the ring, the skip is negative then and the audio starts later.
+	double skip = 0.0;
+	for(i = 0; i < rendition->nb_video_encoders; i++) {
+		double videoSkip = prepare_video_export(rendition->video_encoders[i]);
+		if(i == 0 || videoSkip > skip)
+			skip = videoSkip;
+	}
+
+	// Every track is encoded on its own thread, the writer merges them in DTS order
+	int tracks = rendition->nb_video_encoders + rendition->nb_audio_encoders;
+	TrackExport *exports = calloc(tracks, sizeof(TrackExport));
+	for(i = 0; i < tracks; i++) {
+		TrackExport *track = &exports[i];
+		track->rendition = rendition;
+		track->skip = skip;
+		if(i < rendition->nb_video_encoders) {
+			track->video = rendition->video_encoders[i];
+		} else {
+			track->audio = rendition->audio_encoders[i - rendition->nb_video_encoders];
+			if(track->audio->stream == NULL)
+				continue;
+		}
+		track->started = 1;
+		pthread_create(&track->thread, NULL, track_export_thread, track);
+	}
+
+	// The tracks are checked against each other, both rings end at the time of the save,
+	// so a difference in length means the capture didn't keep up with its framerate.
+	// Audio is checked against the main video track, the first one that isn't a focus crop.
+	double videoDuration = 0.0;
+	int mainTrack = -1;
+	for(i = 0; i < tracks; i++) {
+		TrackExport *track = &exports[i];
+		if(track->started)
+			pthread_join(track->thread, NULL);
+		if(track->video) {
+			// History frames are further apart than the ring's, the duration comes from the timestamps
+			double duration = track->video->exportedDuration;
+			if(mainTrack < 0 && track->video->source->orchestrator->feeder == NULL) {
+				mainTrack = i;
+				videoDuration = duration;
+			}
+			printf("[EXPORT] %s: video track %d, %ld frames (%.2f s)\n", rendition->file, i, track->encoded, duration);
+		} else if(!track->started) {
+			printf("[EXPORT] %s: audio track %d (%s) was silent, left out\n", rendition->file, i, track->audio->source->device->name);
+		} else {
+			double audioDuration = (double) track->encoded / track->audio->source->sampleRate;
+			// Audio starts after the history, both tracks end together
+			double audioEnd = audioDuration + (track->skip < 0 ? -track->skip : 0.0);
+			printf("[EXPORT] %s: audio track %d (%s), %.2f s, A/V offset %+.0f ms against track %d\n", rendition->file, i,
+					track->audio->source->device->name, audioDuration, (audioEnd - videoDuration) * 1000.0, mainTrack);
+		}
+	}
+	free(exports);
+
+	rendition->error = close_export_writer(rendition->writer);
+	rendition->writer = NULL;
+	return NULL;
+}
+
+// Starts encoding the paused capture into `file` on a separate thread.
+// All renditions read the same ring frames, so they can be exported in parallel.
+void start_rendition_export(Rendition *rendition, const char *file) {
+	rendition->file = strdup(file);
+	rendition->error = 0;
+	pthread_create(&rendition->thread, NULL, rendition_export_thread, rendition);
+}
+
+// Waits for the export to finish, returns 0 on success
+int finish_rendition_export(Rendition *rendition) {
+	pthread_join(rendition->thread, NULL);
+	free(rendition->file);
+	rendition->file = NULL;
+	return rendition->error;
+}
+
+void free_rendition(Rendition *rendition) {
+	int i;
+	for(i = 0; i < rendition->nb_video_encoders; i++) {
+		free_video_encoder(rendition->video_encoders[i]);
+	}
+	for(i = 0; i < rendition->nb_audio_encoders; i++) {
+		free_audio_encoder(rendition->audio_encoders[i]);
+	}
+	free(rendition->video_encoders);
+	free(rendition->audio_encoders);
+	// Encoders are bound to a single output, so the whole rendition is thrown away after a save
+	avformat_free_context(rendition->formatContext);
+	av_dict_free(&rendition->options);
+	free(rendition->name);
+	free(rendition->container);
+	free(rendition->codecName);
+	free(rendition);
+}
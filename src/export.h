@@ -0,0 +1,96 @@
+#ifndef EXPORT_H_
+#define EXPORT_H_
+
+#include <pthread.h>
+
+#include "spotlight.h"
+
+// Bounded FIFO of encoded packets, filled by a track's encoding thread
+// and drained by the writer thread.
+typedef struct PacketQueue {
+	AVPacket **packets;
+	size_t capacity;
+	size_t head;
+	size_t count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+} PacketQueue;
+
+// Where an export is written, `type` in the `sink` section of `export`
+enum ExportSink {
+	SINK_FILE, // A file in `directory`, moved into place once it's complete
+	SINK_PIPE, // Streamed into a FIFO
+	SINK_MEMFD, // Written into a memfd, which is sealed and handed to a local consumer over a Unix socket
+	SINK_SOCKET, // Streamed to a local consumer over a Unix socket
+};
+
+typedef struct ExportWriter {
+	AVFormatContext *formatContext;
+	// One queue per track, indexed by stream index
+	PacketQueue *queues;
+	int *finished;
+	int nb_queues;
+	pthread_t thread;
+
+	// The file is written to `tempPath` and renamed to `path`
+	// once the trailer has been written. Other sinks only use `path` to name the export.
+	enum ExportSink sink;
+	char *address; // The sink's address when the export was opened, a reload may change the config's
+	char *path;
+	char *tempPath;
+	int fd;
+	int seekable; // Pipes and sockets can only be written front to back
+	int fragmented; // MP4 is written in self-contained fragments, see `fragment` in the export section
+
+	// Current offset and the highest offset written so far,
+	// the latter is the final file size.
+	int64_t position;
+	int64_t size;
+
+	int error;
+} ExportWriter;
+
+// One output file written on every save, with its own encoder for every stream
+typedef struct Rendition {
+	char *name; // NULL for the main output
+	char *container;
+	char *codecName;
+	int64_t bitrate;
+	int64_t audioBitrate;
+	// Size of the encoded video, 0 keeps the size of the ring
+	size_t frameWidth, frameHeight;
+	AVDictionary *options;
+
+	struct Capture *root;
+	AVFormatContext *formatContext;
+	ExportWriter *writer;
+	int nb_video_encoders;
+	struct VideoEncoder **video_encoders;
+	int nb_audio_encoders;
+	struct AudioEncoder **audio_encoders;
+
+	pthread_t thread;
+	char *file;
+	int error;
+} Rendition;
+
+int init_packet_queue(PacketQueue*, size_t);
+void free_packet_queue(PacketQueue*);
+// Takes ownership of the packet, NULL marks the end of the queue.
+void packet_queue_push(PacketQueue*, AVPacket*);
+AVPacket *packet_queue_peek(PacketQueue*);
+AVPacket *packet_queue_pop(PacketQueue*);
+
+ExportWriter *open_export_writer(AVFormatContext*, const char*, const char*, int64_t);
+int export_write_packet(ExportWriter*, AVPacket*);
+void export_finish_track(ExportWriter*, int);
+int close_export_writer(ExportWriter*);
+
+Rendition *open_rendition(struct Capture*, cfg_t*);
+void start_rendition_export(Rendition*, const char*);
+int finish_rendition_export(Rendition*);
+void free_rendition(Rendition*);
+
+#endif
@@ -0,0 +1,241 @@
+#include "libspotlight.h"
+#include "spotlight.h"
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+
+static void *audio_thread(void *arg) {
+	AudioStream *stream = arg;
+	place_thread(THREAD_AUDIO);
+	trace_thread_name(stream->device->name, -1);
+	while(1) {
+		wait_for_resume(stream->root);
+		// The ring stops growing, the other streams keep recording
+		if(audio_encode(stream)) {
+			printf("[%s] Stopped recording\n", stream->device->name);
+			break;
+		}
+	}
+	return NULL;
+}
+
+// A pipe or socket sink whose consumer goes away mid-save has to fail that export, not kill the process
+static void ignore_sigpipe() {
+	signal(SIGPIPE, SIG_IGN);
+}
+
+struct Capture *spotlight_init(const char *configFile, int flags) {
+	ignore_sigpipe();
+	if(configFile != NULL)
+		C_CONFIG_FILE = configFile;
+	if(!init_config() || load_config()) {
+		free_config();
+		return NULL;
+	}
+	init_trace(cfg_getint(C_SPOTLIGHT_ROOT, "trace-events"));
+
+	Capture *cap = alloc_capture();
+	// Unpaused by spotlight_start() once every stream is running
+	cap->pause = 1;
+
+	AudioDevice** devices = NULL;
+	size_t numDevices = 0;
+	size_t i = 0;
+	if((flags & SPOTLIGHT_GRAB_PULSE) && C_AUDIO_ROOT) {
+		devices = init_pulse(&numDevices);
+		if(devices == NULL) {
+			printf("Error initializing PulseAudio\n");
+			numDevices = 0;
+			goto fail;
+		}
+	}
+
+	// Frames are stored in the format the codec takes, so exports don't have to convert them
+	cap->pixelFormat = negotiate_ring_format();
+
+	// Work out how much memory the window takes up before allocating any of it
+	size_t frameWidth, frameHeight;
+	configured_frame_size(&frameWidth, &frameHeight);
+	cap->windowSize = plan_window_size(cap->windowSize, cap->framerate, frameWidth, frameHeight, cap->pixelFormat, devices, numDevices);
+	cap->activeWindow = cap->windowSize;
+	if(cap->windowSize == 0)
+		goto fail;
+
+	// The cache domains can be used to place threads in the scheduling section
+	print_cpu_topology();
+
+	if(flags & SPOTLIGHT_GRAB_X11) {
+		VideoStream *defaultStream = default_video(cap);
+		if(!defaultStream) {
+			printf("Couldn't initialize X11 video stream.\n");
+			goto fail;
+		}
+		add_video_stream(cap, defaultStream);
+		// The focus crop is cut from the same grabs, it's exported as a second video track
+		VideoStream *focusStream = focus_video(defaultStream);
+		if(focusStream != NULL)
+			add_video_stream(cap, focusStream);
+	}
+
+	for(i = 0; i < numDevices; i++) {
+		AudioStream* stream = alloc_audio_stream(cap, devices[i]);
+		if(stream == NULL) {
+			printf("Error allocating the audio ring of %s\n", devices[i]->name);
+			goto fail;
+		}
+		add_audio_stream(cap, stream);
+	}
+	// The streams own their devices from here on
+	free(devices);
+	return cap;
+
+fail:
+	// Devices without a stream are still ours, the streams are freed along with the capture
+	for(; i < numDevices; i++) {
+		free_audio_device(devices[i]);
+	}
+	free(devices);
+	pause_capture(cap);
+	free_capture(cap);
+	free_config();
+	return NULL;
+}
+
+struct VideoStream *spotlight_open_video(struct Capture *cap, int width, int height) {
+	VideoStream *stream = injected_video(cap, width, height);
+	if(stream != NULL)
+		add_video_stream(cap, stream);
+	return stream;
+}
+
+struct AudioStream *spotlight_open_audio(struct Capture *cap, const char *name, enum SpotlightSampleFormat format, int sampleRate, int channels) {
+	static const enum AVSampleFormat formats[] = {
+		[SPOTLIGHT_SAMPLE_U8] = AV_SAMPLE_FMT_U8,
+		[SPOTLIGHT_SAMPLE_S16] = AV_SAMPLE_FMT_S16,
+		[SPOTLIGHT_SAMPLE_S32] = AV_SAMPLE_FMT_S32,
+		[SPOTLIGHT_SAMPLE_FLT] = AV_SAMPLE_FMT_FLT,
+	};
+	if(format < SPOTLIGHT_SAMPLE_U8 || format > SPOTLIGHT_SAMPLE_FLT)
+		return NULL;
+	AudioStream *stream = injected_audio(cap, name, formats[format], sampleRate, channels);
+	if(stream != NULL)
+		add_audio_stream(cap, stream);
+	return stream;
+}
+
+int spotlight_start(struct Capture *cap) {
+	// Open the encoders on a thread with the export placement, nothing is started if they can't be opened
+	prepare_standby_output(cap);
+	if(wait_for_standby_output(cap))
+		return 1;
+
+	// Create a new thread for each audio device, pushed streams don't need one
+	for(int i = 0; i < cap->nb_audio_streams; i++) {
+		AudioStream* stream = cap->audio_streams[i];
+		if(stream->device->handle != NULL)
+			pthread_create(&stream->thread, NULL, audio_thread, stream);
+	}
+
+	start_memory_monitor(cap);
+
+	// Wait for video threads to spin up.
+	int ready;
+	printf("Waiting for threads to spin up...\n");
+	do {
+		ready = 1;
+		for(int i = 0; i < cap->nb_video_streams; ++i) {
+			// Video streams take some time until they're ready
+			VideoThreadOrchestrator *orch = cap->video_streams[i]->orchestrator;
+			for(int j = 0; j < orch->nb_threads; ++j) {
+				ready &= orch->contexts[j]->ready;
+			}
+		}
+		if(!ready)
+			usleep(10000); // 10ms
+	} while(!ready);
+	cap->pause = 0;
+	return 0;
+}
+
+int spotlight_push_video_frame(struct VideoStream *stream, enum SpotlightPixelFormat format, const uint8_t *const planes[], const int strides[], int64_t time) {
+	return push_video_frame(stream, format == SPOTLIGHT_PIXEL_BGRA ? AV_PIX_FMT_BGRA : AV_PIX_FMT_YUV420P, planes, strides, time);
+}
+
+int spotlight_push_audio(struct AudioStream *stream, const uint8_t *samples, int count) {
+	return push_audio_samples(stream, samples, count);
+}
+
+int spotlight_save(struct Capture *cap) {
+	// The capture only pauses while the exporter process is forked
+	if(cfg_getbool(C_EXPORT_ROOT, "process")) {
+		pause_capture(cap);
+		pid_t pid = fork_export(cap, time(NULL));
+		resume_capture(cap);
+		return pid < 0;
+	}
+
+	// The encoders are re-opened in the background after every save, a failed attempt is retried once
+	if(wait_for_standby_output(cap)) {
+		prepare_standby_output(cap);
+		if(wait_for_standby_output(cap)) {
+			printf("Not saving, the output can't be opened\n");
+			prepare_standby_output(cap);
+			return 1;
+		}
+	}
+
+	// Dump the correct window to the output directory
+	pause_capture(cap);
+	int failed = flush_capture(cap, time(NULL));
+	resume_capture(cap);
+
+	prepare_standby_output(cap);
+	return failed;
+}
+
+int spotlight_still(struct Capture *cap, double offset) {
+	return save_still(cap, offset, time(NULL));
+}
+
+int spotlight_reload(struct Capture *cap) {
+	// Re-read the config and apply it without throwing away the buffered window.
+	// The config is swapped while paused, no capture thread reads it then.
+	wait_for_standby_output(cap);
+	pause_capture(cap);
+	if(reload_config() != 0) {
+		resume_capture(cap);
+		return 1;
+	}
+	int failed = reconfigure_capture(cap);
+	resume_capture(cap);
+
+	// The encoders depend on the new ring layout, so they're re-opened last
+	prepare_standby_output(cap);
+	return failed;
+}
+
+// Stops all threads and frees everything, so leaks show up when running under the sanitizers
+void spotlight_shutdown(struct Capture *cap) {
+	printf("Stopping...\n");
+	stop_memory_monitor(cap);
+	wait_for_standby_output(cap);
+	pause_capture(cap);
+	int saves = cap->saves;
+	free_capture(cap);
+	free_config();
+	printf("Stopped after %d saves, RSS %zu MiB\n", saves, resident_memory() / (1024 * 1024));
+}
+
+int spotlight_transcode(const char *configFile, const char *dump) {
+	ignore_sigpipe();
+	if(configFile != NULL)
+		C_CONFIG_FILE = configFile;
+	if(!init_config() || load_config()) {
+		free_config();
+		return 1;
+	}
+	init_trace(cfg_getint(C_SPOTLIGHT_ROOT, "trace-events"));
+	int failed = transcode_dump(dump);
+	free_config();
+	return failed;
+}
@@ -0,0 +1,77 @@
+#ifndef LIBSPOTLIGHT_H_
+#define LIBSPOTLIGHT_H_
+
+// Public API for embedding Spotlight in an application that already has its frames in memory.
+// The application pushes frames and samples into the rings instead of Spotlight grabbing them from X and Pulse,
+// everything else (window, exports, stills, reloading) works as in the standalone program and is set up from the config.
+// The config is process wide, so there's only one capture per process.
+//
+// 	struct Capture *cap = spotlight_init(NULL, 0);
+// 	struct VideoStream *video = spotlight_open_video(cap, 1920, 1080);
+// 	spotlight_start(cap);
+// 	...
+// 	spotlight_push_video_frame(video, SPOTLIGHT_PIXEL_BGRA, planes, strides, time);
+// 	...
+// 	spotlight_save(cap);
+// 	spotlight_shutdown(cap);
+
+#include <stdint.h>
+#include <time.h>
+
+struct Capture;
+struct VideoStream;
+struct AudioStream;
+
+// Flags for spotlight_init()
+#define SPOTLIGHT_GRAB_X11 1 // Also capture the screen as set in the capture section of the config
+#define SPOTLIGHT_GRAB_PULSE 2 // Also record the devices set in the audio section of the config
+
+enum SpotlightPixelFormat {
+	SPOTLIGHT_PIXEL_YUV420P, // Three planes, copied into the ring as they are if it holds YUV420P at their size
+	SPOTLIGHT_PIXEL_BGRA, // One plane, converted while it's stored
+};
+
+// Interleaved samples
+enum SpotlightSampleFormat {
+	SPOTLIGHT_SAMPLE_U8,
+	SPOTLIGHT_SAMPLE_S16,
+	SPOTLIGHT_SAMPLE_S32,
+	SPOTLIGHT_SAMPLE_FLT,
+};
+
+// Loads the config (the default one if `configFile` is NULL) and sets up the capture without starting it.
+// Threads started from here on inherit the calling thread's signal mask. Returns NULL on errors.
+// SIGPIPE is ignored from here on, writes to a sink whose consumer went away fail with EPIPE instead.
+struct Capture *spotlight_init(const char *configFile, int flags);
+
+// Adds streams fed by the application, only between spotlight_init() and spotlight_start().
+// Pushed frames are scaled to the ring's size from the config, audio is converted to what the encoder takes.
+struct VideoStream *spotlight_open_video(struct Capture*, int width, int height);
+struct AudioStream *spotlight_open_audio(struct Capture*, const char *name, enum SpotlightSampleFormat, int sampleRate, int channels);
+
+// Starts capturing, returns 0 once every stream is running.
+// Returns 1 if the encoders can't be opened, nothing is started then and the capture can only be shut down.
+int spotlight_start(struct Capture*);
+
+// Stores a frame rendered at `time` (microseconds, any monotonic clock), placed on the ring's framerate.
+// Returns 0 if it was stored, 1 if it was dropped (pushed too early, or the capture is paused), -1 on errors.
+// Only one thread may push into a stream at a time.
+int spotlight_push_video_frame(struct VideoStream*, enum SpotlightPixelFormat, const uint8_t *const planes[], const int strides[], int64_t time);
+// Stores `count` samples, returns 0 if they were stored and 1 if they were dropped because the capture is paused
+int spotlight_push_audio(struct AudioStream*, const uint8_t *samples, int count);
+
+// Exports the window, returns the number of outputs that failed, or 1 if the encoders can't be opened.
+// With `process = true` the export runs in a child process, which the application has to reap.
+int spotlight_save(struct Capture*);
+// Writes the frame captured `offset` seconds ago as an image, returns 0 on success
+int spotlight_still(struct Capture*, double offset);
+// Re-reads the config and applies it, returns 0 if it was applied
+int spotlight_reload(struct Capture*);
+// Stops all threads and frees the capture
+void spotlight_shutdown(struct Capture*);
+
+// Encodes a raw dump written with `dump = true` into the outputs set in the config, without capturing anything.
+// Returns the number of outputs that failed, or 1 if the dump can't be read. Ignores SIGPIPE like spotlight_init().
+int spotlight_transcode(const char *configFile, const char *dump);
+
+#endif
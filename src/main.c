@@ -1,108 +1,139 @@
 #include <stdio.h>
 #include <confuse.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/shm.h>
 #include <sys/ipc.h>
 #include <unistd.h>
 #include <time.h>
 #include <signal.h>
+#include <sys/wait.h>
 
 #include <X11/Xlib.h>
-#include <X11/extensions/XShm.h>
 
 #include <pthread.h>
 #include <semaphore.h>
 
+#include "libspotlight.h"
 #include "audio.h"
 #include "video.h"
 
 #define BILLION 1000000000L
 
 struct Capture *G_CAPTURE = NULL;
+static volatile sig_atomic_t G_STOP = 0;
 
 
 
 void save() {
-	// Dump the correct window to the output directory
-	G_CAPTURE->pause = 1;
-	char* file = generate_output_filename();
-	flush_capture(G_CAPTURE, file);
-	free(file);
-	G_CAPTURE->pause = 0;
+	spotlight_save(G_CAPTURE);
 }
 
-void audio_thread(AudioStream* stream) {
-	while(1) {
-		while(G_CAPTURE->pause == 1);
-		audio_encode(stream);
-	}
+void reload() {
+	spotlight_reload(G_CAPTURE);
 }
-void cleanup();
 
-int main(int argc, char** argv) {
-	signal(SIGUSR1, save);
-	
-	// Wait for video threads to spin up.
-	int ready = 1;
-	printf("Waiting for threads to spin up...\n");
-	do {
-		for(int i = 0; i < G_CAPTURE->nb_video_streams; ++i) {
-			// Video streams take some time until they're ready
-			VideoStream *stream = G_CAPTURE->video_streams[i];
-			for(int j = 0; j < stream->orchestrator->nb_threads; ++j) {
-				ready &= stream->orchestrator->contexts[j]->ready;
-			}
-		}
-		if(ready == 1) {
-			G_CAPTURE->pause = 0;
-			break;
-		}
-		usleep(10000); // 10ms
-	}while(!ready);
-
-	printf("Ready, send SIGUSR1 to save.\n");
-
-	while(1);
+void stop() {
+	G_STOP = 1;
 }
 
-__attribute__((constructor))
-void setup() {
-	init_config();
-	load_config();
-	
-	// Initialize capture
-	G_CAPTURE = alloc_capture();
-	G_CAPTURE->pause = 1;
-	// This flag is automatically unset by the video threads when they get initialized.
+// Writes a still of the newest frame, or of the frame `offset` seconds back in the config.
+// Sent with a value (kill -s USR2 -q 3000), the value picks the frame that many milliseconds back.
+void still(int sig, siginfo_t *info, void *context) {
+	double offset = cfg_getfloat(cfg_getsec(C_EXPORT_ROOT, "still"), "offset");
+	if(info->si_code == SI_QUEUE)
+		offset = info->si_value.sival_int / 1000.0;
+	spotlight_still(G_CAPTURE, offset);
+}
 
+// Collects finished exporter processes, whatever happened to them the capture keeps running
+void reap_exporters() {
+	int status;
+	pid_t pid;
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if(WIFSIGNALED(status))
+			printf("[EXPORT] Exporter process %d was killed by signal %d (%s)\n", pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
+		else if(WEXITSTATUS(status) != 0)
+			printf("[EXPORT] Exporter process %d failed\n", pid);
+		else
+			printf("[EXPORT] Exporter process %d finished\n", pid);
+	}
+}
 
+static void control_signals(sigset_t *set) {
+	sigemptyset(set);
+	sigaddset(set, SIGUSR1);
+	sigaddset(set, SIGUSR2);
+	sigaddset(set, SIGHUP);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGTERM);
+	sigaddset(set, SIGCHLD);
+}
 
-	VideoStream *defaultStream = default_video(G_CAPTURE);
-	if(!defaultStream) {
-		printf("Couldn't initialize X11 video stream.");
-		exit(1);
+// Installs `handler` for `sig`, blocking the other control signals while it runs
+// so a reload can't happen in the middle of a save and vice versa.
+static void install_handler(int sig, void (*handler)()) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handler;
+	control_signals(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(sig, &action, NULL);
+}
+
+// Same as install_handler(), for handlers that take the value sent along with the signal
+static void install_info_handler(int sig, void (*handler)(int, siginfo_t*, void*)) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = handler;
+	control_signals(&action.sa_mask);
+	action.sa_flags = SA_RESTART | SA_SIGINFO;
+	sigaction(sig, &action, NULL);
+}
+
+int main(int argc, char** argv) {
+	// spotlight --config <file> reads another config than ~/.config/spotlight/config.cfg
+	const char *configFile = NULL;
+	if(argc >= 3 && strcmp(argv[1], "--config") == 0) {
+		configFile = argv[2];
+		argc -= 2;
+		argv += 2;
 	}
-	add_video_stream(G_CAPTURE, defaultStream);
-
-	AudioDevice** devices = NULL;
-	size_t numDevices = 0;
-	if(C_AUDIO_ROOT) {
-		devices = init_pulse(&numDevices);
-		if(devices == NULL) {
-			printf("Error initializing PulseAudio\n");
-			exit(1);
-		}
-		for(int i = 0; i < numDevices; i++) {
-			AudioStream* stream = alloc_audio_stream(G_CAPTURE, devices[i]);
-			add_audio_stream(G_CAPTURE, stream);
-		}
+	// spotlight --transcode <dump> encodes a raw dump and exits
+	if(argc == 3 && strcmp(argv[1], "--transcode") == 0)
+		return spotlight_transcode(configFile, argv[2]) ? 1 : 0;
+
+	// The control signals stay blocked and are only taken while waiting in sigsuspend(),
+	// so none of them can run before the capture is up or while shutting down.
+	// The handlers wait for the capture threads to pause, so they must never run on one of them.
+	// Threads inherit the mask, only the main thread takes the control signals later on.
+	sigset_t signals, waitMask;
+	control_signals(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, &waitMask);
+	for(int sig = 1; sig < NSIG; sig++) {
+		if(sigismember(&signals, sig) == 1)
+			sigdelset(&waitMask, sig);
 	}
-	
-	// Create a new thread for each audio stream
-	for(int i = 0; i < G_CAPTURE->nb_audio_streams; i++) {
-		AudioStream* stream = G_CAPTURE->audio_streams[i];
-		pthread_t thread;
-		pthread_create(&thread, NULL, audio_thread, stream);
+	install_handler(SIGUSR1, save);
+	install_info_handler(SIGUSR2, still);
+	install_handler(SIGHUP, reload);
+	install_handler(SIGINT, stop);
+	install_handler(SIGTERM, stop);
+	install_handler(SIGCHLD, reap_exporters);
+
+	G_CAPTURE = spotlight_init(configFile, SPOTLIGHT_GRAB_X11 | SPOTLIGHT_GRAB_PULSE);
+	if(G_CAPTURE == NULL)
+		exit(1);
+	if(spotlight_start(G_CAPTURE)) {
+		spotlight_shutdown(G_CAPTURE);
+		exit(1);
 	}
 
+	printf("Ready, send SIGUSR1 to save, SIGUSR2 for a still, SIGHUP to reload the config.\n");
+
+	while(!G_STOP) {
+		sigsuspend(&waitMask);
+	}
+	spotlight_shutdown(G_CAPTURE);
+	return 0;
 }
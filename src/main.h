@@ -2,7 +2,6 @@
 #define MAIN_H
 
 #include <X11/Xlib.h>
-#include <X11/extensions/XShm.h>
 
 #include "spotlight.h"
 #include "audio.h"
@@ -0,0 +1,246 @@
+#include "memory.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define MIB (1024 * 1024)
+
+// Works out how much memory one second of window takes up and returns the largest
+// window (up to `windowSize`) that fits into the configured memory-limit. Returns 0 if not even a second fits.
+size_t plan_window_size(size_t windowSize, size_t framerate, size_t frameWidth, size_t frameHeight, enum AVPixelFormat format, AudioDevice **devices, size_t numDevices) {
+	size_t videoSlot = video_slot_size(frameWidth, frameHeight, format);
+	size_t bytesPerSecond = videoSlot * framerate;
+	printf("[MEMORY] Video slot: %zu bytes (%zux%zu %s), %zu slots/s\n", videoSlot, frameWidth, frameHeight, av_get_pix_fmt_name(format), framerate);
+	size_t cropWidth, cropHeight;
+	if(focus_crop_size(&cropWidth, &cropHeight)) {
+		size_t cropSlot = video_slot_size(cropWidth, cropHeight, format);
+		bytesPerSecond += cropSlot * framerate;
+		printf("[MEMORY] Focus crop slot: %zu bytes (%zux%zu)\n", cropSlot, cropWidth, cropHeight);
+	}
+
+	for(size_t i = 0; i < numDevices; i++) {
+		size_t audioBytes = audio_bytes_per_second(devices[i]);
+		bytesPerSecond += audioBytes;
+		printf("[MEMORY] Audio ring (%s): %zu bytes/s\n", devices[i]->name, audioBytes);
+	}
+	printf("[MEMORY] %zu s window takes up %zu MiB\n", windowSize, bytesPerSecond * windowSize / MIB);
+
+	size_t limit = (size_t) cfg_getint(C_SPOTLIGHT_ROOT, "memory-limit") * MIB;
+	// The history tier has a fixed size, the window gets what's left
+	size_t history = history_memory(format);
+	if(history > 0) {
+		printf("[MEMORY] History tier takes up %zu MiB\n", history / MIB);
+		if(limit > 0 && history >= limit) {
+			printf("[MEMORY] memory-limit of %zu MiB can't hold the history tier (%zu MiB)\n", limit / MIB, history / MIB);
+			return 0;
+		}
+		if(limit > 0)
+			limit -= history;
+	}
+	if(limit == 0 || bytesPerSecond * windowSize <= limit) {
+		return windowSize;
+	}
+
+	size_t fitting = limit / bytesPerSecond;
+	if(fitting == 0) {
+		printf("[MEMORY] memory-limit of %zu MiB can't hold a single second (%zu MiB)\n", limit / MIB, bytesPerSecond / MIB);
+		return 0;
+	}
+	printf("[MEMORY] Limiting window to %zu s (%zu MiB) to stay within memory-limit of %zu MiB\n",
+			fitting, bytesPerSecond * fitting / MIB, limit / MIB);
+	return fitting;
+}
+
+// Hands the whole pages inside the range back to the kernel, the edges may be shared with other allocations.
+// The memory stays allocated, its pages are faulted in again on the next write.
+void release_memory(void *data, size_t size) {
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t) data + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t) data + size) & ~(page - 1);
+	if(end > start) {
+		madvise((void*) start, end - start, MADV_DONTNEED);
+	}
+}
+
+// Zeroes the range of an anonymous mapping, the `zeroed` bytes right before it already are.
+// Whole pages of the zeroed run are released instead of written, so a run of small ranges
+// only keeps the pages at its edges resident: the last one is released once the run covers it.
+void clear_memory(void *data, size_t size, size_t zeroed) {
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t from = (uintptr_t) data;
+	uintptr_t to = from + size;
+	uintptr_t start = (from - zeroed + page - 1) & ~(page - 1);
+	uintptr_t end = to & ~(page - 1);
+	// Pages before the one the range starts in were released by earlier calls
+	if(start < (from & ~(page - 1)))
+		start = from & ~(page - 1);
+	if(end <= start) {
+		memset(data, 0, size);
+		return;
+	}
+	if(start > from)
+		memset(data, 0, start - from);
+	madvise((void*) start, end - start, MADV_DONTNEED);
+	memset((void*) end, 0, to - end);
+}
+
+// Hands the pages backing the frame's buffers back to the kernel
+void release_frame_memory(AVFrame *frame) {
+	for(int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+		release_memory(frame->buf[i]->data, frame->buf[i]->size);
+	}
+}
+
+// Changes the number of active slots of a ring with `capacity` allocated frames.
+// The newest frames are moved to the front (oldest first), frames that fall out of
+// the active part are released, so shrinking drops the oldest frames first.
+void resize_frame_ring(AVFrame **frames, size_t capacity, size_t *bufferSize, size_t *writeIndex, size_t *frameCount, size_t newSize) {
+	if(newSize > capacity)
+		newSize = capacity;
+	if(newSize == 0 || newSize == *bufferSize)
+		return;
+
+	size_t oldSize = *bufferSize;
+	size_t valid = *frameCount < oldSize ? *frameCount : oldSize;
+	size_t oldest = *frameCount > oldSize ? *writeIndex : 0;
+	size_t kept = valid < newSize ? valid : newSize;
+
+	AVFrame **ordered = malloc(sizeof(AVFrame*) * capacity);
+	if(ordered == NULL)
+		return;
+	for(size_t i = 0; i < oldSize; i++)
+		ordered[i] = frames[(oldest + i) % oldSize];
+
+	// New order: kept frames, dropped frames, unwritten slots, and the already released slots
+	size_t n = 0;
+	for(size_t i = valid - kept; i < valid; i++)
+		frames[n++] = ordered[i];
+	for(size_t i = 0; i < valid - kept; i++)
+		frames[n++] = ordered[i];
+	for(size_t i = valid; i < oldSize; i++)
+		frames[n++] = ordered[i];
+	free(ordered);
+
+	for(size_t i = newSize; i < oldSize; i++)
+		release_frame_memory(frames[i]);
+
+	*bufferSize = newSize;
+	*writeIndex = kept % newSize;
+	*frameCount = kept;
+}
+
+// Shrinks or grows all rings of the capture to hold `seconds` of data,
+// at most as much as they were allocated for. The capture has to be paused.
+void set_capture_window(Capture *cap, size_t seconds) {
+	int i;
+	for(i = 0; i < cap->nb_video_streams; i++) {
+		VideoStream *video = cap->video_streams[i];
+		size_t frameCount = video->frameCount;
+		resize_frame_ring(video->frameBuffer, video->capacity, &video->bufferSize, &video->writeIndex, &video->frameCount,
+				video->orchestrator->framerate * seconds);
+		restart_video_time(video, frameCount, video->orchestrator->framerate);
+		video->generation++;
+	}
+	for(i = 0; i < cap->nb_audio_streams; i++) {
+		AudioStream *audio = cap->audio_streams[i];
+		resize_sample_ring(audio, audio->sampleRate * seconds);
+	}
+	cap->activeWindow = seconds;
+}
+
+// Returns the share of time (in percent, averaged over 10s) in which some tasks
+// were stalled on memory, or a negative value if PSI isn't available.
+static float read_memory_pressure() {
+	FILE *file = fopen("/proc/pressure/memory", "r");
+	if(file == NULL)
+		return -1.0f;
+	float pressure = -1.0f;
+	if(fscanf(file, "some avg10=%f", &pressure) != 1)
+		pressure = -1.0f;
+	fclose(file);
+	return pressure;
+}
+
+static void *memory_monitor(void *arg) {
+	Capture *cap = arg;
+	while(1) {
+		// The config may be swapped out by a reload, only read it while holding the lock
+		pthread_mutex_lock(&cap->control);
+		unsigned int interval = cfg_getint(C_SPOTLIGHT_ROOT, "pressure-interval");
+		float threshold = cfg_getfloat(C_SPOTLIGHT_ROOT, "pressure-threshold");
+		size_t minimum = cfg_getint(C_SPOTLIGHT_ROOT, "pressure-min-window");
+		pthread_mutex_unlock(&cap->control);
+
+		sleep(interval > 0 ? interval : 1);
+		if(cap->stop)
+			return NULL;
+		if(threshold <= 0.0f)
+			continue;
+		float pressure = read_memory_pressure();
+		if(pressure < 0.0f) {
+			printf("[MEMORY] /proc/pressure/memory is not available, not adapting the window\n");
+			return NULL;
+		}
+
+		// The window is changed by reloads, which hold the lock while they run
+		pthread_mutex_lock(&cap->control);
+		size_t windowSize = cap->windowSize;
+		size_t active = cap->activeWindow;
+		pthread_mutex_unlock(&cap->control);
+
+		size_t step = windowSize / 4 > 0 ? windowSize / 4 : 1;
+		size_t window = active;
+		if(pressure > threshold && window > minimum) {
+			window = window > minimum + step ? window - step : minimum;
+		} else if(pressure < threshold / 2 && window < windowSize) {
+			// Only grow back once the pressure has clearly eased
+			window = window + step < windowSize ? window + step : windowSize;
+		}
+		if(window == active)
+			continue;
+
+		pause_capture(cap);
+		// A reload might have changed the window since it was read, it can't while paused
+		if(window > cap->windowSize)
+			window = cap->windowSize;
+		if(window == cap->activeWindow) {
+			resume_capture(cap);
+			continue;
+		}
+		printf("[MEMORY] Memory pressure at %.2f%%, %s window to %zu s\n", pressure, window < cap->activeWindow ? "shrinking" : "growing", window);
+		set_capture_window(cap, window);
+		resume_capture(cap);
+	}
+	return NULL;
+}
+
+// Starts watching the system's memory pressure, the capture's window is
+// shrunk while it's above `pressure-threshold`.
+void start_memory_monitor(Capture *cap) {
+	pthread_create(&cap->monitorThread, NULL, memory_monitor, cap);
+	cap->monitoring = 1;
+}
+
+// Waits for the monitor to notice the capture is stopping, which takes up to `pressure-interval` seconds.
+// Must be called before pausing the capture, the monitor pauses it itself.
+void stop_memory_monitor(Capture *cap) {
+	cap->stop = 1;
+	if(cap->monitoring) {
+		pthread_join(cap->monitorThread, NULL);
+		cap->monitoring = 0;
+	}
+}
+
+// Bytes of the process currently held in memory
+size_t resident_memory() {
+	FILE *file = fopen("/proc/self/statm", "r");
+	if(file == NULL)
+		return 0;
+	size_t pages = 0;
+	if(fscanf(file, "%*zu %zu", &pages) != 1)
+		pages = 0;
+	fclose(file);
+	return pages * sysconf(_SC_PAGESIZE);
+}
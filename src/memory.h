@@ -0,0 +1,16 @@
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+#include "spotlight.h"
+
+size_t plan_window_size(size_t, size_t, size_t, size_t, enum AVPixelFormat, struct AudioDevice**, size_t);
+void release_memory(void*, size_t);
+void clear_memory(void*, size_t, size_t);
+void release_frame_memory(AVFrame*);
+void resize_frame_ring(AVFrame**, size_t, size_t*, size_t*, size_t*, size_t);
+void set_capture_window(Capture*, size_t);
+void start_memory_monitor(Capture*);
+void stop_memory_monitor(Capture*);
+size_t resident_memory();
+
+#endif
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include "placement.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+// glibc has no wrapper for ioprio_set
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+static const char *THREAD_CLASS_NAMES[] = { "capture", "audio", "export" };
+
+// Parses a kernel style cpu list ("0-3,8,10-11") into `set`, returns -1 on a malformed list.
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+	const char *p = list;
+	while(*p != '\0' && *p != '\n') {
+		char *end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if(end == p)
+			return -1;
+		if(*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if(end == p)
+				return -1;
+		}
+		for(long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, set);
+		}
+		p = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+}
+
+static int read_sysfs_line(const char *path, char *buffer, size_t size) {
+	FILE *file = fopen(path, "r");
+	if(file == NULL)
+		return -1;
+	int ok = fgets(buffer, size, file) != NULL;
+	fclose(file);
+	return ok ? 0 : -1;
+}
+
+// Fills `domain` with the cpus sharing `cpu`'s last level cache.
+// Falls back to the cpu itself if sysfs has no cache information.
+static void cache_domain(int cpu, cpu_set_t *domain) {
+	char path[256];
+	char line[256];
+	int best = -1;
+	CPU_ZERO(domain);
+	for(int index = 0; ; index++) {
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/level", cpu, index);
+		if(read_sysfs_line(path, line, sizeof(line)) != 0)
+			break;
+		int level = atoi(line);
+		if(level <= best)
+			continue;
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+		if(read_sysfs_line(path, line, sizeof(line)) != 0)
+			continue;
+		cpu_set_t shared;
+		CPU_ZERO(&shared);
+		if(parse_cpu_list(line, &shared) == 0) {
+			best = level;
+			*domain = shared;
+		}
+	}
+	if(best < 0)
+		CPU_SET(cpu, domain);
+}
+
+static int online_cpus(cpu_set_t *set) {
+	char line[256];
+	CPU_ZERO(set);
+	if(read_sysfs_line(SYSFS_CPU "/online", line, sizeof(line)) != 0 || parse_cpu_list(line, set) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Finds the `n`-th last level cache domain, domains are numbered by their lowest cpu.
+static int nth_cache_domain(int n, cpu_set_t *domain) {
+	cpu_set_t online, seen;
+	if(online_cpus(&online) != 0)
+		return -1;
+	CPU_ZERO(&seen);
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(!CPU_ISSET(cpu, &online) || CPU_ISSET(cpu, &seen))
+			continue;
+		cache_domain(cpu, domain);
+		if(n-- == 0)
+			return 0;
+		CPU_OR(&seen, &seen, domain);
+	}
+	return -1;
+}
+
+// Parses the `cpus` option: a cpu list, optionally mixed with whole cache domains ("l3:0,6-7").
+static int parse_placement(const char *cpus, cpu_set_t *set) {
+	char *copy = strdup(cpus);
+	char *save = NULL;
+	int ret = 0;
+	CPU_ZERO(set);
+	for(char *item = strtok_r(copy, ",", &save); item != NULL && ret == 0; item = strtok_r(NULL, ",", &save)) {
+		while(*item == ' ')
+			item++;
+		if(strncmp(item, "l3:", 3) == 0) {
+			cpu_set_t domain;
+			ret = nth_cache_domain(atoi(item + 3), &domain);
+			if(ret == 0)
+				CPU_OR(set, set, &domain);
+		} else {
+			ret = parse_cpu_list(item, set);
+		}
+	}
+	free(copy);
+	return ret;
+}
+
+static void format_cpu_set(cpu_set_t *set, char *buffer, size_t size) {
+	size_t length = 0;
+	buffer[0] = '\0';
+	for(int cpu = 0; cpu < CPU_SETSIZE && length < size; cpu++) {
+		if(!CPU_ISSET(cpu, set))
+			continue;
+		int last = cpu;
+		while(last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+			last++;
+		if(last == cpu)
+			length += snprintf(buffer + length, size - length, "%s%d", length ? "," : "", cpu);
+		else
+			length += snprintf(buffer + length, size - length, "%s%d-%d", length ? "," : "", cpu, last);
+		cpu = last;
+	}
+}
+
+// Lists the cache domains that can be referred to as `l3:<n>` in the config.
+void print_cpu_topology() {
+	cpu_set_t domain;
+	char cpus[256];
+	for(int n = 0; nth_cache_domain(n, &domain) == 0; n++) {
+		format_cpu_set(&domain, cpus, sizeof(cpus));
+		printf("[SCHED] Cache domain l3:%d: cpus %s\n", n, cpus);
+	}
+}
+
+static int parse_policy(const char *policy) {
+	if(strcmp(policy, "fifo") == 0)
+		return SCHED_FIFO;
+	if(strcmp(policy, "rr") == 0)
+		return SCHED_RR;
+	if(strcmp(policy, "batch") == 0)
+		return SCHED_BATCH;
+	if(strcmp(policy, "idle") == 0)
+		return SCHED_IDLE;
+	return SCHED_OTHER;
+}
+
+static int parse_io_class(const char *class) {
+	if(strcmp(class, "realtime") == 0)
+		return 1;
+	if(strcmp(class, "best-effort") == 0)
+		return 2;
+	if(strcmp(class, "idle") == 0)
+		return 3;
+	return 0;
+}
+
+// Applies the placement configured for `class` to the calling thread.
+// Threads a thread creates inherit all of this, which is what moves the
+// encoders' own worker threads along with the export threads.
+// Anything the process isn't permitted to do is reported and skipped.
+void place_thread(ThreadClass class) {
+	const char *name = THREAD_CLASS_NAMES[class];
+	cfg_t *section = cfg_getsec(C_SCHEDULING_ROOT, name);
+	if(section == NULL)
+		return;
+	pid_t tid = syscall(SYS_gettid);
+
+	const char *cpus = cfg_getstr(section, "cpus");
+	if(cpus != NULL && cpus[0] != '\0') {
+		cpu_set_t set;
+		if(parse_placement(cpus, &set) != 0 || CPU_COUNT(&set) == 0) {
+			printf("[SCHED] Invalid cpus \"%s\" for %s threads\n", cpus, name);
+		} else {
+			int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			if(ret != 0)
+				printf("[SCHED] Couldn't pin %s thread to cpus %s: %s\n", name, cpus, strerror(ret));
+		}
+	}
+
+	int policy = parse_policy(cfg_getstr(section, "policy"));
+	if(policy != SCHED_OTHER) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		if(policy == SCHED_FIFO || policy == SCHED_RR)
+			param.sched_priority = cfg_getint(section, "priority");
+		int ret = pthread_setschedparam(pthread_self(), policy, &param);
+		if(ret != 0)
+			printf("[SCHED] Couldn't set %s scheduling for %s thread: %s\n", cfg_getstr(section, "policy"), name, strerror(ret));
+	}
+
+	// On Linux the nice value is per thread
+	int nice = cfg_getint(section, "nice");
+	if(nice != 0 && setpriority(PRIO_PROCESS, tid, nice) != 0)
+		printf("[SCHED] Couldn't set nice %d for %s thread: %s\n", nice, name, strerror(errno));
+
+	int ioClass = parse_io_class(cfg_getstr(section, "io-class"));
+	if(ioClass != 0) {
+		int ioprio = (ioClass << IOPRIO_CLASS_SHIFT) | cfg_getint(section, "io-priority");
+		if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio) != 0)
+			printf("[SCHED] Couldn't set io-class %s for %s thread: %s\n", cfg_getstr(section, "io-class"), name, strerror(errno));
+	}
+}
+
+// Moves the whole process into a cgroup (v2) by its directory, so its cpu and memory can be limited
+// apart from the capture. The cgroup has to exist and be writable by the user.
+void join_cgroup(const char *cgroup) {
+	if(cgroup == NULL || cgroup[0] == '\0')
+		return;
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup);
+	FILE *file = fopen(path, "w");
+	if(file == NULL) {
+		printf("[SCHED] Couldn't join cgroup %s: %s\n", cgroup, strerror(errno));
+		return;
+	}
+	fprintf(file, "%d\n", getpid());
+	// The kernel only checks the write once it's flushed
+	if(fclose(file) != 0)
+		printf("[SCHED] Couldn't join cgroup %s: %s\n", cgroup, strerror(errno));
+}
@@ -0,0 +1,18 @@
+#ifndef PLACEMENT_H_
+#define PLACEMENT_H_
+
+#include "spotlight.h"
+
+// Every thread spotlight starts belongs to one of these, each with its own
+// section in `scheduling` in the config.
+typedef enum ThreadClass {
+	THREAD_CAPTURE,
+	THREAD_AUDIO,
+	THREAD_EXPORT
+} ThreadClass;
+
+void print_cpu_topology();
+void place_thread(ThreadClass);
+void join_cgroup(const char*);
+
+#endif
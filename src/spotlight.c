@@ -1,16 +1,25 @@
 #include "spotlight.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
 
 void free_video_stream(VideoStream*);
 
 cfg_t *C_CONFIG;
+// The config replaced by the last reload, see reload_config()
+static cfg_t *C_PREVIOUS_CONFIG;
 cfg_t *C_CAPTURE_ROOT;
 cfg_t *C_SCALE_ROOT;
 cfg_t *C_SPOTLIGHT_ROOT;
 cfg_t *C_AUDIO_ROOT;
 cfg_t *C_CODEC_ROOT;
 cfg_t *C_EXPORT_ROOT;
+cfg_t *C_SCHEDULING_ROOT;
 
 const char* const SPOTLIGHT_CONFIG_FILE = "~/.config/spotlight/config.cfg";
+// Embedding applications can use their own config file
+const char *C_CONFIG_FILE = SPOTLIGHT_CONFIG_FILE;
 
 cfg_t* SPOTLIGHT_CONFIG;
 
@@ -19,7 +28,17 @@ cfg_opt_t capture_opts[] = {
 	CFG_INT("y", 0, CFGF_NONE),
 	CFG_INT("width", 1920, CFGF_NONE),
 	CFG_INT("height", 1080, CFGF_NONE),
+	CFG_STR("window", "", CFGF_NONE),
+	CFG_STR("pixel-format", "auto", CFGF_NONE),
 	CFG_SEC("scale", scale_opts, CFGF_NONE),
+	CFG_SEC("focus", focus_opts, CFGF_NONE),
+	CFG_END()
+};
+
+cfg_opt_t focus_opts[] = {
+	CFG_INT("width", 0, CFGF_NONE),
+	CFG_INT("height", 0, CFGF_NONE),
+	CFG_STR("follow", "pointer", CFGF_NONE),
 	CFG_END()
 };
 
@@ -29,11 +48,24 @@ cfg_opt_t scale_opts[] = {
 	CFG_END()
 };
 
+cfg_opt_t history_opts[] = {
+	CFG_INT("window-size", 0, CFGF_NONE),
+	CFG_INT("framerate", 10, CFGF_NONE),
+	CFG_SEC("scale", scale_opts, CFGF_NONE),
+	CFG_END()
+};
+
 cfg_opt_t spotlight_opts[] = {
 	CFG_INT("framerate", 30, CFGF_NONE),
 	CFG_INT("window-size", 30, CFGF_NONE),
 	CFG_INT("threads", 3, CFGF_NONE),
+	CFG_INT("memory-limit", 0, CFGF_NONE),
+	CFG_FLOAT("pressure-threshold", 0.0, CFGF_NONE),
+	CFG_INT("pressure-min-window", 10, CFGF_NONE),
+	CFG_INT("pressure-interval", 2, CFGF_NONE),
+	CFG_INT("trace-events", 0, CFGF_NONE),
 	CFG_SEC("capture", capture_opts, CFGF_NONE),
+	CFG_SEC("history", history_opts, CFGF_NONE),
 	CFG_SEC("audio", audio_opts, CFGF_NONE),
 	CFG_END()
 };
@@ -42,13 +74,15 @@ cfg_opt_t audio_opts[] = {
 	CFG_STR("codec", "aac", CFGF_NONE),
 	CFG_STR_LIST("merge", "", CFGF_NONE),
 	CFG_INT("bitrate", 64000, CFGF_NONE),
+	CFG_FLOAT("silence-threshold", -96.0, CFGF_NONE),
+	CFG_STR("silent-tracks", "keep", CFGF_NONE),
 	CFG_SEC("device", audio_device_opts, CFGF_TITLE | CFGF_MULTI),
 	CFG_END()
 };
 
 cfg_opt_t audio_device_opts[] = {
 	CFG_STR("name", NULL, CFGF_NONE),
-	CFG_STR("channels", "stereo", CFGF_NONE),
+	CFG_STR("channels", "native", CFGF_NONE),
 	CFG_END()
 };
 
@@ -60,8 +94,71 @@ cfg_opt_t codec_opts[] = {
 	CFG_END()
 };
 
+cfg_opt_t rendition_opts[] = {
+	CFG_STR("codec", "libx264", CFGF_NONE),
+	CFG_STR("container", "mp4", CFGF_NONE),
+	CFG_INT("bitrate", 4000000, CFGF_NONE),
+	CFG_INT("audio-bitrate", 0, CFGF_NONE),
+	CFG_SEC("scale", scale_opts, CFGF_NONE),
+	CFG_SEC("options", NULL, CFGF_KEYSTRVAL | CFGF_IGNORE_UNKNOWN),
+	CFG_END()
+};
+
+cfg_opt_t still_opts[] = {
+	CFG_STR("format", "png", CFGF_NONE),
+	CFG_FLOAT("offset", 0.0, CFGF_NONE),
+	CFG_BOOL("upscale", cfg_false, CFGF_NONE),
+	CFG_END()
+};
+
+cfg_opt_t sink_opts[] = {
+	CFG_STR("type", "file", CFGF_NONE),
+	CFG_STR("address", "", CFGF_NONE),
+	CFG_END()
+};
+
+cfg_opt_t adaptive_opts[] = {
+	CFG_BOOL("enabled", cfg_false, CFGF_NONE),
+	CFG_FLOAT("scene-cut", 24.0, CFGF_NONE),
+	CFG_FLOAT("static-level", 0.5, CFGF_NONE),
+	CFG_INT("max-gop", 10, CFGF_NONE),
+	CFG_BOOL("drop-duplicates", cfg_true, CFGF_NONE),
+	CFG_END()
+};
+
 cfg_opt_t export_opts[] = {
 	CFG_STR("directory", "~/Videos/", CFGF_NONE),
+	CFG_SEC("rendition", rendition_opts, CFGF_TITLE | CFGF_MULTI),
+	CFG_SEC("still", still_opts, CFGF_NONE),
+	CFG_SEC("sink", sink_opts, CFGF_NONE),
+	CFG_SEC("adaptive", adaptive_opts, CFGF_NONE),
+	CFG_INT("buffer-size", 8, CFGF_NONE),
+	CFG_INT("queue-size", 512, CFGF_NONE),
+	CFG_BOOL("preallocate", cfg_true, CFGF_NONE),
+	CFG_BOOL("fragment", cfg_false, CFGF_NONE),
+	CFG_FLOAT("fragment-duration", 1.0, CFGF_NONE),
+	CFG_BOOL("process", cfg_false, CFGF_NONE),
+	CFG_BOOL("dump", cfg_false, CFGF_NONE),
+	CFG_STR("cgroup", "", CFGF_NONE),
+	CFG_BOOL("pre-encode", cfg_false, CFGF_NONE),
+	CFG_INT("pre-encode-chunk", 2, CFGF_NONE),
+	CFG_END()
+};
+
+cfg_opt_t thread_class_opts[] = {
+	CFG_STR("cpus", "", CFGF_NONE),
+	CFG_STR("policy", "other", CFGF_NONE),
+	CFG_INT("priority", 10, CFGF_NONE),
+	CFG_INT("nice", 0, CFGF_NONE),
+	CFG_STR("io-class", "", CFGF_NONE),
+	CFG_INT("io-priority", 4, CFGF_NONE),
+	CFG_END()
+};
+
+cfg_opt_t scheduling_opts[] = {
+	CFG_SEC("capture", thread_class_opts, CFGF_NONE),
+	CFG_SEC("audio", thread_class_opts, CFGF_NONE),
+	CFG_SEC("export", thread_class_opts, CFGF_NONE),
 	CFG_END()
 };
 
@@ -69,6 +166,7 @@ cfg_opt_t config_opts[] = {
 	CFG_SEC("spotlight", spotlight_opts, CFGF_NONE),
 	CFG_SEC("codec", codec_opts, CFGF_NONE),
 	CFG_SEC("export", export_opts, CFGF_NONE),
+	CFG_SEC("scheduling", scheduling_opts, CFGF_NONE),
 	CFG_END()
 };
 
@@ -78,12 +176,7 @@ int init_config() {
 	C_CONFIG = cfg_init(config_opts, CFGF_NONE);
 	return C_CONFIG != NULL;
 }
-int load_config() {
-	if(cfg_parse(C_CONFIG, SPOTLIGHT_CONFIG_FILE) == CFG_PARSE_ERROR) {
-		printf("Error parsing config file: %s\n", SPOTLIGHT_CONFIG_FILE);
-		exit(1);
-	}
-	
+static void load_config_sections() {
 	/* Initialize global config sections */
 	C_SPOTLIGHT_ROOT = cfg_getsec(C_CONFIG, "spotlight");
 	C_CAPTURE_ROOT = cfg_getsec(C_SPOTLIGHT_ROOT, "capture");
@@ -91,12 +184,60 @@ int load_config() {
 	C_AUDIO_ROOT = cfg_getsec(C_SPOTLIGHT_ROOT, "audio");
 	C_CODEC_ROOT = cfg_getsec(C_CONFIG, "codec");
 	C_EXPORT_ROOT = cfg_getsec(C_CONFIG, "export");
+	C_SCHEDULING_ROOT = cfg_getsec(C_CONFIG, "scheduling");
+}
+
+int load_config() {
+	if(cfg_parse(C_CONFIG, C_CONFIG_FILE) == CFG_PARSE_ERROR) {
+		printf("Error parsing config file: %s\n", C_CONFIG_FILE);
+		return 1;
+	}
+	load_config_sections();
+
+	return 0;
+}
+
+// Parses the config file again and swaps it in.
+// If the file can't be parsed, the current config stays active and 1 is returned.
+// The capture has to be paused: running threads only read the config while holding its control lock.
+// The replaced config is freed on the next reload, so strings read from it just before the pause stay valid.
+int reload_config() {
+	cfg_t *config = cfg_init(config_opts, CFGF_NONE);
+	if(config == NULL) {
+		return 1;
+	}
+	if(cfg_parse(config, C_CONFIG_FILE) == CFG_PARSE_ERROR) {
+		printf("Error parsing config file: %s, keeping the current config\n", C_CONFIG_FILE);
+		cfg_free(config);
+		return 1;
+	}
 
+	// Don't swap in a config we couldn't export with
+	cfg_t *codec = cfg_getsec(config, "codec");
+	cfg_t *audio = cfg_getsec(cfg_getsec(config, "spotlight"), "audio");
+	if(avcodec_find_encoder_by_name(cfg_getstr(codec, "name")) == NULL
+			|| avcodec_find_encoder_by_name(cfg_getstr(audio, "codec")) == NULL
+			|| av_guess_format(cfg_getstr(codec, "container"), NULL, NULL) == NULL) {
+		printf("Unknown codec or container in %s, keeping the current config\n", C_CONFIG_FILE);
+		cfg_free(config);
+		return 1;
+	}
+
+	if(C_PREVIOUS_CONFIG != NULL)
+		cfg_free(C_PREVIOUS_CONFIG);
+	C_PREVIOUS_CONFIG = C_CONFIG;
+	C_CONFIG = config;
+	load_config_sections();
 	return 0;
 }
 
 void free_config() {
-	cfg_free(SPOTLIGHT_CONFIG);
+	if(C_PREVIOUS_CONFIG != NULL)
+		cfg_free(C_PREVIOUS_CONFIG);
+	C_PREVIOUS_CONFIG = NULL;
+	if(C_CONFIG != NULL)
+		cfg_free(C_CONFIG);
+	C_CONFIG = NULL;
 }
 
 Capture *alloc_capture() {
@@ -106,24 +247,38 @@ Capture *alloc_capture() {
 	capture->nb_audio_streams = 0;
 	capture->audio_streams = NULL;
 	
-	capture->formatContext = NULL;
+	capture->nb_renditions = 0;
+	capture->renditions = NULL;
+	capture->writers = 0;
+	capture->standbyPending = 0;
+	capture->monitoring = 0;
+	capture->stop = 0;
+	capture->saves = 0;
+	capture->pixelFormat = AV_PIX_FMT_YUV420P;
 
 	capture->windowSize = cfg_getint(C_SPOTLIGHT_ROOT, "window-size");
+	capture->activeWindow = capture->windowSize;
 	capture->framerate = cfg_getint(C_SPOTLIGHT_ROOT, "framerate");
-
-	avformat_alloc_output_context2(&capture->formatContext, NULL, cfg_getstr(C_CODEC_ROOT, "container"), NULL);
-	if(!capture->formatContext) {
-		printf("Error allocating output context\n");
-		exit(1);
-	}
-
-	
+	pthread_mutex_init(&capture->control, NULL);
 
 	return capture;
 }
 
+static void free_capture_output(Capture *capture) {
+	for(int i = 0; i < capture->nb_renditions; i++) {
+		free_rendition(capture->renditions[i]);
+	}
+	free(capture->renditions);
+	capture->renditions = NULL;
+	capture->nb_renditions = 0;
+}
+
+// Stops all capture threads and frees the capture.
+// The capture has to be paused and the memory monitor stopped.
 void free_capture(Capture *capture) {
 	int i;
+	wait_for_standby_output(capture);
+	free_capture_output(capture);
 	for(i = 0; i < capture->nb_video_streams; i++) {
 		free_video_stream(capture->video_streams[i]);
 	}
@@ -132,8 +287,8 @@ void free_capture(Capture *capture) {
 		free_audio_stream(capture->audio_streams[i]);
 	}
 	free(capture->audio_streams);
-	avio_close(capture->formatContext->pb);
-	avformat_free_context(capture->formatContext);
+	pthread_mutex_unlock(&capture->control);
+	pthread_mutex_destroy(&capture->control);
 	free(capture);
 }
 
@@ -141,98 +296,245 @@ void add_video_stream(Capture *capture, VideoStream *videoStream) {
 	capture->video_streams = realloc(capture->video_streams, sizeof(VideoStream*) * (capture->nb_video_streams + 1));
 	capture->video_streams[capture->nb_video_streams] = videoStream;
 	capture->nb_video_streams++;
-	// Open the AVStream for this object
-	if(open_video_stream(capture, videoStream)) {
-		fprintf(stderr, "Error opening video stream\n");
-		exit(1);
-	}
 }
 
 void add_audio_stream(Capture *capture, AudioStream *audioStream) {
-	capture->audio_streams = realloc(capture->audio_streams, sizeof(VideoStream*) * (capture->nb_audio_streams + 1));
+	capture->audio_streams = realloc(capture->audio_streams, sizeof(AudioStream*) * (capture->nb_audio_streams + 1));
 	capture->audio_streams[capture->nb_audio_streams] = audioStream;
 	capture->nb_audio_streams++;
-	// Open the AVStream for this object
-	// TODO: Horrible, for the love of god, fix this.
-	// Unlike the VideoStream, we don't know how many buffer AVFrame*s
-	// we need for the configured window size, so the alloc_audio_stream() method
-	// HAS to open the codec and it's context to get the frame size.
-	// Ideally, we want to have the same application flow as the VideoStream,
-	// but for now, I'll just leave it at this.
-	/*if(open_audio_stream(capture, audioStream)) {
-		fprintf(stderr, "Error opening audio stream\n");
-		exit(1);
-	}*/
-}
-
-void flush_capture(Capture* cap, char* file) {
-	printf("[CAPTURE] Flushing capture into %s\n", file);
-	avio_open(&cap->formatContext->pb, file, AVIO_FLAG_WRITE);
-	if(avformat_write_header(cap->formatContext, NULL) < 0) {
-		printf("Error writing header\n");
-		exit(1);
-	}
-	// Flushes all streams in the capture
+}
+
+// Encodes the paused capture into every rendition, all renditions are encoded in parallel.
+// Returns the number of renditions that couldn't be exported.
+int flush_capture(Capture* cap, time_t timestamp) {
+	struct timespec start, end;
 	int i;
-	for(i = 0; i < cap->nb_video_streams; i++) {
-		flush_video_stream(cap->video_streams[i]);
+	int failed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// A raw dump only takes as long as the disk does, it's encoded later with --transcode
+	if(cfg_getbool(C_EXPORT_ROOT, "dump")) {
+		failed = dump_capture(cap, timestamp);
+	} else {
+		// Every rendition encodes the same frames, they're analysed once for all of them
+		for(i = 0; i < cap->nb_video_streams; i++) {
+			plan_video_export(cap->video_streams[i]);
+		}
+		for(i = 0; i < cap->nb_renditions; i++) {
+			char *file = generate_output_filename(timestamp, cap->renditions[i]);
+			printf("[CAPTURE] Flushing capture into %s\n", file);
+			start_rendition_export(cap->renditions[i], file);
+			free(file);
+		}
+		for(i = 0; i < cap->nb_renditions; i++) {
+			if(finish_rendition_export(cap->renditions[i])) {
+				printf("[CAPTURE] Error exporting rendition %s\n", cap->renditions[i]->name ? cap->renditions[i]->name : "main");
+				failed++;
+			}
+		}
 	}
-	for(i = 0; i < cap->nb_audio_streams; i++) {
-		flush_audio_stream(cap->audio_streams[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// Logged on every save so long runs can be checked for slowdowns and leaks
+	cap->saves++;
+	double elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+	printf("[CAPTURE] Save #%d took %.0f ms, RSS %zu MiB\n", cap->saves, elapsed, resident_memory() / (1024 * 1024));
+
+	// The trace is written next to the main output: output-2023-06-26T21:10:15.mp4.trace.json
+	if(G_TRACE_ENABLED && cap->nb_renditions > 0) {
+		char *file = generate_output_filename(timestamp, cap->renditions[0]);
+		char *trace = malloc(strlen(file) + sizeof(".trace.json"));
+		sprintf(trace, "%s.trace.json", file);
+		if(trace_dump(trace) == 0)
+			printf("[TRACE] Wrote %s\n", trace);
+		free(trace);
+		free(file);
 	}
+	return failed;
+}
 
-	av_write_trailer(cap->formatContext);
-	avio_close(cap->formatContext->pb);
-	
-	// Reset the AVFormatContext as encoding more videos with the same context will cause errors
-	// (A bunch of "Application provided invalid, non monotonically increasing dts to muxer in stream 0")
-	// As described here: https://stackoverflow.com/questions/53004170/c-ffmpeg-how-to-continue-encoding-after-flushing
-	avformat_free_context(cap->formatContext);
+// Exports the paused capture from a forked copy of the process and returns its pid, or -1.
+// The copy sees the rings as they were when it was forked, copy-on-write keeps them that way
+// while the capture goes on. A crash or running out of memory during the export only takes down the copy.
+pid_t fork_export(Capture *cap, time_t timestamp) {
+	// Anything still buffered would be printed twice
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid < 0) {
+		printf("[EXPORT] Error starting exporter process: %s\n", strerror(errno));
+		return -1;
+	}
+	if(pid > 0) {
+		cap->saves++;
+		printf("[EXPORT] Exporter process %d started\n", pid);
+		return pid;
+	}
+
+	// Only this thread exists in the copy, none of the capture's or encoders' threads do.
+	// The capture stays paused here, so nothing waits for them.
+	prctl(PR_SET_NAME, "spotlight-export");
+	join_cgroup(cfg_getstr(C_EXPORT_ROOT, "cgroup"));
+	place_thread(THREAD_EXPORT);
+	trace_thread_name("exporter", -1);
+	cap->renditions = NULL;
+	cap->nb_renditions = 0;
+	int failed = reopen_capture_output(cap) || flush_capture(cap, timestamp);
+	fflush(stdout);
+	// Skip the exit handlers, the X and PulseAudio connections belong to the capture
+	_exit(failed ? 1 : 0);
+}
 
-	AVFormatContext *replacement;
-	avformat_alloc_output_context2(&replacement, NULL, cfg_getstr(C_CODEC_ROOT, "container"), NULL);
-	cap->formatContext = replacement;
+static void *standby_output_thread(void *arg) {
+	// The encoders' own threads are started from here and inherit the export placement
+	place_thread(THREAD_EXPORT);
+	return (void*) (intptr_t) reopen_capture_output(arg);
+}
 
-	if(!cap->formatContext) {
-		printf("Error allocating output context\n");
-		exit(1);
+// Opens the output and encoders for the next save in the background,
+// so the capture can resume right after a save instead of waiting for them.
+void prepare_standby_output(Capture *cap) {
+	// Exporter processes open their own output
+	if(cfg_getbool(C_EXPORT_ROOT, "process")) {
+		free_capture_output(cap);
+		return;
 	}
+	cap->standbyPending = 1;
+	pthread_create(&cap->standbyThread, NULL, standby_output_thread, cap);
+}
 
-	// Re open streams for video and audio
-	for(i = 0; i < cap->nb_video_streams; i++) {
-		if(open_video_stream(cap, cap->video_streams[i])) {
-			fprintf(stderr, "Error opening video stream\n");
-			exit(1);
-		}
+// Blocks until the output prepared by prepare_standby_output() is ready.
+// Has to be called before anything touches the capture's output or reloads the config.
+// Returns 1 if the output couldn't be opened, the capture has no renditions then.
+int wait_for_standby_output(Capture *cap) {
+	void *failed = NULL;
+	if(cap->standbyPending) {
+		pthread_join(cap->standbyThread, &failed);
+		cap->standbyPending = 0;
 	}
-	for(i = 0; i < cap->nb_audio_streams; i++) {
-		if(open_audio_stream(cap, cap->audio_streams[i])) {
-			fprintf(stderr, "Error opening audio stream\n");
-			exit(1);
+	return failed != NULL;
+}
+
+// Replaces the capture's renditions with fresh ones, opened with the current config.
+// Encoders can't be re-used once they've been flushed, so this runs after every save.
+// Returns 1 if a rendition can't be opened, none are kept then.
+int reopen_capture_output(Capture *cap) {
+	free_capture_output(cap);
+
+	int renditions = cfg_size(C_EXPORT_ROOT, "rendition");
+	cap->renditions = malloc(sizeof(Rendition*) * (renditions + 1));
+	for(int i = 0; i <= renditions; i++) {
+		cfg_t *section = i == 0 ? C_CODEC_ROOT : cfg_getnsec(C_EXPORT_ROOT, "rendition", i - 1);
+		Rendition *rendition = open_rendition(cap, section);
+		if(rendition == NULL) {
+			printf("Error opening rendition %s\n", i == 0 ? "main" : cfg_title(section));
+			free_capture_output(cap);
+			return 1;
 		}
+		cap->renditions[cap->nb_renditions++] = rendition;
 	}
+	return 0;
 }
 
+// Called by the capture threads before they write into a ring.
+// Returns 0 if the capture is paused, in which case the ring must not be touched.
+int begin_ring_write(Capture *cap) {
+	__atomic_add_fetch(&cap->writers, 1, __ATOMIC_SEQ_CST);
+	if(cap->pause) {
+		end_ring_write(cap);
+		return 0;
+	}
+	return 1;
+}
 
-char* generate_output_filename() {
-	time_t rawtime;
-	struct tm* timeinfo;
-	char* file = malloc(sizeof(char) * 100); // Adjust the size as needed
-	char* filename = malloc(sizeof(char) * 100); // Adjust the size as needed
-	char* base = cfg_getstr(C_EXPORT_ROOT, "directory");
+void end_ring_write(Capture *cap) {
+	__atomic_sub_fetch(&cap->writers, 1, __ATOMIC_SEQ_CST);
+}
 
-	if (filename == NULL) {
-		fprintf(stderr, "Failed to allocate memory for filename\n");
-		return NULL;
+// Stops the capture threads and waits until none of them is still writing into a ring,
+// after this returns the rings can safely be read or re-allocated.
+// Pauses don't nest, whoever pauses the capture holds it until resume_capture().
+void pause_capture(Capture *cap) {
+	pthread_mutex_lock(&cap->control);
+	cap->pause = 1;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&cap->writers, __ATOMIC_SEQ_CST) > 0);
+}
+
+void resume_capture(Capture *cap) {
+	cap->pause = 0;
+	pthread_mutex_unlock(&cap->control);
+}
+
+// Lets a capture thread sit out a pause without spinning, a spinning
+// real-time thread would starve the export running on the same cpu.
+void wait_for_resume(Capture *cap) {
+	while(cap->pause == 1) {
+		usleep(1000);
+	}
+}
+
+// Applies a freshly reloaded config to a running capture.
+// The rings are resized in place, the output has to be re-opened afterwards
+// with prepare_standby_output(). The capture has to be paused.
+// Returns 1 if the new settings couldn't be applied to every ring.
+int reconfigure_capture(Capture *cap) {
+	size_t windowSize = cfg_getint(C_SPOTLIGHT_ROOT, "window-size");
+	size_t framerate = cfg_getint(C_SPOTLIGHT_ROOT, "framerate");
+	int i;
+
+	// Re-plan the window against the memory-limit with the new settings
+	size_t frameWidth, frameHeight;
+	configured_frame_size(&frameWidth, &frameHeight);
+	AudioDevice **devices = malloc(sizeof(AudioDevice*) * cap->nb_audio_streams);
+	for(i = 0; i < cap->nb_audio_streams; i++) {
+		devices[i] = cap->audio_streams[i]->device;
+	}
+	windowSize = plan_window_size(windowSize, framerate, frameWidth, frameHeight, cap->pixelFormat, devices, cap->nb_audio_streams);
+	free(devices);
+	if(windowSize == 0) {
+		printf("[CAPTURE] The new window doesn't fit, keeping the rings as they are\n");
+		return 1;
 	}
+	if(negotiate_ring_format() != cap->pixelFormat)
+		printf("[VIDEO] Changing the ring's pixel format requires a restart, keeping %s\n", av_get_pix_fmt_name(cap->pixelFormat));
 
-	time(&rawtime);
-	timeinfo = localtime(&rawtime);
-	strftime(filename, 100, "%FT%T", timeinfo);
+	// Start from the fully grown rings, the memory monitor shrinks them again if needed
+	set_capture_window(cap, cap->windowSize);
 
+	int failed = 0;
+	for(i = 0; i < cap->nb_video_streams; i++) {
+		failed |= resize_video_stream(cap->video_streams[i], framerate, windowSize);
+	}
+	// Keep the old timing if a ring couldn't be resized, otherwise the
+	// video tracks would be encoded at the wrong rate
+	if(!failed) {
+		cap->windowSize = windowSize;
+		cap->framerate = framerate;
+	}
+	cap->activeWindow = cap->windowSize;
+
+	for(i = 0; i < cap->nb_audio_streams; i++) {
+		failed |= resize_audio_stream(cap->audio_streams[i], cap->windowSize);
+	}
+	printf("[CAPTURE] Configuration reloaded%s\n", failed ? ", some rings kept their old size" : "");
+	return failed;
+}
 
-	sprintf(file, "%s/output-%s.%s", base, filename, cfg_getstr(C_CODEC_ROOT, "container"));
-	free(filename);
+// Builds the path of the file a rendition is exported to, renditions other
+// than the main one get their name appended: output-2023-06-26T21:10:15-chat.mp4
+char* generate_output_filename(time_t timestamp, Rendition *rendition) {
+	char date[64];
+	char* base = cfg_getstr(C_EXPORT_ROOT, "directory");
+	const char* name = rendition->name ? rendition->name : "";
+
+	strftime(date, sizeof(date), "%FT%T", localtime(&timestamp));
+
+	size_t length = strlen(base) + strlen(date) + strlen(name) + strlen(rendition->container) + sizeof("/output-.-");
+	char* file = malloc(length);
+	if (file == NULL) {
+		fprintf(stderr, "Failed to allocate memory for filename\n");
+		return NULL;
+	}
+	sprintf(file, "%s/output-%s%s%s.%s", base, date, rendition->name ? "-" : "", name, rendition->container);
 
 	return file;
 }
@@ -10,18 +10,28 @@
 #include <libavformat/avformat.h>
 #include <time.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 extern const char* const SPOTLIGHT_CONFIG_FILE;
+extern const char *C_CONFIG_FILE;
 extern cfg_t* C_CONFIG;
 
 extern cfg_opt_t capture_opts[];
 extern cfg_opt_t scale_opts[];
+extern cfg_opt_t focus_opts[];
 extern cfg_opt_t spotlight_opts[];
+extern cfg_opt_t history_opts[];
 extern cfg_opt_t audio_opts[];
 extern cfg_opt_t audio_device_opts[];
 extern cfg_opt_t codec_opts[];
 extern cfg_opt_t config_opts[];
 extern cfg_opt_t export_opts[];
+extern cfg_opt_t rendition_opts[];
+extern cfg_opt_t still_opts[];
+extern cfg_opt_t sink_opts[];
+extern cfg_opt_t adaptive_opts[];
+extern cfg_opt_t thread_class_opts[];
+extern cfg_opt_t scheduling_opts[];
 
 extern cfg_t *C_CAPTURE_ROOT;
 extern cfg_t *C_SCALE_ROOT;
@@ -29,59 +39,74 @@ extern cfg_t *C_SPOTLIGHT_ROOT;
 extern cfg_t *C_AUDIO_ROOT;
 extern cfg_t *C_CODEC_ROOT;
 extern cfg_t *C_EXPORT_ROOT;
+extern cfg_t *C_SCHEDULING_ROOT;
 
 
 
 extern int init_config();
 extern int load_config();
+extern int reload_config();
 extern void free_config();
 
 struct Capture;
+struct Rendition;
 
 struct VideoThreadContext;
 struct VideoThreadOrchestrator;
 
 typedef struct VideoStream {
-	AVStream* stream;
-	AVCodecContext* codecContext;
-	const AVCodec* codec;
-
 	AVFrame **frameBuffer;
-	AVPacket *packet;
-	size_t bufferSize;
+	size_t bufferSize; // Slots in use, frames past this are released until the ring grows again
+	size_t capacity; // Allocated frames
 
 	struct Capture *root;
 
 	size_t sourceHeight, sourceWidth;
 	size_t frameHeight, frameWidth;
+	enum AVPixelFormat format; // Planar or semi-planar YUV, luma always in plane 0
 
 	struct VideoThreadOrchestrator *orchestrator;
 
 	size_t writeIndex;
 	size_t frameCount;
-	size_t pts;
+	size_t generation; // Bumped whenever a resize starts the frame indices over
+	int64_t startTime; // Capture time of frame index 0 in microseconds, carried across resizes
+	struct HistoryTier *history; // NULL without a history tier
+
+	// How each frame of the paused ring is exported, set by plan_video_export() before a save
+	uint8_t *plan;
+	size_t planStart; // Frame index of plan[0]
+	size_t planFrames;
 } VideoStream;
 
 struct AudioDevice;
 typedef struct AudioStream {
-	AVStream* stream;
-	AVCodecContext* codecContext;
-	const AVCodec* codec;
-
-	AVFrame **frameBuffer;
-	AVFrame *resampleFrame;
-	AVPacket *packet;
+	// Flat ring of samples, one buffer per plane. Sizes and indices are in samples.
+	uint8_t **planes;
+	int planeCount;
+	size_t sampleStride; // Bytes per sample in each plane
+	AVFrame *resampleFrame; // A chunk as read from the device
+	AVFrame *convertFrame; // The same chunk in the ring's layout
 	struct AudioDevice *device;
 	size_t bufferSize;
+	size_t capacity;
 
 	struct Capture *root;
 
 	struct SwrContext *resampler;
 
 	size_t writeIndex;
-	size_t frameCount;
-	size_t pts;
-	int numSamples;
+	size_t sampleCount; // Samples written since the ring was last resized
+	size_t lastSound; // sampleCount after the last chunk that wasn't silent
+
+	// Layout of the ring, as expected by the configured encoder
+	enum AVSampleFormat sampleFormat;
+	int sampleRate;
+	AVChannelLayout channelLayout;
+	int chunkSamples; // Samples read from the device at once
+	float silenceLevel; // Chunks whose peak (relative to full scale) is at or below this are stored as silent
+
+	pthread_t thread;
 } AudioStream;
 
 typedef struct Capture {
@@ -89,20 +114,51 @@ typedef struct Capture {
 	VideoStream** video_streams;
 	int nb_audio_streams;
 	AudioStream** audio_streams;
-	AVFormatContext *formatContext;
+	// Outputs written on every save, the first one is configured in the `codec` section
+	int nb_renditions;
+	struct Rendition **renditions;
 	size_t windowSize;
+	size_t activeWindow; // Seconds currently held, less than windowSize under memory pressure
 	size_t framerate;
+	enum AVPixelFormat pixelFormat; // Format of the video rings, negotiated at startup
 	volatile uint8_t pause;
+	pthread_mutex_t control; // Held while the capture is paused
+
+	// Thread re-opening the output after a save
+	pthread_t standbyThread;
+	int standbyPending;
+	int writers; // Number of capture threads currently writing into a ring
+
+	pthread_t monitorThread;
+	int monitoring;
+	volatile int stop; // Set when spotlight shuts down
+	int saves;
 } Capture;
 
 extern Capture *alloc_capture();
-void flush_capture(Capture*, char*);
+int flush_capture(Capture*, time_t);
+pid_t fork_export(Capture*, time_t);
 extern void free_capture(Capture*);
 extern void add_video_stream(Capture*, VideoStream*);
 extern void add_audio_stream(Capture*, AudioStream*);
-extern char* generate_output_filename();
+extern char* generate_output_filename(time_t, struct Rendition*);
+extern int reopen_capture_output(Capture*);
+extern void prepare_standby_output(Capture*);
+extern int wait_for_standby_output(Capture*);
+extern int reconfigure_capture(Capture*);
+extern void pause_capture(Capture*);
+extern void resume_capture(Capture*);
+extern void wait_for_resume(Capture*);
+extern int begin_ring_write(Capture*);
+extern void end_ring_write(Capture*);
 
 #include "video.h"
 #include "audio.h"
+#include "export.h"
+#include "memory.h"
+#include "placement.h"
+#include "trace.h"
+#include "still.h"
+#include "dump.h"
 
 #endif
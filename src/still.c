@@ -0,0 +1,180 @@
+#include "still.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+// Encoder used for each image format
+static const struct {
+	const char *format;
+	const char *encoder;
+} STILL_ENCODERS[] = {
+	{ "png", "png" },
+	{ "jpg", "mjpeg" },
+	{ "jpeg", "mjpeg" },
+	{ "webp", "libwebp" },
+};
+
+static const char *still_encoder(const char *format) {
+	for(size_t i = 0; i < sizeof(STILL_ENCODERS) / sizeof(STILL_ENCODERS[0]); i++) {
+		if(strcmp(STILL_ENCODERS[i].format, format) == 0)
+			return STILL_ENCODERS[i].encoder;
+	}
+	return NULL;
+}
+
+// Copies the ring frame captured `offset` seconds before the newest one, without pausing the capture.
+// Frames the capture threads may still be writing into, or are about to overwrite, are never picked.
+// Returns through `actual` how far back the copied frame is.
+static AVFrame *copy_ring_frame(VideoStream *video, double offset, double *actual) {
+	Capture *cap = video->root;
+	AVFrame *copy = av_frame_alloc();
+	if(copy == NULL)
+		return NULL;
+	copy->format = video->format;
+	copy->width = video->frameWidth;
+	copy->height = video->frameHeight;
+	if(av_frame_get_buffer(copy, 0) < 0) {
+		av_frame_free(&copy);
+		return NULL;
+	}
+
+	// The ring is only paused while it's resized, wait that out
+	for(int attempt = 0; !begin_ring_write(cap); attempt++) {
+		if(attempt == 1000) {
+			av_frame_free(&copy);
+			return NULL;
+		}
+		usleep(1000);
+	}
+	size_t frameCount = __atomic_load_n(&video->frameCount, __ATOMIC_ACQUIRE);
+	size_t margin = video_write_margin(video);
+	size_t reach = frameCount + margin * 2;
+	size_t oldest = reach > video->bufferSize ? reach - video->bufferSize : 0;
+	if(frameCount <= margin || frameCount - margin - 1 < oldest) {
+		end_ring_write(cap);
+		av_frame_free(&copy);
+		return NULL;
+	}
+	size_t newest = frameCount - margin - 1;
+	size_t back = lround(offset * video->orchestrator->framerate);
+	size_t index = back > newest - oldest ? oldest : newest - back;
+	av_frame_copy(copy, video->frameBuffer[index % video->bufferSize]);
+	end_ring_write(cap);
+
+	*actual = (double) (newest - index) / video->orchestrator->framerate;
+	return copy;
+}
+
+// Encodes a single frame with the codec's preferred pixel format, optionally scaled.
+// Returns the encoded image, which for the still formats is a complete file.
+static AVPacket *encode_still(const AVCodec *codec, AVFrame *source, size_t width, size_t height) {
+	AVPacket *packet = NULL;
+	AVFrame *frame = source;
+	struct SwsContext *scaler = NULL;
+	AVCodecContext *codecContext = avcodec_alloc_context3(codec);
+	if(codecContext == NULL)
+		return NULL;
+	codecContext->width = width;
+	codecContext->height = height;
+	codecContext->time_base = (AVRational) { 1, 1 };
+	codecContext->pix_fmt = codec->pix_fmts ? avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, source->format, 0, NULL) : source->format;
+	if(avcodec_open2(codecContext, codec, NULL) < 0) {
+		printf("[STILL] Could not open encoder %s\n", codec->name);
+		goto end;
+	}
+
+	// The ring holds YUV at the scaled size, most image encoders want something else
+	if(codecContext->pix_fmt != source->format || width != source->width || height != source->height) {
+		frame = av_frame_alloc();
+		frame->format = codecContext->pix_fmt;
+		frame->width = width;
+		frame->height = height;
+		scaler = sws_getContext(source->width, source->height, source->format,
+				width, height, codecContext->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+		if(scaler == NULL || av_frame_get_buffer(frame, 0) < 0) {
+			printf("[STILL] Error converting the frame for %s\n", codec->name);
+			goto end;
+		}
+		sws_scale(scaler, (const uint8_t * const *) source->data, source->linesize,
+				0, source->height, frame->data, frame->linesize);
+	}
+	frame->pts = 0;
+
+	packet = av_packet_alloc();
+	if(avcodec_send_frame(codecContext, frame) < 0 || avcodec_send_frame(codecContext, NULL) < 0
+			|| avcodec_receive_packet(codecContext, packet) < 0) {
+		printf("[STILL] Error encoding the frame with %s\n", codec->name);
+		av_packet_free(&packet);
+	}
+
+end:
+	if(frame != source)
+		av_frame_free(&frame);
+	sws_freeContext(scaler);
+	avcodec_free_context(&codecContext);
+	return packet;
+}
+
+// Writes the frame captured `offset` seconds ago as an image next to the exports:
+// still-2023-06-26T21:10:15.png. The capture keeps running, returns 0 on success.
+int save_still(Capture *cap, double offset, time_t timestamp) {
+	cfg_t *section = cfg_getsec(C_EXPORT_ROOT, "still");
+	const char *format = cfg_getstr(section, "format");
+	const char *encoder = still_encoder(format);
+	if(encoder == NULL) {
+		printf("[STILL] Unsupported format %s\n", format);
+		return 1;
+	}
+	const AVCodec *codec = avcodec_find_encoder_by_name(encoder);
+	if(codec == NULL) {
+		printf("[STILL] Encoder %s for %s isn't available\n", encoder, format);
+		return 1;
+	}
+	if(cap->nb_video_streams == 0)
+		return 1;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	VideoStream *video = cap->video_streams[0];
+	double actual;
+	AVFrame *frame = copy_ring_frame(video, offset, &actual);
+	if(frame == NULL) {
+		printf("[STILL] No frame buffered %.2f s back\n", offset);
+		return 1;
+	}
+
+	// The ring may be scaled down, the still can be scaled back up to what was captured
+	size_t width = video->frameWidth, height = video->frameHeight;
+	if(cfg_getbool(section, "upscale")) {
+		width = video->sourceWidth;
+		height = video->sourceHeight;
+	}
+	AVPacket *packet = encode_still(codec, frame, width, height);
+	av_frame_free(&frame);
+	if(packet == NULL)
+		return 1;
+
+	char date[64];
+	strftime(date, sizeof(date), "%FT%T", localtime(&timestamp));
+	const char *directory = cfg_getstr(C_EXPORT_ROOT, "directory");
+	char *file = malloc(strlen(directory) + strlen(date) + strlen(format) + sizeof("/still-."));
+	sprintf(file, "%s/still-%s.%s", directory, date, format);
+
+	int ret = 0;
+	FILE *output = fopen(file, "wb");
+	if(output == NULL || fwrite(packet->data, 1, packet->size, output) != (size_t) packet->size) {
+		printf("[STILL] Error writing %s\n", file);
+		ret = 1;
+	}
+	if(output != NULL && fclose(output) != 0)
+		ret = 1;
+	if(ret == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+		printf("[STILL] Wrote %s (%zux%zu, %.2f s back) in %.1f ms\n", file, width, height, actual, elapsed);
+	}
+	free(file);
+	av_packet_free(&packet);
+	return ret;
+}
@@ -0,0 +1,8 @@
+#ifndef STILL_H_
+#define STILL_H_
+
+#include "spotlight.h"
+
+int save_still(Capture*, double, time_t);
+
+#endif
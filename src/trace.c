@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+int G_TRACE_ENABLED = 0;
+
+static size_t G_TRACE_CAPACITY = 0;
+static TraceBuffer *G_TRACE_BUFFERS = NULL; // Never shrinks, only pushed onto
+static pthread_key_t G_TRACE_KEY;
+static __thread TraceBuffer *G_THREAD_BUFFER = NULL;
+
+static uint64_t trace_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Called when a thread exits, its events stay around until another thread takes over the buffer
+static void release_buffer(void *arg) {
+	TraceBuffer *buffer = arg;
+	__atomic_store_n(&buffer->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static TraceBuffer *thread_buffer() {
+	if(G_THREAD_BUFFER != NULL)
+		return G_THREAD_BUFFER;
+
+	// Take over the buffer of a thread that has exited, otherwise push a new one
+	TraceBuffer *buffer;
+	for(buffer = __atomic_load_n(&G_TRACE_BUFFERS, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+		int unused = 0;
+		if(__atomic_compare_exchange_n(&buffer->inUse, &unused, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+	if(buffer == NULL) {
+		buffer = calloc(1, sizeof(TraceBuffer));
+		buffer->events = malloc(sizeof(TraceEvent) * G_TRACE_CAPACITY);
+		buffer->capacity = G_TRACE_CAPACITY;
+		buffer->inUse = 1;
+		buffer->next = __atomic_load_n(&G_TRACE_BUFFERS, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&G_TRACE_BUFFERS, &buffer->next, buffer, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	buffer->tid = syscall(SYS_gettid);
+	strcpy(buffer->name, "thread");
+	__atomic_store_n(&buffer->count, 0, __ATOMIC_RELEASE);
+
+	G_THREAD_BUFFER = buffer;
+	pthread_setspecific(G_TRACE_KEY, buffer);
+	return buffer;
+}
+
+// Keeps the last `events` spans of every thread, 0 leaves tracing disabled.
+// Has to be called before any thread records a span.
+void init_trace(size_t events) {
+	if(events == 0)
+		return;
+	G_TRACE_CAPACITY = events;
+	pthread_key_create(&G_TRACE_KEY, release_buffer);
+	G_TRACE_ENABLED = 1;
+	printf("[TRACE] Keeping the last %zu spans of every thread\n", events);
+}
+
+// Names the calling thread in the trace, `id` is appended if it's not negative
+void trace_thread_name(const char *name, int id) {
+	if(!G_TRACE_ENABLED)
+		return;
+	TraceBuffer *buffer = thread_buffer();
+	if(id < 0)
+		snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+	else
+		snprintf(buffer->name, sizeof(buffer->name), "%s %d", name, id);
+}
+
+uint64_t trace_begin() {
+	return G_TRACE_ENABLED ? trace_now() : 0;
+}
+
+// Records the span from `start` until now, `name` has to be a string literal
+void trace_end(const char *name, uint64_t start) {
+	if(!G_TRACE_ENABLED)
+		return;
+	TraceBuffer *buffer = thread_buffer();
+	size_t count = buffer->count;
+	TraceEvent *event = &buffer->events[count % buffer->capacity];
+	event->name = name;
+	event->start = start;
+	event->duration = trace_now() - start;
+	__atomic_store_n(&buffer->count, count + 1, __ATOMIC_RELEASE);
+}
+
+// Writes `text` as a JSON string, thread names can contain titles from the config
+static void write_json_string(FILE *file, const char *text) {
+	fputc('"', file);
+	for(const unsigned char *c = (const unsigned char*) text; *c != '\0'; c++) {
+		if(*c == '"' || *c == '\\')
+			fprintf(file, "\\%c", *c);
+		else if(*c < 0x20)
+			fprintf(file, "\\u%04x", *c);
+		else
+			fputc(*c, file);
+	}
+	fputc('"', file);
+}
+
+// Writes the spans of all threads as Chrome trace events, which can be opened in Perfetto or chrome://tracing.
+// Threads may keep recording while this runs, their newest spans are then missing or torn.
+int trace_dump(const char *path) {
+	FILE *file = fopen(path, "w");
+	if(file == NULL) {
+		printf("[TRACE] Error opening %s\n", path);
+		return -1;
+	}
+	int pid = getpid();
+	int first = 1;
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for(TraceBuffer *buffer = __atomic_load_n(&G_TRACE_BUFFERS, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+		size_t count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+		if(count == 0)
+			continue;
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+				first ? "" : ",\n", pid, buffer->tid);
+		write_json_string(file, buffer->name);
+		fprintf(file, "}}");
+		first = 0;
+		size_t start = count > buffer->capacity ? count - buffer->capacity : 0;
+		for(size_t i = start; i < count; i++) {
+			TraceEvent *event = &buffer->events[i % buffer->capacity];
+			fprintf(file, ",\n{\"name\":");
+			write_json_string(file, event->name);
+			fprintf(file, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					pid, buffer->tid, event->start / 1000.0, event->duration / 1000.0);
+		}
+	}
+	fprintf(file, "\n]}\n");
+	if(fclose(file) != 0) {
+		printf("[TRACE] Error writing %s\n", path);
+		return -1;
+	}
+	return 0;
+}
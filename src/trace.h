@@ -0,0 +1,34 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A finished span, times are CLOCK_MONOTONIC nanoseconds
+typedef struct TraceEvent {
+	const char *name;
+	uint64_t start;
+	uint64_t duration;
+} TraceEvent;
+
+// Ring of the latest spans of a single thread, only that thread writes into it.
+// Buffers are handed to the next thread once their thread exits.
+typedef struct TraceBuffer {
+	int tid;
+	char name[32];
+	TraceEvent *events;
+	size_t capacity;
+	size_t count;
+	int inUse;
+	struct TraceBuffer *next;
+} TraceBuffer;
+
+extern int G_TRACE_ENABLED;
+
+void init_trace(size_t);
+void trace_thread_name(const char*, int);
+uint64_t trace_begin();
+void trace_end(const char*, uint64_t);
+int trace_dump(const char*);
+
+#endif
@@ -1,23 +1,34 @@
 #include "video.h"
 #include <math.h>
 #include <unistd.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sys/shm.h>
 #include <sys/ipc.h>
+#include <X11/Xutil.h>
+#include <libavutil/pixdesc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
-
-extern Capture *G_CAPTURE;
+// Keyframe interval of the exports, adaptive exports keep it while the picture moves
+#define DEFAULT_GOP_SIZE 10
 
 static void video_worker(VideoThreadContext* ctx);
+static int open_window_capture(VideoThreadOrchestrator*, const char*);
+static int attach_shm_image(VideoThreadContext*, int, int);
+static void detach_shm_image(VideoThreadContext*);
+static int open_history_tier(VideoStream*);
+static void free_history_tier(HistoryTier*);
 
 
-AVDictionary* parse_codec_options() {
+AVDictionary* parse_codec_options(cfg_t *section) {
 	// Take the options string from the config file and parse it into a dictionary
 	// The options string looks like this [name=value,?]*
 	
 	AVDictionary* options = NULL;
-	cfg_t* optionsSection = cfg_getsec(C_CODEC_ROOT, "options");
+	cfg_t* optionsSection = cfg_getsec(section, "options");
 	if(optionsSection == NULL) {
 		return options;
 	}
@@ -31,32 +42,144 @@ AVDictionary* parse_codec_options() {
 	return options;
 }
 
-// Create a video stream from the spotlight config
-VideoStream *default_video(Capture *root) {
-	if(C_CONFIG == NULL) return NULL;
-	VideoStream *video = malloc(sizeof(VideoStream));
-	memset(video, 0, sizeof(VideoStream));
-	video->root = root;
-
-	int frameHeight, frameWidth, sourceHeight, sourceWidth;
-	frameHeight = sourceHeight = cfg_getint(C_CAPTURE_ROOT, "height");
-	frameWidth = sourceWidth = cfg_getint(C_CAPTURE_ROOT, "width");
+// Reads the size frames are stored at in the ring from the config
+void configured_frame_size(size_t *width, size_t *height) {
+	*height = cfg_getint(C_CAPTURE_ROOT, "height");
+	*width = cfg_getint(C_CAPTURE_ROOT, "width");
 	// Check whether the `scale` block ist set.
 	// If so, use those width and heights,
 	// otherwise use the capture width and height
 	if(cfg_size(C_CAPTURE_ROOT, "scale") > 0) {
 		if(cfg_getint(C_SCALE_ROOT, "width") && cfg_getint(C_SCALE_ROOT, "height")) {
-			frameHeight = cfg_getint(C_SCALE_ROOT, "height");
-			frameWidth = cfg_getint(C_SCALE_ROOT, "width");
+			*height = cfg_getint(C_SCALE_ROOT, "height");
+			*width = cfg_getint(C_SCALE_ROOT, "width");
+		}
+	}
+}
+
+static AVFrame *alloc_video_frame(size_t width, size_t height, enum AVPixelFormat format) {
+	AVFrame *frame = av_frame_alloc();
+	if(frame == NULL) {
+		return NULL;
+	}
+	frame->format = format;
+	frame->width = width;
+	frame->height = height;
+	if(av_frame_get_buffer(frame, 0) < 0) {
+		av_frame_free(&frame);
+		return NULL;
+	}
+	return frame;
+}
+
+// Returns the size in bytes of a single ring slot at the given frame size and format
+size_t video_slot_size(size_t width, size_t height, enum AVPixelFormat format) {
+	AVFrame *frame = alloc_video_frame(width, height, format);
+	if(frame == NULL) {
+		return 0;
+	}
+	size_t size = 0;
+	for(int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+		size += frame->buf[i]->size;
+	}
+	av_frame_free(&frame);
+	return size;
+}
+
+// Formats the ring can hold: 8 bit YUV with the luma in plane 0, which the export analysis reads
+static const enum AVPixelFormat RING_FORMATS[] = {
+	AV_PIX_FMT_YUV420P,
+	AV_PIX_FMT_NV12,
+	AV_PIX_FMT_YUV422P,
+	AV_PIX_FMT_YUV444P,
+	AV_PIX_FMT_NONE
+};
+
+static int pixel_format_in(const enum AVPixelFormat *formats, enum AVPixelFormat format) {
+	for(; *formats != AV_PIX_FMT_NONE; formats++) {
+		if(*formats == format)
+			return 1;
+	}
+	return 0;
+}
+
+int ring_format_supported(enum AVPixelFormat format) {
+	return format != AV_PIX_FMT_NONE && pixel_format_in(RING_FORMATS, format);
+}
+
+// Picks the format frames are stored in: `pixel-format` from the capture section if the ring can hold it,
+// otherwise the main codec's most preferred format the ring can hold, so the capture converts every image
+// into what the encoder takes once and exports don't convert at all.
+enum AVPixelFormat negotiate_ring_format() {
+	const char *preferred = cfg_getstr(C_CAPTURE_ROOT, "pixel-format");
+	const AVCodec *codec = avcodec_find_encoder_by_name(cfg_getstr(C_CODEC_ROOT, "name"));
+	if(strcmp(preferred, "auto") != 0) {
+		enum AVPixelFormat format = av_get_pix_fmt(preferred);
+		if(ring_format_supported(format)) {
+			if(codec != NULL && codec->pix_fmts && !pixel_format_in(codec->pix_fmts, format))
+				printf("[VIDEO] %s doesn't take %s, exports will convert every frame\n", codec->name, preferred);
+			return format;
+		}
+		printf("[VIDEO] Can't store frames as %s, negotiating the format with the codec\n", preferred);
+	}
+	if(codec != NULL && codec->pix_fmts) {
+		for(const enum AVPixelFormat *format = codec->pix_fmts; *format != AV_PIX_FMT_NONE; format++) {
+			if(ring_format_supported(*format))
+				return *format;
 		}
 	}
+	return AV_PIX_FMT_YUV420P;
+}
+
+// Height of a plane of a frame in the given format
+int video_plane_height(enum AVPixelFormat format, int height, int plane) {
+	const AVPixFmtDescriptor *descriptor = av_pix_fmt_desc_get(format);
+	return plane == 0 || plane == 3 ? height : AV_CEIL_RSHIFT(height, descriptor->log2_chroma_h);
+}
+
+// The ring's format if the codec takes it, otherwise the closest one it does
+static enum AVPixelFormat encoder_pixel_format(const AVCodec *codec, enum AVPixelFormat format) {
+	if(codec->pix_fmts == NULL || pixel_format_in(codec->pix_fmts, format))
+		return format;
+	return avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, format, 0, NULL);
+}
+
+// Creates a scaler converting captured images of the given size into ring frames
+static struct SwsContext *create_formatter(VideoStream *video, int sourceWidth, int sourceHeight) {
+	return sws_getContext(
+		sourceWidth,
+		sourceHeight,
+		AV_PIX_FMT_RGB32,
+		video->frameWidth,
+		video->frameHeight,
+		video->format,
+		// TODO: User should be able to set the scaling algorithm
+		// 	     in the config file
+		SWS_FAST_BILINEAR, // ~21ms
+		//SWS_SINC, // ~40ms
+		//SWS_LANCZOS, // ~30ms
+		// SWS_SPLINE, // ~31ms
+		NULL,
+		NULL,
+		NULL
+	);
+}
+
+// Allocates a stream with its ring of frames of the given size, fed from a source of the given size
+static VideoStream *alloc_video_ring(Capture *root, size_t sourceWidth, size_t sourceHeight, size_t frameWidth, size_t frameHeight) {
+	VideoStream *video = malloc(sizeof(VideoStream));
+	memset(video, 0, sizeof(VideoStream));
+	video->root = root;
 
 	video->sourceHeight = sourceHeight;
 	video->sourceWidth = sourceWidth;
-	video->frameHeight = frameHeight;
 	video->frameWidth = frameWidth;
+	video->frameHeight = frameHeight;
+	video->format = root->pixelFormat;
 
-	video->bufferSize = cfg_getint(C_SPOTLIGHT_ROOT, "framerate") * cfg_getint(C_SPOTLIGHT_ROOT, "window-size");
+	// The window may have been limited to fit into the memory-limit
+	video->bufferSize = root->framerate * root->windowSize;
+	video->capacity = video->bufferSize;
 	video->frameBuffer = malloc(sizeof(AVFrame*) * video->bufferSize);
 	if(video->frameBuffer == NULL) {
 		printf("Error allocating frame buffer\n");
@@ -66,40 +189,47 @@ VideoStream *default_video(Capture *root) {
 
 	// Allocate AVFrame's inside frame buffer
 	for(int i = 0; i < video->bufferSize; i++) {
-		video->frameBuffer[i] = av_frame_alloc();
+		video->frameBuffer[i] = alloc_video_frame(video->frameWidth, video->frameHeight, video->format);
 		if(video->frameBuffer[i] == NULL) {
 			printf("Error allocating frame %d\n", i);
 			return NULL;
 		}
-		video->frameBuffer[i]->format = AV_PIX_FMT_YUV420P;
-		video->frameBuffer[i]->width = frameWidth;
-		video->frameBuffer[i]->height = frameHeight;
-		av_frame_get_buffer(video->frameBuffer[i], 0);
 	}
 
+	VideoThreadOrchestrator *orch = (VideoThreadOrchestrator*) malloc(sizeof(VideoThreadOrchestrator));
+	memset(orch, 0, sizeof(VideoThreadOrchestrator));
+	video->orchestrator = orch;
+	orch->framerate = root->framerate;
+	orch->stream = video;
+	return video;
+}
 
-	video->packet = av_packet_alloc();
-	if(video->packet == NULL) {
-		printf("Error allocating packet\n");
+// Create a video stream from the spotlight config
+VideoStream *default_video(Capture *root) {
+	if(C_CONFIG == NULL) return NULL;
+	size_t frameWidth, frameHeight;
+	configured_frame_size(&frameWidth, &frameHeight);
+	VideoStream *video = alloc_video_ring(root, cfg_getint(C_CAPTURE_ROOT, "width"), cfg_getint(C_CAPTURE_ROOT, "height"), frameWidth, frameHeight);
+	if(video == NULL)
 		return NULL;
-	}
-	video->packet->data = NULL;
-	video->packet->size = 0;
 
 	// Initialize multi-threading for this context
-	VideoThreadOrchestrator *orch = (VideoThreadOrchestrator*) malloc(sizeof(VideoThreadOrchestrator));
-	video->orchestrator = orch;
+	VideoThreadOrchestrator *orch = video->orchestrator;
 	int threads = cfg_getint(C_SPOTLIGHT_ROOT, "threads");
 	orch->nb_threads = threads;
 	orch->contexts = malloc(sizeof(VideoThreadContext*) * threads);
-	orch->threads = malloc(sizeof(pthread_t*) * threads);
+	orch->threads = malloc(sizeof(pthread_t) * threads);
 	orch->timestamp = 0.0f;
-	orch->framerate = cfg_getint(C_SPOTLIGHT_ROOT, "framerate");
-	orch->stream = video;
 
 
 	Display* display = XOpenDisplay(NULL);
 	orch->display = display;
+	orch->window = None;
+	orch->windowLost = 0;
+	const char *window = cfg_getstr(C_CAPTURE_ROOT, "window");
+	if(window != NULL && window[0] != '\0' && open_window_capture(orch, window)) {
+		return NULL;
+	}
 
 	XMapRaised(display, DefaultRootWindow(display));
 
@@ -115,98 +245,1247 @@ VideoStream *default_video(Capture *root) {
 		pthread_create(&orch->threads[i], NULL, video_worker, ctx);
 	}
 
+	if(open_history_tier(video)) {
+		free_video_stream(video);
+		return NULL;
+	}
 	return video;
 }
 
-void flush_video_stream(VideoStream *video) {
-	int start_index;
-	int encoding = 1;
+// Creates a stream whose frames are pushed in by an embedding application through push_video_frame(),
+// instead of grabbed from X. Frames of `width` x `height` are scaled to the ring's size as set in the config.
+VideoStream *injected_video(Capture *root, size_t width, size_t height) {
+	if(C_CONFIG == NULL) return NULL;
+	size_t frameWidth, frameHeight;
+	configured_frame_size(&frameWidth, &frameHeight);
+	VideoStream *video = alloc_video_ring(root, width, height, frameWidth, frameHeight);
+	if(video == NULL)
+		return NULL;
+	VideoInjector *injector = malloc(sizeof(VideoInjector));
+	memset(injector, 0, sizeof(VideoInjector));
+	injector->format = AV_PIX_FMT_NONE;
+	video->orchestrator->injector = injector;
+	if(open_history_tier(video)) {
+		free_video_stream(video);
+		return NULL;
+	}
+	return video;
+}
+
+// Reads the size of the focus crop from the config, limited to the captured area. Returns 0 without a focus crop.
+int focus_crop_size(size_t *width, size_t *height) {
+	cfg_t *focus = cfg_getsec(C_CAPTURE_ROOT, "focus");
+	*width = cfg_getint(focus, "width");
+	*height = cfg_getint(focus, "height");
+	if(*width > (size_t) cfg_getint(C_CAPTURE_ROOT, "width"))
+		*width = cfg_getint(C_CAPTURE_ROOT, "width");
+	if(*height > (size_t) cfg_getint(C_CAPTURE_ROOT, "height"))
+		*height = cfg_getint(C_CAPTURE_ROOT, "height");
+	// The chroma planes are half the size
+	*width &= ~(size_t) 1;
+	*height &= ~(size_t) 1;
+	return *width > 0 && *height > 0;
+}
 
-	if (video->frameCount > video->bufferSize) {
-		start_index = video->writeIndex;
+// Moves the crop onto (x, y) on the screen, keeping it inside the captured area.
+// With `pan`, it only moves once the point leaves its middle half, so small pointer movements don't shake the picture.
+static void aim_crop(FocusCrop *crop, int x, int y, int pan) {
+	int width = crop->stream->frameWidth, height = crop->stream->frameHeight;
+	int left = crop->x, top = crop->y;
+	x -= crop->areaX;
+	y -= crop->areaY;
+	if(pan) {
+		if(x < left + width / 4)
+			left = x - width / 4;
+		else if(x > left + width - width / 4)
+			left = x - width + width / 4;
+		if(y < top + height / 4)
+			top = y - height / 4;
+		else if(y > top + height - height / 4)
+			top = y - height + height / 4;
 	} else {
-		start_index = 0;
+		left = x - width / 2;
+		top = y - height / 2;
+	}
+	left = left < 0 ? 0 : left > crop->areaWidth - width ? crop->areaWidth - width : left;
+	top = top < 0 ? 0 : top > crop->areaHeight - height ? crop->areaHeight - height : top;
+	crop->x = left;
+	crop->y = top;
+}
+
+// Looks up the focused window and moves the crop onto it. The window manager's frame around it is the
+// window that moves, it's a child of the root window, so its position is on the screen.
+static void follow_active_window(FocusCrop *crop, xcb_window_t root, xcb_atom_t active) {
+	xcb_connection_t *connection = crop->connection;
+	xcb_get_property_reply_t *property = xcb_get_property_reply(connection,
+			xcb_get_property(connection, 0, root, active, XCB_ATOM_WINDOW, 0, 1), NULL);
+	xcb_window_t window = XCB_NONE;
+	if(property != NULL && xcb_get_property_value_length(property) >= (int) sizeof(xcb_window_t))
+		window = *(xcb_window_t*) xcb_get_property_value(property);
+	free(property);
+	if(window == XCB_NONE)
+		return;
+	while(1) {
+		xcb_query_tree_reply_t *tree = xcb_query_tree_reply(connection, xcb_query_tree(connection, window), NULL);
+		if(tree == NULL)
+			return;
+		xcb_window_t parent = tree->parent;
+		free(tree);
+		if(parent == root || parent == XCB_NONE)
+			break;
+		window = parent;
+	}
+
+	// Moves and resizes of the followed window come in as ConfigureNotify
+	if(window != crop->window) {
+		uint32_t mask = XCB_EVENT_MASK_NO_EVENT;
+		if(crop->window != XCB_NONE)
+			xcb_change_window_attributes(connection, crop->window, XCB_CW_EVENT_MASK, &mask);
+		mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+		xcb_change_window_attributes(connection, window, XCB_CW_EVENT_MASK, &mask);
+		crop->window = window;
+	}
+	xcb_get_geometry_reply_t *geometry = xcb_get_geometry_reply(connection, xcb_get_geometry(connection, window), NULL);
+	if(geometry == NULL)
+		return;
+	aim_crop(crop, geometry->x + geometry->width / 2, geometry->y + geometry->height / 2, 0);
+	free(geometry);
+}
+
+// Keeps the crop on the focused window, as announced by the window manager through _NET_ACTIVE_WINDOW
+static void *focus_thread(void *arg) {
+	FocusCrop *crop = arg;
+	xcb_connection_t *connection = crop->connection;
+	trace_thread_name("focus", -1);
+	xcb_window_t root = xcb_setup_roots_iterator(xcb_get_setup(connection)).data->root;
+	xcb_intern_atom_reply_t *atom = xcb_intern_atom_reply(connection,
+			xcb_intern_atom(connection, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW"), NULL);
+	if(atom == NULL) {
+		printf("[VIDEO] Couldn't look up the focused window, the focus crop stays where it is\n");
+		return NULL;
+	}
+	xcb_atom_t active = atom->atom;
+	free(atom);
+	uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+	xcb_change_window_attributes(connection, root, XCB_CW_EVENT_MASK, &mask);
+	follow_active_window(crop, root, active);
+
+	struct pollfd descriptor = { xcb_get_file_descriptor(connection), POLLIN, 0 };
+	while(!crop->stop && !xcb_connection_has_error(connection)) {
+		xcb_generic_event_t *event;
+		while((event = xcb_poll_for_event(connection)) != NULL) {
+			uint8_t type = event->response_type & ~0x80;
+			if(type == XCB_PROPERTY_NOTIFY && ((xcb_property_notify_event_t*) event)->atom == active) {
+				follow_active_window(crop, root, active);
+			} else if(type == XCB_CONFIGURE_NOTIFY && ((xcb_configure_notify_event_t*) event)->window == crop->window) {
+				xcb_configure_notify_event_t *configure = (xcb_configure_notify_event_t*) event;
+				aim_crop(crop, configure->x + configure->width / 2, configure->y + configure->height / 2, 0);
+			}
+			free(event);
+		}
+		// Wakes up regularly to notice when it's stopped
+		poll(&descriptor, 1, 100);
+	}
+	return NULL;
+}
+
+// Creates the focus crop set in the capture section for a screen capture, as a stream of its own.
+// Its frames are cut from `source`'s grabs at their native resolution. Returns NULL without a focus crop.
+VideoStream *focus_video(VideoStream *source) {
+	size_t width, height;
+	if(!focus_crop_size(&width, &height))
+		return NULL;
+	VideoThreadOrchestrator *orch = source->orchestrator;
+	if(orch->nb_threads == 0 || orch->window != None) {
+		printf("[VIDEO] The focus crop only works when capturing the screen\n");
+		return NULL;
+	}
+	VideoStream *video = alloc_video_ring(source->root, width, height, width, height);
+	if(video == NULL)
+		return NULL;
+	video->orchestrator->feeder = orch;
+
+	FocusCrop *crop = malloc(sizeof(FocusCrop));
+	memset(crop, 0, sizeof(FocusCrop));
+	crop->stream = video;
+	crop->areaX = cfg_getint(C_CAPTURE_ROOT, "x");
+	crop->areaY = cfg_getint(C_CAPTURE_ROOT, "y");
+	crop->areaWidth = source->sourceWidth;
+	crop->areaHeight = source->sourceHeight;
+	crop->x = (crop->areaWidth - width) / 2;
+	crop->y = (crop->areaHeight - height) / 2;
+
+	const char *follow = cfg_getstr(cfg_getsec(C_CAPTURE_ROOT, "focus"), "follow");
+	if(strcmp(follow, "window") == 0) {
+		crop->connection = xcb_connect(NULL, NULL);
+		if(xcb_connection_has_error(crop->connection)) {
+			printf("[VIDEO] Error connecting to the X server, the focus crop follows the pointer\n");
+			xcb_disconnect(crop->connection);
+			crop->connection = NULL;
+		} else {
+			crop->followWindow = 1;
+			pthread_create(&crop->thread, NULL, focus_thread, crop);
+		}
+	} else if(strcmp(follow, "pointer") != 0) {
+		printf("[VIDEO] Unknown focus crop target %s, following the pointer\n", follow);
+	}
+	orch->crop = crop;
+	printf("[VIDEO] Focus crop of %zux%zu following the %s\n", width, height, crop->followWindow ? "focused window" : "pointer");
+	return video;
+}
+
+// Number of the newest frames in the ring that workers may still be writing into
+size_t video_write_margin(VideoStream *video) {
+	VideoThreadOrchestrator *orch = video->orchestrator;
+	return orch->feeder != NULL ? orch->feeder->nb_threads : orch->nb_threads;
+}
+
+// Writes a pushed image into the next slot of the ring. Images already in the ring's format and size
+// are copied as they are, anything else goes through a scaler kept for as long as the input doesn't change.
+static int inject_image(VideoStream *video, enum AVPixelFormat format, const uint8_t *const planes[], const int strides[]) {
+	VideoInjector *injector = video->orchestrator->injector;
+	int width = video->sourceWidth, height = video->sourceHeight;
+	if(format == video->format && width == video->frameWidth && height == video->frameHeight) {
+		AVFrame *frame = claim_video_frame(video);
+		uint64_t span = trace_begin();
+		av_image_copy(frame->data, frame->linesize, (const uint8_t **) planes, strides, format, width, height);
+		trace_end("copy", span);
+		return 0;
+	}
+	// The ring's size changes when the config is reloaded
+	if(injector->scaler == NULL || injector->format != format
+			|| injector->ringWidth != video->frameWidth || injector->ringHeight != video->frameHeight) {
+		sws_freeContext(injector->scaler);
+		injector->scaler = sws_getContext(width, height, format, video->frameWidth, video->frameHeight, video->format,
+				SWS_FAST_BILINEAR, NULL, NULL, NULL);
+		injector->format = format;
+		injector->ringWidth = video->frameWidth;
+		injector->ringHeight = video->frameHeight;
+		if(injector->scaler == NULL)
+			return -1;
+	}
+	AVFrame *frame = claim_video_frame(video);
+	uint64_t span = trace_begin();
+	sws_scale(injector->scaler, planes, strides, 0, height, frame->data, frame->linesize);
+	trace_end("sws_scale", span);
+	return 0;
+}
+
+// Appends an image pushed by the embedding application to the ring. `time` is when it was rendered,
+// in microseconds on any clock, and places it on the ring's framerate: images coming in faster
+// are dropped, gaps are filled by repeating the image. Returns 0 if it was stored, 1 if it was dropped, -1 on errors.
+// Only one thread may push into a stream at a time.
+int push_video_frame(VideoStream *video, enum AVPixelFormat format, const uint8_t *const planes[], const int strides[], int64_t time) {
+	VideoInjector *injector = video->orchestrator->injector;
+	if(injector == NULL || (format != AV_PIX_FMT_YUV420P && format != AV_PIX_FMT_BGRA))
+		return -1;
+	// Nothing is stored while the capture is paused for a save or a reload
+	if(!begin_ring_write(video->root))
+		return 1;
+
+	size_t framerate = video->orchestrator->framerate;
+	int64_t period = 1000000 / framerate;
+	// The pushed clock is mapped onto the ring's on the first image, and again after long gaps
+	int64_t expected = injector->origin + video_frame_time(video, video->frameCount);
+	if(!injector->started || time - expected > (int64_t) 1000000) {
+		injector->origin = time - video_frame_time(video, video->frameCount);
+		injector->started = 1;
+		expected = time;
+	}
+	if(time < expected - period / 2) {
+		end_ring_write(video->root);
+		return 1;
+	}
+
+	size_t index = video->writeIndex;
+	int ret = inject_image(video, format, planes, strides);
+	// Frames the application didn't render in time are repeated, so the ring stays on its framerate
+	for(int64_t missed = (time - expected + period / 2) / period; ret == 0 && missed > 0; missed--) {
+		av_frame_copy(claim_video_frame(video), video->frameBuffer[index]);
+	}
+	end_ring_write(video->root);
+	return ret;
+}
+
+static void cache_packet(VideoEncoder *encoder, AVPacket *packet) {
+	if(encoder->nb_cached == encoder->cachedCapacity) {
+		encoder->cachedCapacity = encoder->cachedCapacity ? encoder->cachedCapacity * 2 : 256;
+		encoder->cached = realloc(encoder->cached, sizeof(AVPacket*) * encoder->cachedCapacity);
+	}
+	AVPacket *cached = av_packet_alloc();
+	av_packet_move_ref(cached, packet);
+	encoder->cached[encoder->nb_cached++] = cached;
+}
+
+// Drops the cached packets in front of the keyframe at `pts`
+static void trim_cache(VideoEncoder *encoder, int64_t pts) {
+	size_t dropped = 0;
+	while(dropped < encoder->nb_cached && encoder->cached[dropped]->pts < pts) {
+		av_packet_free(&encoder->cached[dropped]);
+		dropped++;
+	}
+	encoder->nb_cached -= dropped;
+	memmove(encoder->cached, encoder->cached + dropped, sizeof(AVPacket*) * encoder->nb_cached);
+}
+
+static void clear_cache(VideoEncoder *encoder) {
+	for(size_t i = 0; i < encoder->nb_cached; i++) {
+		av_packet_free(&encoder->cached[i]);
+	}
+	encoder->nb_cached = 0;
+}
+
+// Moves the packet into the output, timestamps start at the first exported frame.
+// Packets of frames before it were encoded ahead of time and aren't part of this export.
+static void write_exported_packet(VideoEncoder *encoder, AVPacket *packet) {
+	int64_t start = encoder->exportOrigin;
+	if(packet->pts < start) {
+		av_packet_unref(packet);
+		return;
+	}
+	packet->pts -= start;
+	if(packet->dts != AV_NOPTS_VALUE)
+		packet->dts -= start;
+	av_packet_rescale_ts(packet, encoder->codecContext->time_base, encoder->stream->time_base);
+	packet->stream_index = encoder->stream->index;
+	uint64_t span = trace_begin();
+	export_write_packet(encoder->rendition->writer, packet);
+	trace_end("write_packet", span);
+}
+
+static int encode_video_frame(VideoEncoder *encoder, AVFrame *frame) {
+	uint64_t span = trace_begin();
+	int ret = avcodec_send_frame(encoder->codecContext, frame);
+	trace_end("send_frame", span);
+	if (ret < 0) {
+		printf("Error sending frame for encoding\n");
+		return ret;
+	}
+	while (ret >= 0) {
+		span = trace_begin();
+		ret = avcodec_receive_packet(encoder->codecContext, encoder->packet);
+		trace_end("receive_packet", span);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+			return 0;
+		} else if (ret < 0) {
+			printf("Error during encoding\n");
+			return ret;
+		}
+
+		// Packets encoded ahead of time are kept until the next save
+		if(encoder->exporting)
+			write_exported_packet(encoder, encoder->packet);
+		else
+			cache_packet(encoder, encoder->packet);
+		av_packet_unref(encoder->packet);
+	}
+	return 0;
+}
+
+// Returns the frame to hand to the encoder for a ring frame
+static AVFrame *prepare_video_frame(VideoEncoder *encoder, AVFrame *source) {
+	if (encoder->scaler) {
+		// The encoder may still hold a reference to the previous frame
+		av_frame_make_writable(encoder->scaledFrame);
+		sws_scale(encoder->scaler, (const uint8_t * const *) source->data, source->linesize,
+				0, encoder->source->frameHeight, encoder->scaledFrame->data, encoder->scaledFrame->linesize);
+		return encoder->scaledFrame;
+	}
+	// Other renditions read the same ring frame at the same time,
+	// so the timestamp goes onto a reference instead of the frame itself
+	av_frame_ref(encoder->frame, source);
+	return encoder->frame;
+}
+
+// Index of the oldest frame in the ring
+static size_t ring_start(VideoStream *video) {
+	return video->frameCount > video->bufferSize ? video->frameCount - video->bufferSize : 0;
+}
+
+// First keyframe at or after `index`
+static size_t next_chunk(VideoEncoder *encoder, size_t index) {
+	return (index + encoder->chunkFrames - 1) / encoder->chunkFrames * encoder->chunkFrames;
+}
+
+// Frame indices start over whenever the ring is resized, the timestamps handed to the encoder have to keep increasing
+static void follow_ring_generation(VideoEncoder *encoder) {
+	if(encoder->generation == encoder->source->generation)
+		return;
+	encoder->ptsBase += encoder->nextFrame;
+	encoder->generation = encoder->source->generation;
+	encoder->validStart = encoder->nextFrame = 0;
+	clear_cache(encoder);
+}
+
+// Encodes the ring while capturing, so a save only has to encode the frames captured since.
+// Every chunk of the ring starts with a keyframe, chunks are dropped from the cache once their
+// first frame is overwritten. If the encoder falls behind, it skips ahead to the next chunk.
+static void *pre_encode_thread(void *arg) {
+	VideoEncoder *encoder = arg;
+	VideoStream *video = encoder->source;
+	Capture *cap = video->root;
+	trace_thread_name("pre-encode", encoder->stream->index);
+
+	while(!encoder->stopPreEncoding) {
+		// The ring mustn't be read while it's resized
+		if(!begin_ring_write(cap)) {
+			usleep(10000);
+			continue;
+		}
+		follow_ring_generation(encoder);
+
+		// The newest frames may still be written into, the oldest are about to be overwritten.
+		// Keep a chunk of distance to the latter, scaling a frame takes a while.
+		size_t frameCount = __atomic_load_n(&video->frameCount, __ATOMIC_ACQUIRE);
+		size_t margin = video_write_margin(video);
+		size_t sealed = frameCount > margin ? frameCount - margin : 0;
+		size_t reach = frameCount + margin + encoder->chunkFrames;
+		size_t oldest = reach > video->bufferSize ? reach - video->bufferSize : 0;
+
+		size_t keep = next_chunk(encoder, oldest);
+		if(encoder->nextFrame < oldest) {
+			encoder->validStart = encoder->nextFrame = keep;
+			clear_cache(encoder);
+		} else if(keep > encoder->validStart && keep < encoder->nextFrame) {
+			encoder->validStart = keep;
+			trim_cache(encoder, encoder->ptsBase + keep);
+		}
+
+		if(encoder->nextFrame >= sealed) {
+			end_ring_write(cap);
+			usleep(1000000 / video->orchestrator->framerate);
+			continue;
+		}
+		size_t index = encoder->nextFrame;
+		AVFrame *frame = prepare_video_frame(encoder, video->frameBuffer[index % video->bufferSize]);
+		end_ring_write(cap);
+
+		frame->pts = encoder->ptsBase + index;
+		frame->pict_type = index == encoder->validStart || index % encoder->chunkFrames == 0 ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+		int ret = encode_video_frame(encoder, frame);
+		av_frame_unref(encoder->frame);
+		if(ret < 0) {
+			printf("[VIDEO] Pre-encoding failed, the next save encodes the whole window\n");
+			break;
+		}
+		encoder->nextFrame++;
+	}
+	return NULL;
+}
+
+static void stop_pre_encoding(VideoEncoder *encoder) {
+	if(!encoder->preEncoding)
+		return;
+	encoder->stopPreEncoding = 1;
+	pthread_join(encoder->preEncoder, NULL);
+	encoder->preEncoding = 0;
+}
+
+// Timestamp of a history frame in the encoder's time base, relative to the first exported ring frame
+static int64_t history_pts(VideoEncoder *encoder, AVFrame *frame) {
+	VideoStream *video = encoder->source;
+	int64_t back = video_frame_time(video, encoder->exportStart) - frame->pts;
+	return encoder->ptsBase + encoder->exportStart - llround(back * video->orchestrator->framerate / 1000000.0);
+}
+
+// Returns the history frame in the encoder's size
+static AVFrame *prepare_history_frame(VideoEncoder *encoder, AVFrame *source) {
+	int width = encoder->codecContext->width, height = encoder->codecContext->height;
+	enum AVPixelFormat format = encoder->codecContext->pix_fmt;
+	if(source->width == width && source->height == height && source->format == format) {
+		av_frame_ref(encoder->frame, source);
+		return encoder->frame;
+	}
+	if(encoder->historyFrame == NULL) {
+		encoder->historyFrame = alloc_video_frame(width, height, format);
+		encoder->historyScaler = sws_getContext(source->width, source->height, source->format,
+				width, height, format, SWS_BICUBIC, NULL, NULL, NULL);
+	}
+	// The encoder may still hold a reference to the previous frame
+	av_frame_make_writable(encoder->historyFrame);
+	sws_scale(encoder->historyScaler, (const uint8_t * const *) source->data, source->linesize,
+			0, source->height, encoder->historyFrame->data, encoder->historyFrame->linesize);
+	return encoder->historyFrame;
+}
+
+// Adaptive exports place keyframes themselves, which can't happen once the ring's encoded ahead of time in fixed chunks
+int adaptive_export(VideoStream *video) {
+	int preEncode = cfg_getbool(C_EXPORT_ROOT, "pre-encode") && !cfg_getbool(C_EXPORT_ROOT, "process") && video->history == NULL;
+	return cfg_getbool(cfg_getsec(C_EXPORT_ROOT, "adaptive"), "enabled") && !preEncode;
+}
+
+// Total difference of 8 neighbouring pixels up to which they count as unchanged, covers scaler rounding
+#define DUPLICATE_TOLERANCE 8
+
+// Sum of absolute differences of two rows of luma. `peak` is raised to the largest difference of any 8 neighbouring pixels.
+static uint64_t row_difference(const uint8_t *a, const uint8_t *b, size_t width, unsigned *peak) {
+	uint64_t total = 0;
+	size_t x = 0;
+#ifdef __SSE2__
+	// psadbw sums the differences of each half of 16 pixels into the low 16 bits of its 64-bit lane
+	__m128i sum = _mm_setzero_si128();
+	__m128i highest = _mm_setzero_si128();
+	for(; x + 16 <= width; x += 16) {
+		__m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i*) (a + x)), _mm_loadu_si128((const __m128i*) (b + x)));
+		sum = _mm_add_epi64(sum, sad);
+		highest = _mm_max_epi16(highest, sad);
+	}
+	uint64_t sums[2];
+	_mm_storeu_si128((__m128i*) sums, sum);
+	total = sums[0] + sums[1];
+	unsigned high = _mm_extract_epi16(highest, 0) > _mm_extract_epi16(highest, 4) ? _mm_extract_epi16(highest, 0) : _mm_extract_epi16(highest, 4);
+	if(high > *peak)
+		*peak = high;
+#endif
+	for(; x < width; x += 8) {
+		unsigned group = 0;
+		for(size_t i = x; i < x + 8 && i < width; i++) {
+			group += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+		}
+		total += group;
+		if(group > *peak)
+			*peak = group;
+	}
+	return total;
+}
+
+// Compares the luma of two frames, returns the mean absolute difference per pixel (0-255)
+// and sets `duplicate` if no part of the picture changed.
+static double frame_difference(const AVFrame *a, const AVFrame *b, int *duplicate) {
+	uint64_t total = 0;
+	unsigned peak = 0;
+	for(int y = 0; y < a->height; y++) {
+		total += row_difference(a->data[0] + (size_t) y * a->linesize[0], b->data[0] + (size_t) y * b->linesize[0], a->width, &peak);
+	}
+	*duplicate = peak <= DUPLICATE_TOLERANCE;
+	return (double) total / ((double) a->width * a->height);
+}
+
+// Scores every frame of the paused ring against the one before it and plans the export from that:
+// keyframes at scene cuts, every gop-size frames while the picture moves and only every `max-gop` seconds while
+// it's static, and duplicate frames dropped so they're shown for longer instead (variable framerate).
+// The plan is shared by every rendition of the save.
+void plan_video_export(VideoStream *video) {
+	free(video->plan);
+	video->plan = NULL;
+	video->planFrames = 0;
+	if(!adaptive_export(video))
+		return;
+
+	cfg_t *section = cfg_getsec(C_EXPORT_ROOT, "adaptive");
+	double sceneCut = cfg_getfloat(section, "scene-cut");
+	double staticLevel = cfg_getfloat(section, "static-level");
+	int dropDuplicates = cfg_getbool(section, "drop-duplicates");
+	size_t framerate = video->orchestrator->framerate;
+	size_t maxGop = cfg_getint(section, "max-gop") * framerate;
+	if(maxGop < DEFAULT_GOP_SIZE)
+		maxGop = DEFAULT_GOP_SIZE;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t span = trace_begin();
+	video->planStart = ring_start(video);
+	video->planFrames = video->frameCount - video->planStart;
+	video->plan = malloc(video->planFrames);
+	size_t sinceKeyframe = 0, cuts = 0, dropped = 0;
+	for(size_t i = 0; i < video->planFrames; i++) {
+		size_t index = video->planStart + i;
+		if(i == 0) {
+			video->plan[i] = PLAN_KEYFRAME;
+			sinceKeyframe = 1;
+			continue;
+		}
+		int duplicate;
+		double difference = frame_difference(video->frameBuffer[index % video->bufferSize],
+				video->frameBuffer[(index - 1) % video->bufferSize], &duplicate);
+		int moving = !duplicate && difference > staticLevel;
+		if(difference >= sceneCut) {
+			video->plan[i] = PLAN_KEYFRAME;
+			cuts++;
+		} else if(sinceKeyframe >= maxGop || (moving && sinceKeyframe >= DEFAULT_GOP_SIZE)) {
+			video->plan[i] = PLAN_KEYFRAME;
+		} else if(duplicate && dropDuplicates && i + 1 < video->planFrames) {
+			// The last frame is always encoded, it ends the video where the audio ends
+			video->plan[i] = PLAN_DROP;
+			dropped++;
+		} else {
+			video->plan[i] = PLAN_ENCODE;
+		}
+		sinceKeyframe = video->plan[i] == PLAN_KEYFRAME ? 1 : sinceKeyframe + 1;
+	}
+	trace_end("plan_export", span);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+	printf("[VIDEO] Analysed %zu frames in %.0f ms: %zu scene cuts, %zu duplicates dropped\n", video->planFrames, elapsed, cuts, dropped);
+}
+
+// Planned action for a frame, frames without a plan are encoded as usual
+static uint8_t frame_plan(VideoStream *video, size_t index) {
+	if(video->plan == NULL || index < video->planStart || index - video->planStart >= video->planFrames)
+		return PLAN_ENCODE;
+	return video->plan[index - video->planStart];
+}
+
+// Decides which frames of the paused ring are exported. With pre-encoding, the export starts at the oldest
+// keyframe encoded ahead of time that's still in the ring, up to a chunk later than the ring's start.
+// Returns the seconds between the ring's start and the first exported frame, the audio skips as much.
+// With a history tier, the history comes first and the negated length of it is returned instead.
+double prepare_video_export(VideoEncoder *encoder) {
+	VideoStream *video = encoder->source;
+	stop_pre_encoding(encoder);
+	follow_ring_generation(encoder);
+
+	size_t start = ring_start(video);
+	if(encoder->nextFrame > 0) {
+		size_t keyframe = next_chunk(encoder, start > encoder->validStart ? start : encoder->validStart);
+		if(keyframe < encoder->nextFrame)
+			start = keyframe;
+		else if(encoder->nextFrame > start)
+			// Nothing usable was encoded, the encoder can't go back in time though
+			start = encoder->nextFrame;
 	}
-	int n = 0;
-	int ret;
+	encoder->exportStart = start;
+	encoder->exportOrigin = encoder->ptsBase + start;
+
+	// The history tier is stitched in front of the ring, at its own framerate.
+	// Only frames from before the first exported ring frame are taken.
+	HistoryTier *history = video->history;
+	encoder->historyCount = 0;
+	if(history != NULL && history->frameCount > 0) {
+		size_t valid = history->frameCount < history->bufferSize ? history->frameCount : history->bufferSize;
+		size_t first = history->frameCount - valid;
+		int64_t startTime = video_frame_time(video, start);
+		while(encoder->historyCount < valid
+				&& history->frames[(first + encoder->historyCount) % history->bufferSize]->pts < startTime)
+			encoder->historyCount++;
+		if(encoder->historyCount > 0) {
+			encoder->historyStart = first;
+			encoder->exportOrigin = history_pts(encoder, history->frames[first % history->bufferSize]);
+			// The audio only covers the ring, its track starts where the ring does
+			return -(double) (encoder->ptsBase + start - encoder->exportOrigin) / video->orchestrator->framerate;
+		}
+	}
+	return (double) (start - ring_start(video)) / video->orchestrator->framerate;
+}
 
-	do {
-		AVFrame *frame = video->frameBuffer[start_index];
-		frame->pts = av_rescale_q(n, video->codecContext->time_base, video->stream->time_base);
-		frame->pkt_dts = av_rescale_q(n, video->codecContext->time_base, video->stream->time_base);
+// Encodes the paused ring of the encoder's stream into its rendition, returns the number of frames encoded.
+// prepare_video_export() has to be called first.
+size_t flush_video_encoder(VideoEncoder *encoder) {
+	VideoStream *video = encoder->source;
+	encoder->exporting = 1;
 
-		printf("\r[VIDEO] Encoding Frame %i/%i (PTS: %ld)", start_index, video->bufferSize, frame->pts);
+	// Remux whatever was encoded ahead of time, then encode the rest
+	for(size_t i = 0; i < encoder->nb_cached; i++) {
+		write_exported_packet(encoder, encoder->cached[i]);
+		av_packet_free(&encoder->cached[i]);
+	}
+	encoder->nb_cached = 0;
+	size_t first = encoder->nextFrame > encoder->exportStart ? encoder->nextFrame : encoder->exportStart;
+	if(first > encoder->exportStart)
+		printf("[VIDEO] %zu frames were encoded ahead of time\n", first - encoder->exportStart);
+
+	// History frames have gaps between them, which their timestamps keep
+	HistoryTier *history = video->history;
+	int64_t lastPts = encoder->exportOrigin - 1;
+	size_t historyFrames = 0;
+	for(size_t i = 0; i < encoder->historyCount; i++) {
+		AVFrame *source = history->frames[(encoder->historyStart + i) % history->bufferSize];
+		int64_t pts = history_pts(encoder, source);
+		if(pts <= lastPts || pts >= encoder->ptsBase + encoder->exportStart)
+			continue;
+		AVFrame *frame = prepare_history_frame(encoder, source);
+		frame->pts = lastPts = pts;
+		frame->pict_type = historyFrames == 0 ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+		int ret = encode_video_frame(encoder, frame);
+		av_frame_unref(encoder->frame);
+		if(ret < 0)
+			return historyFrames;
+		historyFrames++;
+	}
+	if(historyFrames > 0)
+		printf("[VIDEO] Encoded %zu history frames\n", historyFrames);
+	encoder->exportedDuration = (double) (encoder->ptsBase + video->frameCount - encoder->exportOrigin) / video->orchestrator->framerate;
+
+	size_t dropped = 0;
+	for (size_t index = first; index < video->frameCount; index++) {
+		// Dropped duplicates leave a gap in the timestamps, the previous frame is shown until the next one
+		uint8_t plan = frame_plan(video, index);
+		if(plan == PLAN_DROP && index != encoder->exportStart) {
+			dropped++;
+			continue;
+		}
+		AVFrame *frame = prepare_video_frame(encoder, video->frameBuffer[index % video->bufferSize]);
+		frame->pts = encoder->ptsBase + index;
+		frame->pict_type = index == encoder->exportStart || plan == PLAN_KEYFRAME ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
 
-		ret = avcodec_send_frame(video->codecContext, frame);
+		int ret = encode_video_frame(encoder, frame);
+		av_frame_unref(encoder->frame);
 		if (ret < 0) {
-			printf("Error sending frame for encoding\n");
-			return;
+			return historyFrames + index - encoder->exportStart - dropped;
 		}
-		while (ret >= 0) {
-			ret = avcodec_receive_packet(video->codecContext, video->packet);
-			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-				goto outer;
-			} else if (ret < 0) {
-				printf("Error during encoding\n");
-				return;
-			}
+	}
+
+	// Drain the frames the encoder is still holding on to
+	encode_video_frame(encoder, NULL);
+	return historyFrames + video->frameCount - encoder->exportStart - dropped;
+}
+
+// The captured window may disappear at any point, which the default handler would exit on
+static int ignore_x_error(Display *display, XErrorEvent *event) {
+	return 0;
+}
+
+static int window_matches(Display *display, Window window, const char *name) {
+	char *title = NULL;
+	int matches = 0;
+	if(XFetchName(display, window, &title) && title != NULL) {
+		matches = strstr(title, name) != NULL;
+		XFree(title);
+	}
+	XClassHint hint;
+	if(!matches && XGetClassHint(display, window, &hint)) {
+		matches = (hint.res_name && strcmp(hint.res_name, name) == 0) || (hint.res_class && strcmp(hint.res_class, name) == 0);
+		XFree(hint.res_name);
+		XFree(hint.res_class);
+	}
+	return matches;
+}
+
+// Depth first search for the first window whose title contains `name`, or whose WM_CLASS is `name`
+static Window find_window(Display *display, Window parent, const char *name) {
+	Window root, parentReturn, *children = NULL;
+	unsigned int count = 0;
+	Window found = None;
+	if(!XQueryTree(display, parent, &root, &parentReturn, &children, &count))
+		return None;
+	for(unsigned int i = 0; i < count && found == None; i++) {
+		if(window_matches(display, children[i], name))
+			found = children[i];
+		else
+			found = find_window(display, children[i], name);
+	}
+	if(children)
+		XFree(children);
+	return found;
+}
+
+// Looks up the window named in the capture section and has the X server keep its contents
+// in an off-screen pixmap, so it can be read even while it's covered by other windows.
+static int open_window_capture(VideoThreadOrchestrator *orch, const char *name) {
+	Display *display = orch->display;
+	int eventBase, errorBase;
+	if(!XCompositeQueryExtension(display, &eventBase, &errorBase)) {
+		printf("[VIDEO] XComposite extension not supported, can't capture window %s\n", name);
+		return 1;
+	}
 
-			// Calculate packet duration
-			video->packet->duration = av_rescale_q(video->packet->duration, video->codecContext->time_base, video->stream->time_base);
-			// Write packet to file
-			av_interleaved_write_frame(video->root->formatContext, video->packet);
-			av_packet_unref(video->packet);
+	// An XID as printed by xwininfo, otherwise the window's title or class
+	char *end;
+	Window window = strtoul(name, &end, 0);
+	if(*end != '\0' || window == 0) {
+		window = find_window(display, DefaultRootWindow(display), name);
+	}
+	if(window == None) {
+		printf("[VIDEO] Couldn't find a window matching \"%s\"\n", name);
+		return 1;
+	}
+
+	XSetErrorHandler(ignore_x_error);
+	XCompositeRedirectWindow(display, window, CompositeRedirectAutomatic);
+	XSync(display, False);
+	orch->window = window;
+	printf("[VIDEO] Capturing window 0x%lx (%s)\n", window, name);
+	return 0;
+}
+
+// Follows a size change of the captured window, noticed during the previous grab.
+// If no image of the new size can be attached, the old one is kept and it's tried again on the next grab.
+static void follow_window_size(VideoThreadContext *ctx) {
+	if(ctx->windowWidth == ctx->imageWidth && ctx->windowHeight == ctx->imageHeight)
+		return;
+	uint8_t *oldImage = ctx->image;
+	xcb_shm_seg_t oldSegment = ctx->segment;
+	int oldShmid = ctx->shmid;
+	if(attach_shm_image(ctx, ctx->windowWidth, ctx->windowHeight)) {
+		if(!ctx->resizeFailed)
+			printf("[VIDEO] Can't follow window 0x%lx to %dx%d, keeping %dx%d\n", ctx->sync->window,
+					ctx->windowWidth, ctx->windowHeight, ctx->imageWidth, ctx->imageHeight);
+		ctx->image = oldImage;
+		ctx->segment = oldSegment;
+		ctx->shmid = oldShmid;
+		ctx->resizeFailed = 1;
+		return;
+	}
+	ctx->resizeFailed = 0;
+	// The old image is only swapped back in to be detached
+	uint8_t *image = ctx->image;
+	xcb_shm_seg_t segment = ctx->segment;
+	ctx->image = oldImage;
+	ctx->segment = oldSegment;
+	detach_shm_image(ctx);
+	ctx->image = image;
+	ctx->segment = segment;
+	sws_freeContext(ctx->formatter);
+	ctx->formatter = create_formatter(ctx->sync->stream, ctx->windowWidth, ctx->windowHeight);
+}
+
+// Sends the requests for the next image without waiting for them, finish_grab() collects the replies.
+// A window is read from its off-screen pixmap, which is replaced whenever the window is resized,
+// so it's looked up on every frame. Its size is requested along with it and applied on the next grab.
+static void request_grab(VideoThreadContext *ctx, int x, int y) {
+	xcb_connection_t *connection = ctx->connection;
+	xcb_window_t window = ctx->sync->window;
+	if(window == None) {
+		ctx->imageCookie = xcb_shm_get_image(connection, ctx->root, x, y, ctx->imageWidth, ctx->imageHeight,
+				~0, XCB_IMAGE_FORMAT_Z_PIXMAP, ctx->segment, 0);
+		// The pointer's position comes back along with the image
+		if(ctx->sync->crop != NULL && !ctx->sync->crop->followWindow)
+			ctx->pointerCookie = xcb_query_pointer(connection, ctx->root);
+	} else {
+		follow_window_size(ctx);
+		// The pixmap includes the border, the window's contents start after it
+		xcb_pixmap_t pixmap = xcb_generate_id(connection);
+		xcb_composite_name_window_pixmap(connection, window, pixmap);
+		ctx->imageCookie = xcb_shm_get_image(connection, pixmap, ctx->windowBorder, ctx->windowBorder,
+				ctx->imageWidth, ctx->imageHeight, ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, ctx->segment, 0);
+		xcb_free_pixmap(connection, pixmap);
+		ctx->geometryCookie = xcb_get_geometry(connection, window);
+	}
+	xcb_flush(connection);
+}
+
+// Waits until the X server has copied the requested image into the worker's segment.
+// If it couldn't, e.g. while the window is unmapped or after it's gone, the segment keeps the last frame.
+static void finish_grab(VideoThreadContext *ctx) {
+	xcb_connection_t *connection = ctx->connection;
+	xcb_generic_error_t *error = NULL;
+	free(xcb_shm_get_image_reply(connection, ctx->imageCookie, &error));
+	free(error);
+
+	FocusCrop *crop = ctx->sync->crop;
+	if(crop != NULL && !crop->followWindow) {
+		xcb_query_pointer_reply_t *pointer = xcb_query_pointer_reply(connection, ctx->pointerCookie, NULL);
+		if(pointer != NULL) {
+			aim_crop(crop, pointer->root_x, pointer->root_y, 1);
+			free(pointer);
 		}
+	}
 
-outer:
-		++n;
-		if (n == video->bufferSize) {
-			encoding = 0;
+	if(ctx->sync->window != None) {
+		xcb_get_geometry_reply_t *geometry = xcb_get_geometry_reply(connection, ctx->geometryCookie, NULL);
+		if(geometry == NULL) {
+			if(!ctx->sync->windowLost)
+				printf("[VIDEO] Window 0x%lx is gone, repeating the last frame\n", ctx->sync->window);
+			ctx->sync->windowLost = 1;
+		} else {
+			ctx->windowWidth = geometry->width;
+			ctx->windowHeight = geometry->height;
+			ctx->windowBorder = geometry->border_width;
+			free(geometry);
 		}
-		start_index = (start_index + 1) % video->bufferSize;
-	}while (encoding);
+	}
 
+	// Errors of the requests without a reply end up in the event queue
+	xcb_generic_event_t *event;
+	while((event = xcb_poll_for_event(connection)) != NULL)
+		free(event);
 }
 
-// TODO: Debug this function, as of now it isn't really used as the binary should
-// never really exit, except with SIGINT, in which case we don't need to free.
+// Creates the worker's shared memory segment, which the X server copies captured pixels into.
+// Images are 32 bits per pixel, for both 24 and 32 bit depths.
+static int attach_shm_image(VideoThreadContext *ctx, int width, int height) {
+	ctx->shmid = shmget(IPC_PRIVATE, (size_t) width * height * 4, IPC_CREAT | 0600);
+	if(ctx->shmid == -1) {
+		printf("Error creating shared memory segment\n");
+		return 1;
+	}
+	ctx->image = shmat(ctx->shmid, 0, 0);
+	if(ctx->image == (void*) -1) {
+		ctx->image = NULL;
+		shmctl(ctx->shmid, IPC_RMID, 0);
+		printf("Error attaching shared memory segment\n");
+		return 1;
+	}
+
+	ctx->segment = xcb_generate_id(ctx->connection);
+	xcb_generic_error_t *error = xcb_request_check(ctx->connection, xcb_shm_attach_checked(ctx->connection, ctx->segment, ctx->shmid, 0));
+	// Both sides are attached now, the segment goes away once they've detached
+	shmctl(ctx->shmid, IPC_RMID, 0);
+	if(error != NULL) {
+		free(error);
+		shmdt(ctx->image);
+		ctx->image = NULL;
+		printf("Error attaching shared memory segment to the X server\n");
+		return 1;
+	}
+	ctx->imageWidth = width;
+	ctx->imageHeight = height;
+	ctx->bytesPerLine = width * 4;
+	return 0;
+}
+
+static void detach_shm_image(VideoThreadContext *ctx) {
+	if(ctx->image == NULL)
+		return;
+	xcb_shm_detach(ctx->connection, ctx->segment);
+	xcb_flush(ctx->connection);
+	shmdt(ctx->image);
+	ctx->image = NULL;
+}
+
+// Stops the worker threads and frees the stream.
+// The capture has to be paused, so all workers are either waiting for their turn or for the capture to resume.
 void free_video_stream(VideoStream *video) {
-	// Kill all threads
+	for(int i = 0; i < video->orchestrator->nb_threads; i++) {
+		pthread_cancel(video->orchestrator->threads[i]);
+		pthread_join(video->orchestrator->threads[i], NULL);
+	}
 	for(int i = 0; i < video->orchestrator->nb_threads; i++) {
 		VideoThreadContext *ctx = video->orchestrator->contexts[i];
-		pthread_kill(video->orchestrator->threads[i], SIGINT);
-		// Free XShm stuff
-		if(ctx->shmInfo->shmaddr != NULL) {
-			XShmDetach(ctx->sync->display, ctx->shmInfo);
-			shmdt(ctx->shmInfo->shmaddr);
-			shmctl(ctx->shmInfo->shmid, IPC_RMID, 0);
+		if(ctx->connection != NULL) {
+			detach_shm_image(ctx);
+			xcb_disconnect(ctx->connection);
 		}
+		sws_freeContext(ctx->formatter);
+		sws_freeContext(ctx->cropFormatter);
+		sem_destroy(&ctx->active);
 		free(ctx);
 	}
+	if(video->history != NULL)
+		free_history_tier(video->history);
+	if(video->orchestrator->injector != NULL) {
+		sws_freeContext(video->orchestrator->injector->scaler);
+		free(video->orchestrator->injector);
+	}
+	// The crop's own stream is freed separately
+	FocusCrop *crop = video->orchestrator->crop;
+	if(crop != NULL) {
+		if(crop->connection != NULL) {
+			crop->stop = 1;
+			pthread_join(crop->thread, NULL);
+			xcb_disconnect(crop->connection);
+		}
+		free(crop);
+	}
 	// Free XDisplay
-	XCloseDisplay(video->orchestrator->display);
+	if(video->orchestrator->display != NULL)
+		XCloseDisplay(video->orchestrator->display);
 	free(video->orchestrator->contexts);
 	free(video->orchestrator->threads);
 	free(video->orchestrator);
 	
-	// Free all the things
-	av_packet_free(&video->packet);
-	avcodec_free_context(&video->codecContext);
 	// Free all frames inside frameBuffer
-	for(int i = 0; i < video->bufferSize; i++) {
+	for(int i = 0; i < video->capacity; i++) {
 		av_frame_free(&video->frameBuffer[i]);
 	}
 	free(video->frameBuffer);
+	free(video->plan);
+	free(video);
 }
 
-void video_encode_ximage(VideoStream *video, XImage *screenContent, struct SwsContext *formatter) {
-	// TODO: streamline the parameters and rename this function.
-	// the requirement for SwsContext pixfmtScaler was added after adding multi-threading to prevent dropped
-	// frames from long sws_scale calls.
-	// With the old code (SwsContext allocated by VideoStream*); thus multiple threads using one SwsContext,
-	// the sws_scale function would more often than not cause a SEGFAULT, the most likely reason is some internal variables
-	// in SwsContext being messed up with multi-threading.
-	
+// Resizes the ring in place to hold `windowSize` seconds at `framerate` of frames
+// in the size currently set in the config. The newest frames are kept;
+// they're decimated or duplicated to the new framerate and rescaled if the frame size changed.
+// The capture has to be paused and the ring fully grown while this runs.
+int resize_video_stream(VideoStream *video, size_t framerate, size_t windowSize) {
+	size_t frameWidth, frameHeight;
+	if(video->orchestrator->feeder != NULL) {
+		// The focus crop keeps its size, the workers cut it at that size
+		size_t cropWidth, cropHeight;
+		if(!focus_crop_size(&cropWidth, &cropHeight) || cropWidth != video->frameWidth || cropHeight != video->frameHeight)
+			printf("[VIDEO] Changing the focus crop requires a restart, keeping %zux%zu\n", video->frameWidth, video->frameHeight);
+		frameWidth = video->frameWidth;
+		frameHeight = video->frameHeight;
+	} else {
+		configured_frame_size(&frameWidth, &frameHeight);
+
+		if(video->orchestrator->injector == NULL
+				&& (cfg_getint(C_CAPTURE_ROOT, "width") != video->sourceWidth || cfg_getint(C_CAPTURE_ROOT, "height") != video->sourceHeight)) {
+			printf("[VIDEO] Changing the capture zone requires a restart, keeping %zux%zu\n", video->sourceWidth, video->sourceHeight);
+		}
+		cfg_t *history = cfg_getsec(C_SPOTLIGHT_ROOT, "history");
+		size_t historyFrames = cfg_getint(history, "window-size") * cfg_getint(history, "framerate");
+		if(historyFrames != (video->history ? video->history->bufferSize : 0)
+				|| (video->history && (size_t) cfg_getint(history, "framerate") != video->history->framerate)) {
+			printf("[VIDEO] Changing the history requires a restart, keeping the current one\n");
+		}
+	}
+
+	size_t oldSize = video->bufferSize;
+	size_t oldFramerate = video->orchestrator->framerate;
+	size_t newSize = framerate * windowSize;
+	if(newSize == 0) {
+		printf("[VIDEO] Invalid framerate or window size, keeping the current ring\n");
+		return 1;
+	}
+	int rescale = frameWidth != video->frameWidth || frameHeight != video->frameHeight;
+	if(newSize == oldSize && framerate == oldFramerate && !rescale) {
+		return 0;
+	}
+
+	// Order the captured frames from oldest to newest
+	size_t valid = video->frameCount < oldSize ? video->frameCount : oldSize;
+	size_t oldest = video->frameCount > oldSize ? video->writeIndex : 0;
+	AVFrame **ordered = malloc(sizeof(AVFrame*) * oldSize);
+	uint8_t *taken = calloc(oldSize, sizeof(uint8_t));
+	AVFrame **frames = calloc(newSize, sizeof(AVFrame*));
+	if(ordered == NULL || taken == NULL || frames == NULL) {
+		printf("[VIDEO] Error allocating frame buffer\n");
+		free(ordered);
+		free(taken);
+		free(frames);
+		return 1;
+	}
+	for(size_t i = 0; i < oldSize; i++) {
+		ordered[i] = video->frameBuffer[(oldest + i) % oldSize];
+	}
+
+	struct SwsContext *scaler = NULL;
+	if(rescale) {
+		scaler = sws_getContext(video->frameWidth, video->frameHeight, video->format,
+				frameWidth, frameHeight, video->format, SWS_BILINEAR, NULL, NULL, NULL);
+	}
+
+	// Map every kept slot onto the source frame closest in time, aligned on the newest frame.
+	size_t kept = valid * framerate / oldFramerate;
+	if(kept > newSize)
+		kept = newSize;
+	for(size_t j = 0; j < kept; j++) {
+		size_t source = valid - 1 - (kept - 1 - j) * oldFramerate / framerate;
+		if(!rescale && !taken[source]) {
+			frames[j] = ordered[source];
+			taken[source] = 1;
+			continue;
+		}
+		frames[j] = alloc_video_frame(frameWidth, frameHeight, video->format);
+		if(frames[j] == NULL)
+			goto fail;
+		if(rescale) {
+			sws_scale(scaler, (const uint8_t * const *) ordered[source]->data, ordered[source]->linesize,
+					0, video->frameHeight, frames[j]->data, frames[j]->linesize);
+		} else {
+			av_frame_copy(frames[j], ordered[source]);
+		}
+	}
+
+	// Fill up the remaining slots, re-using frames that weren't kept where possible
+	size_t spare = 0;
+	for(size_t j = kept; j < newSize; j++) {
+		while(!rescale && spare < oldSize && taken[spare])
+			spare++;
+		if(!rescale && spare < oldSize) {
+			frames[j] = ordered[spare];
+			taken[spare] = 1;
+		} else if((frames[j] = alloc_video_frame(frameWidth, frameHeight, video->format)) == NULL) {
+			goto fail;
+		}
+	}
+	for(size_t i = 0; i < oldSize; i++) {
+		if(!taken[i])
+			av_frame_free(&ordered[i]);
+	}
+
+	free(video->frameBuffer);
+	size_t frameCount = video->frameCount;
+	video->frameBuffer = frames;
+	video->bufferSize = newSize;
+	video->capacity = newSize;
+	video->writeIndex = kept % newSize;
+	video->frameCount = kept;
+	video->generation++;
+	video->frameWidth = frameWidth;
+	video->frameHeight = frameHeight;
+	video->orchestrator->framerate = framerate;
+	restart_video_time(video, frameCount, oldFramerate);
+
+	// The worker's scalers write straight into the ring, so they need to know the new size
+	if(rescale) {
+		for(int i = 0; i < video->orchestrator->nb_threads; i++) {
+			VideoThreadContext *ctx = video->orchestrator->contexts[i];
+			sws_freeContext(ctx->formatter);
+			ctx->formatter = create_formatter(video, ctx->imageWidth, ctx->imageHeight);
+		}
+	}
+
+	printf("[VIDEO] Resized ring from %zu to %zu frames (%zux%zu @ %zu fps), kept %zu frames\n",
+			oldSize, newSize, frameWidth, frameHeight, framerate, kept);
+	sws_freeContext(scaler);
+	free(ordered);
+	free(taken);
+	return 0;
+
+fail:
+	printf("[VIDEO] Error allocating frames, keeping the current ring\n");
+	for(size_t j = 0; j < newSize; j++) {
+		if(frames[j] == NULL)
+			continue;
+		// Frames we borrowed from the old ring stay where they are
+		int borrowed = 0;
+		for(size_t i = 0; i < oldSize && !borrowed; i++)
+			borrowed = frames[j] == ordered[i];
+		if(!borrowed)
+			av_frame_free(&frames[j]);
+	}
+	sws_freeContext(scaler);
+	free(ordered);
+	free(taken);
+	free(frames);
+	return 1;
+}
+
+// Capture time of the frame at `index` in the ring's current generation, in microseconds
+int64_t video_frame_time(VideoStream *video, size_t index) {
+	return video->startTime + (int64_t) index * 1000000 / video->orchestrator->framerate;
+}
+
+// Keeps the capture times of the frames continuous after a resize started the indices over.
+// The resize kept the newest frames (now ending at frameCount) of the `oldFrameCount` at `oldFramerate`.
+void restart_video_time(VideoStream *video, size_t oldFrameCount, size_t oldFramerate) {
+	int64_t next = video->startTime + (int64_t) oldFrameCount * 1000000 / oldFramerate;
+	video->startTime = next - (int64_t) video->frameCount * 1000000 / video->orchestrator->framerate;
+}
+
+// Reads the size of the history frames from the config, the ring's size if none is set
+static void history_frame_size(size_t *width, size_t *height) {
+	cfg_t *scale = cfg_getsec(cfg_getsec(C_SPOTLIGHT_ROOT, "history"), "scale");
+	configured_frame_size(width, height);
+	if(scale && cfg_getint(scale, "width") && cfg_getint(scale, "height")) {
+		*width = cfg_getint(scale, "width");
+		*height = cfg_getint(scale, "height");
+	}
+}
+
+// Returns the bytes the configured history tier takes up in the given format, 0 without one
+size_t history_memory(enum AVPixelFormat format) {
+	cfg_t *section = cfg_getsec(C_SPOTLIGHT_ROOT, "history");
+	size_t frames = cfg_getint(section, "window-size") * cfg_getint(section, "framerate");
+	if(frames == 0)
+		return 0;
+	size_t width, height;
+	history_frame_size(&width, &height);
+	return video_slot_size(width, height, format) * frames;
+}
+
+// Copies one ring frame into the history tier
+static void demote_frame(VideoStream *video, HistoryTier *history, AVFrame *source, int64_t time) {
+	// The ring's frame size may change when the config is reloaded
+	if(history->sourceWidth != video->frameWidth || history->sourceHeight != video->frameHeight) {
+		sws_freeContext(history->scaler);
+		history->scaler = sws_getContext(video->frameWidth, video->frameHeight, video->format,
+				history->width, history->height, video->format, SWS_BILINEAR, NULL, NULL, NULL);
+		history->sourceWidth = video->frameWidth;
+		history->sourceHeight = video->frameHeight;
+	}
+	AVFrame *frame = history->frames[history->writeIndex];
+	av_frame_make_writable(frame);
+	uint64_t span = trace_begin();
+	sws_scale(history->scaler, (const uint8_t * const *) source->data, source->linesize,
+			0, video->frameHeight, frame->data, frame->linesize);
+	trace_end("demote", span);
+	frame->pts = time;
+	history->writeIndex = (history->writeIndex + 1) % history->bufferSize;
+	history->frameCount++;
+}
+
+// Moves frames that are about to age out of the ring into the history tier, at the tier's framerate.
+// Frames are taken a second before they're overwritten, so they're only ever held once.
+static void *history_thread(void *arg) {
+	VideoStream *video = arg;
+	HistoryTier *history = video->history;
+	Capture *cap = video->root;
+	place_thread(THREAD_EXPORT);
+	trace_thread_name("history", -1);
+	int64_t interval = 1000000 / history->framerate;
+	size_t generation = video->generation;
+	size_t next = 0;
+
+	while(!history->stop) {
+		// The tier is written within the ring section, so exports see it paused along with the ring
+		if(!begin_ring_write(cap)) {
+			usleep(10000);
+			continue;
+		}
+		if(generation != video->generation) {
+			generation = video->generation;
+			next = 0;
+		}
+		size_t framerate = video->orchestrator->framerate;
+		size_t margin = video_write_margin(video);
+		size_t frameCount = __atomic_load_n(&video->frameCount, __ATOMIC_ACQUIRE);
+		size_t aging = frameCount + framerate + margin > video->bufferSize ? frameCount + framerate + margin - video->bufferSize : 0;
+		size_t oldest = frameCount + margin > video->bufferSize ? frameCount + margin - video->bufferSize : 0;
+		// Frames that were overwritten before we got to them are lost
+		if(next < oldest)
+			next = oldest;
+		if(next >= aging) {
+			end_ring_write(cap);
+			usleep(1000000 / framerate);
+			continue;
+		}
+
+		int64_t time = video_frame_time(video, next);
+		if(time >= history->nextTime) {
+			demote_frame(video, history, video->frameBuffer[next % video->bufferSize], time);
+			// Aligned on a grid, so rounding doesn't make the tier drift
+			history->nextTime = (time / interval + 1) * interval;
+		}
+		next++;
+		end_ring_write(cap);
+	}
+	return NULL;
+}
+
+// Allocates the history tier configured in the `history` section and starts moving frames into it.
+// Returns 1 if it can't be allocated.
+static int open_history_tier(VideoStream *video) {
+	cfg_t *section = cfg_getsec(C_SPOTLIGHT_ROOT, "history");
+	size_t framerate = cfg_getint(section, "framerate");
+	size_t frames = cfg_getint(section, "window-size") * framerate;
+	if(frames == 0)
+		return 0;
+	if(framerate >= video->orchestrator->framerate) {
+		printf("[VIDEO] The history framerate has to be lower than the capture's, not keeping a history\n");
+		return 0;
+	}
+
+	HistoryTier *history = malloc(sizeof(HistoryTier));
+	memset(history, 0, sizeof(HistoryTier));
+	history->framerate = framerate;
+	history->bufferSize = frames;
+	history_frame_size(&history->width, &history->height);
+	history->frames = malloc(sizeof(AVFrame*) * frames);
+	for(size_t i = 0; i < frames; i++) {
+		history->frames[i] = alloc_video_frame(history->width, history->height, video->format);
+		if(history->frames[i] == NULL) {
+			printf("Error allocating history frame %zu\n", i);
+			while(i > 0)
+				av_frame_free(&history->frames[--i]);
+			free(history->frames);
+			free(history);
+			return 1;
+		}
+	}
+	printf("[VIDEO] Keeping %ld s of history at %zu fps (%zux%zu) behind the window\n",
+			cfg_getint(section, "window-size"), framerate, history->width, history->height);
+	video->history = history;
+	pthread_create(&history->thread, NULL, history_thread, video);
+	return 0;
+}
+
+static void free_history_tier(HistoryTier *history) {
+	history->stop = 1;
+	pthread_join(history->thread, NULL);
+	for(size_t i = 0; i < history->bufferSize; i++) {
+		av_frame_free(&history->frames[i]);
+	}
+	free(history->frames);
+	sws_freeContext(history->scaler);
+	free(history);
+}
+
+// Claims the next slot of the ring. Slots are claimed in the order the grabs are requested,
+// which keeps the frames in order even if the workers take different times to convert them.
+AVFrame *claim_video_frame(VideoStream *video) {
 	AVFrame* frame = video->frameBuffer[video->writeIndex];
 	av_frame_make_writable(frame);
 
@@ -214,195 +1493,269 @@ void video_encode_ximage(VideoStream *video, XImage *screenContent, struct SwsCo
 	// other threads write to the correct address, if we take too long.
 	video->writeIndex = (video->writeIndex + 1) % video->bufferSize;
 	video->frameCount++;
+	return frame;
+}
+
+void video_encode_image(AVFrame *frame, const uint8_t *image, int bytesPerLine, int height, struct SwsContext *formatter) {
+	// Every worker has its own SwsContext, sharing one between threads crashes in sws_scale.
 	
-	// Convert XImage to AVFrame using the previously initialized swscaler.
-	// This scaler converts both RGB32 to YUV420P, and scales the frame down if it was so configured to be.
+	// Convert the captured image to AVFrame using the previously initialized swscaler.
+	// This scaler converts both RGB32 to the ring's format, and scales the frame down if it was so configured to be.
+	uint64_t span = trace_begin();
 	sws_scale(
 		formatter,
-		(const uint8_t * const *) &screenContent->data,
-		&screenContent->bytes_per_line,
+		(const uint8_t * const *) &image,
+		&bytesPerLine,
 		0,
-		screenContent->height,
+		height,
 		frame->data,
 		frame->linesize
 	);
+	trace_end("sws_scale", span);
 
 }
 
 
-int open_video_stream(Capture *capture, VideoStream* vstream) {
-	// Free all the things
-	if(vstream->codecContext)
-		avcodec_free_context(&vstream->codecContext);
-	// Open the AVStream for this stream in the capture's AVFormatContext
+// Opens an encoder for `video` with the rendition's settings and adds a track for it to the rendition's output
+VideoEncoder *open_video_encoder(Rendition *rendition, VideoStream *video) {
+	VideoEncoder *encoder = malloc(sizeof(VideoEncoder));
+	memset(encoder, 0, sizeof(VideoEncoder));
+	encoder->source = video;
+	encoder->rendition = rendition;
 
-	const char* codecName = cfg_getstr(C_CODEC_ROOT, "name");
-	int bitrate = cfg_getint(C_CODEC_ROOT, "bitrate");
+	size_t width = rendition->frameWidth ? rendition->frameWidth : video->frameWidth;
+	size_t height = rendition->frameHeight ? rendition->frameHeight : video->frameHeight;
+	// The focus crop is there for its detail, it's never scaled
+	if(video->orchestrator->feeder != NULL) {
+		width = video->frameWidth;
+		height = video->frameHeight;
+	}
 
-	vstream->codec = avcodec_find_encoder_by_name(codecName);
-	if(vstream->codec == NULL) {
-		printf("Error finding codec %s\n", codecName);
-		return 1;
+	encoder->codec = avcodec_find_encoder_by_name(rendition->codecName);
+	if(encoder->codec == NULL) {
+		printf("Error finding codec %s\n", rendition->codecName);
+		goto fail;
 	}
 
-	AVStream *track = avformat_new_stream(capture->formatContext, NULL);
-	if (!track) {
+	encoder->stream = avformat_new_stream(rendition->formatContext, NULL);
+	if (!encoder->stream) {
 		printf("Could not allocate stream\n");
-		return 1;
+		goto fail;
 	}
-	track->id = capture->formatContext->nb_streams - 1;
-	vstream->packet->stream_index = track->id;
-	vstream->packet->pts = 0;
-	vstream->packet->dts = 0;
-	vstream->packet->duration = 0;
-	vstream->pts = 0;
+	encoder->stream->id = rendition->formatContext->nb_streams - 1;
+	if(video->orchestrator->feeder != NULL)
+		av_dict_set(&encoder->stream->metadata, "title", "Focus", 0);
 
-	vstream->codecContext = avcodec_alloc_context3(vstream->codec);
-	if(vstream->codecContext == NULL) {
-		printf("Error allocating codec context\n");
-		return 1;
+	encoder->packet = av_packet_alloc();
+	encoder->frame = av_frame_alloc();
+	if(encoder->packet == NULL || encoder->frame == NULL) {
+		printf("Error allocating packet\n");
+		goto fail;
 	}
 
+	encoder->codecContext = avcodec_alloc_context3(encoder->codec);
+	if(encoder->codecContext == NULL) {
+		printf("Error allocating codec context\n");
+		goto fail;
+	}
 
-	vstream->codecContext->bit_rate = bitrate;
-	vstream->codecContext->width = vstream->frameWidth;
-	vstream->codecContext->height = vstream->frameHeight;
-	// TODO: Preferably, the required variables for this operation should be set in the struct,
-	// and not dynamically retrieved from the config.
-	vstream->codecContext->time_base = (AVRational){1, cfg_getint(C_SPOTLIGHT_ROOT, "framerate")};
-	vstream->codecContext->framerate = (AVRational){cfg_getint(C_SPOTLIGHT_ROOT, "framerate"), 1};
-	vstream->codecContext->gop_size = 10;
-	vstream->codecContext->max_b_frames = 1;
-	vstream->codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
-
-	// Initialize track's codec parameters
-	AVCodecParameters *codecParams = track->codecpar;
-	codecParams->codec_id = vstream->codec->id;
-	codecParams->bit_rate = vstream->codecContext->bit_rate;
-	codecParams->codec_type = AVMEDIA_TYPE_VIDEO;
-	codecParams->width = vstream->frameWidth;
-	codecParams->height = vstream->frameHeight;
-
-	vstream->stream = track;
+	AVCodecContext *codecContext = encoder->codecContext;
+	codecContext->bit_rate = rendition->bitrate;
+	codecContext->width = width;
+	codecContext->height = height;
+	codecContext->time_base = (AVRational){1, video->orchestrator->framerate};
+	codecContext->framerate = (AVRational){video->orchestrator->framerate, 1};
+	codecContext->gop_size = DEFAULT_GOP_SIZE;
+	codecContext->max_b_frames = 1;
+	// Adaptive exports place the keyframes, the encoder only adds one once a static stretch outlasts max-gop
+	if(adaptive_export(video))
+		codecContext->gop_size = (cfg_getint(cfg_getsec(C_EXPORT_ROOT, "adaptive"), "max-gop") + 1) * video->orchestrator->framerate;
+	// The ring's format was negotiated against the main codec, other codecs may need the frames converted
+	codecContext->pix_fmt = encoder_pixel_format(encoder->codec, video->format);
+	// Encoding ahead of time cuts the stream at chunk boundaries, which only works if no frame refers across them
+	// Exporter processes start from a snapshot, there's nothing to encode ahead of time
+	// The history is encoded in front of the ring, which can't happen once the ring's encoded ahead of time
+	int preEncode = cfg_getbool(C_EXPORT_ROOT, "pre-encode") && !cfg_getbool(C_EXPORT_ROOT, "process") && video->history == NULL;
+	if(preEncode) {
+		encoder->chunkFrames = video->orchestrator->framerate * cfg_getint(C_EXPORT_ROOT, "pre-encode-chunk");
+		if(encoder->chunkFrames == 0)
+			encoder->chunkFrames = video->orchestrator->framerate;
+		codecContext->gop_size = encoder->chunkFrames;
+		codecContext->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+	}
+	if(rendition->formatContext->oformat->flags & AVFMT_GLOBALHEADER)
+		codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	AVDictionary *dict = NULL;
+	av_dict_copy(&dict, rendition->options, 0);
+	int ret = avcodec_open2(codecContext, encoder->codec, &dict);
+	av_dict_free(&dict);
+	if(ret < 0) {
+		printf("Error opening codec\n");
+		goto fail;
+	}
 
-	if(avcodec_parameters_from_context(track->codecpar, vstream->codecContext) < 0) {
+	if(avcodec_parameters_from_context(encoder->stream->codecpar, codecContext) < 0) {
 		printf("Failed to copy codec parameters to stream\n");
-		return 1;
+		goto fail;
 	}
 
-	AVDictionary *dict = parse_codec_options();
-	if(avcodec_open2(vstream->codecContext, vstream->codec, &dict) < 0) {
-		printf("Error opening codec\n");
-		return 1;
+	// Renditions with a different size or format than the ring convert every frame on the way into the encoder
+	if(width != video->frameWidth || height != video->frameHeight || codecContext->pix_fmt != video->format) {
+		encoder->scaler = sws_getContext(video->frameWidth, video->frameHeight, video->format,
+				width, height, codecContext->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+		encoder->scaledFrame = alloc_video_frame(width, height, codecContext->pix_fmt);
+		if(encoder->scaler == NULL || encoder->scaledFrame == NULL) {
+			printf("Error allocating scaler for %zux%zu %s\n", width, height, av_get_pix_fmt_name(codecContext->pix_fmt));
+			goto fail;
+		}
+		if(codecContext->pix_fmt != video->format)
+			printf("[VIDEO] %s doesn't take %s, converting every frame to %s\n", encoder->codec->name,
+					av_get_pix_fmt_name(video->format), av_get_pix_fmt_name(codecContext->pix_fmt));
 	}
 
-	return 0;
+	if(preEncode) {
+		encoder->generation = video->generation;
+		encoder->preEncoding = 1;
+		pthread_create(&encoder->preEncoder, NULL, pre_encode_thread, encoder);
+	}
+	return encoder;
+
+fail:
+	free_video_encoder(encoder);
+	return NULL;
+}
+
+void free_video_encoder(VideoEncoder *encoder) {
+	stop_pre_encoding(encoder);
+	clear_cache(encoder);
+	free(encoder->cached);
+	av_frame_free(&encoder->historyFrame);
+	sws_freeContext(encoder->historyScaler);
+	avcodec_free_context(&encoder->codecContext);
+	av_packet_free(&encoder->packet);
+	av_frame_free(&encoder->frame);
+	sws_freeContext(encoder->scaler);
+	av_frame_free(&encoder->scaledFrame);
+	free(encoder);
 }
 
 
 #define TIMESPEC_TO_MS(ts) (((float)(ts).tv_sec * 1000.0f) + ((float)(ts).tv_nsec / 1000000.0f))
 
+// Converts the focus crop's part of the grabbed image, read in place from the shared memory segment
+static void encode_crop(VideoThreadContext *ctx, AVFrame *frame) {
+	FocusCrop *crop = ctx->sync->crop;
+	VideoStream *video = crop->stream;
+	if(ctx->cropFormatter == NULL) {
+		ctx->cropFormatter = sws_getContext(video->frameWidth, video->frameHeight, AV_PIX_FMT_RGB32,
+				video->frameWidth, video->frameHeight, video->format, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	}
+	const uint8_t *corner = ctx->image + (size_t) crop->y * ctx->bytesPerLine + (size_t) crop->x * 4;
+	video_encode_image(frame, corner, ctx->bytesPerLine, video->frameHeight, ctx->cropFormatter);
+}
+
 static void video_worker(VideoThreadContext *ctx) {
 	struct timespec threadTime;
 
-	float frameTime = 1000.0 / ctx->sync->framerate;
-
-	// Initialize XShm module for this thread.
-	// In the past, multiple threads used a single XImage for capturing, 
-	// however this was subject to race conditions in specific contexts.
+	// Every worker has its own X connection and shared memory segment.
+	// In the past, all workers shared one Xlib display, where every grab was a round trip
+	// under the display's lock, so grabs of different workers had to wait for each other.
 	// The threads are synchronized to always take a screenshot at the frame time
-	// for 30 fps, this would be 33.3ms, if a thread spends more than frame-time on `video_encode_ximage`
-	// then the next thread is already overwriting the image data the previous thread is still working on.
-	// For my point of view, this is a suboptimal, but the only feasible solution.
+	// for 30 fps, this would be 33.3ms, if a thread spends more than frame-time on `video_encode_image`
+	// then the next thread is already requesting its own image into its own segment.
 	// The resource overhead should be somewhere along the lines of (width * height * 4) * nb_threads + SHM structs
 	// which is a lot, but acceptable for now.
 	
 	/* --------------------- INITIALIZE MIT-SHM MODULE --------------------- */
-	int framerate = cfg_getint(C_SPOTLIGHT_ROOT, "framerate");
 	int xOffset = cfg_getint(C_CAPTURE_ROOT, "x");
 	int yOffset = cfg_getint(C_CAPTURE_ROOT, "y");
 	int width = cfg_getint(C_CAPTURE_ROOT, "width");
 	int height = cfg_getint(C_CAPTURE_ROOT, "height");
 
-	if(!XShmQueryExtension(ctx->sync->display)) {
-		printf("XShm extension not supported\n");
+	int screen;
+	ctx->connection = xcb_connect(NULL, &screen);
+	if(xcb_connection_has_error(ctx->connection)) {
+		printf("Error connecting to the X server\n");
 		return;
 	}
-
-	// Create a XShm instance for the X11 display
-	// at coordinates captureRoot->x, captureRoot->y, captureRoot->width, captureRoot->height
-	XShmSegmentInfo* xShmInfo = malloc(sizeof(XShmSegmentInfo));
-
-	XImage* xImage = XShmCreateImage(
-		ctx->sync->display,
-		XDefaultVisual(ctx->sync->display, XDefaultScreen(ctx->sync->display)),
-		XDefaultDepth(ctx->sync->display, XDefaultScreen(ctx->sync->display)),
-		ZPixmap,
-		NULL,
-		xShmInfo,
-		width,
-		height);
-
-	xShmInfo->shmid = shmget(IPC_PRIVATE, xImage->bytes_per_line * xImage->height, IPC_CREAT | 0600);
-	if(xShmInfo->shmid == -1) {
-		printf("Error creating shared memory segment\n");
+	const xcb_query_extension_reply_t *shm = xcb_get_extension_data(ctx->connection, &xcb_shm_id);
+	if(shm == NULL || !shm->present) {
+		printf("XShm extension not supported\n");
 		return;
 	}
-
-	xImage->data = shmat(xShmInfo->shmid, 0, 0);
-	xShmInfo->shmaddr = xImage->data;
-
-	xShmInfo->readOnly = 0;
-	if(!XShmAttach(ctx->sync->display, xShmInfo)) {
-		printf("Error attaching shared memory segment\n");
+	xcb_screen_iterator_t screens = xcb_setup_roots_iterator(xcb_get_setup(ctx->connection));
+	for(int i = 0; i < screen; i++)
+		xcb_screen_next(&screens);
+	ctx->root = screens.data->root;
+
+	// Create a shared memory segment for the X11 display
+	// at coordinates captureRoot->x, captureRoot->y, captureRoot->width, captureRoot->height.
+	// When capturing a single window, the image follows the window's size instead.
+	if(ctx->sync->window != None) {
+		xcb_get_geometry_reply_t *geometry = xcb_get_geometry_reply(ctx->connection, xcb_get_geometry(ctx->connection, ctx->sync->window), NULL);
+		if(geometry == NULL) {
+			printf("[VIDEO] Window 0x%lx is gone\n", ctx->sync->window);
+			return;
+		}
+		width = ctx->windowWidth = geometry->width;
+		height = ctx->windowHeight = geometry->height;
+		ctx->windowBorder = geometry->border_width;
+		free(geometry);
+	}
+	if(attach_shm_image(ctx, width, height)) {
 		return;
 	}
+	ctx->formatter = create_formatter(ctx->sync->stream, width, height);
 
-	ctx->shmInfo = xShmInfo;
-
-
-	ctx->formatter = sws_getContext(
-		ctx->sync->stream->sourceWidth,
-		ctx->sync->stream->sourceHeight,
-		AV_PIX_FMT_RGB32,
-		ctx->sync->stream->frameWidth,
-		ctx->sync->stream->frameHeight,
-		AV_PIX_FMT_YUV420P,
-		// TODO: User should be able to set the scaling algorithm
-		// 	     in the config file
-		SWS_FAST_BILINEAR, // ~21ms
-		//SWS_SINC, // ~40ms
-		//SWS_LANCZOS, // ~30ms
-		// SWS_SPLINE, // ~31ms
-		NULL,
-		NULL,
-		NULL
-	);
-
+	place_thread(THREAD_CAPTURE);
+	trace_thread_name("video", ctx->id);
 	ctx->ready = 1;
 
 	float frameTimer = 0.0;
+	Capture *cap = ctx->sync->stream->root;
 	while(1) {
 		// Wait for encoder to finish
-		while(G_CAPTURE->pause == 1);
+		wait_for_resume(cap);
+		uint64_t span = trace_begin();
 		sem_wait(&ctx->active);
+		trace_end("sem_wait", span);
+		// The framerate may change when the config is reloaded
+		float frameTime = 1000.0 / ctx->sync->framerate;
 		clock_gettime(CLOCK_MONOTONIC, &threadTime);
 		frameTimer = TIMESPEC_TO_MS(threadTime) - ctx->sync->timestamp;
 		if(frameTimer < frameTime) {
+			span = trace_begin();
 			usleep((frameTime - frameTimer) * 1000);
+			trace_end("sleep", span);
 		}
 
-		// Unlock semaphore for next thread
 		clock_gettime(CLOCK_MONOTONIC, &threadTime);
 		ctx->sync->timestamp = TIMESPEC_TO_MS(threadTime);
 
-		sem_post(&ctx->sync->contexts[(ctx->id + 1) % ctx->sync->nb_threads]->active);
-
-		if (!XShmGetImage(ctx->sync->display, DefaultRootWindow(ctx->sync->display), xImage, 0, 0, AllPlanes)) {
+		// The capture might have been paused while we were waiting for our turn,
+		// in that case hand the turn back to ourselves and wait until it resumes.
+		if(!begin_ring_write(cap)) {
+			sem_post(&ctx->active);
+			continue;
 		}
 
+		// Request the image and claim the slot before handing the turn on, so frames stay in order.
+		// The next worker's request is in flight on its own connection while we convert ours.
+		request_grab(ctx, xOffset, yOffset);
+		AVFrame *frame = claim_video_frame(ctx->sync->stream);
+		// The focus crop is cut from the same grab, its ring advances along with the main one
+		AVFrame *cropFrame = ctx->sync->crop != NULL ? claim_video_frame(ctx->sync->crop->stream) : NULL;
+		sem_post(&ctx->sync->contexts[(ctx->id + 1) % ctx->sync->nb_threads]->active);
+
+		span = trace_begin();
+		finish_grab(ctx);
+		trace_end("shm_get_image", span);
 
-		video_encode_ximage(ctx->sync->stream, xImage, ctx->formatter);
+		video_encode_image(frame, ctx->image, ctx->bytesPerLine, ctx->imageHeight, ctx->formatter);
+		if(cropFrame != NULL)
+			encode_crop(ctx, cropFrame);
+		end_ring_write(cap);
 
 	}
 
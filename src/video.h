@@ -2,12 +2,42 @@
 #define VIDEO_H_
 
 #include <X11/Xlib.h>
-#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xcomposite.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+#include <xcb/composite.h>
 #include <semaphore.h>
 
 #include "spotlight.h"
 
 typedef struct VideoThreadContext VideoThreadContext;
+
+// Source of a stream whose frames are pushed in by an embedding application, see push_video_frame()
+typedef struct VideoInjector {
+	// Only set up for images that aren't in the ring's format and size already
+	struct SwsContext *scaler;
+	enum AVPixelFormat format;
+	size_t ringWidth, ringHeight;
+	int64_t origin; // Pushed time of the ring's time 0
+	int started;
+} VideoInjector;
+
+// Crop of the captured image at its native resolution, following the pointer or the focused window.
+// It's cut from the main stream's grabs into a stream of its own, see focus_video().
+typedef struct FocusCrop {
+	VideoStream *stream;
+	int followWindow;
+	int areaX, areaY; // Captured area on the screen
+	int areaWidth, areaHeight;
+	volatile int x, y; // Top left corner of the crop in the captured image
+
+	// Follows the focused window through X events, only with followWindow
+	xcb_connection_t *connection;
+	xcb_window_t window; // Top level window that's followed
+	pthread_t thread;
+	volatile int stop;
+} FocusCrop;
+
 typedef struct VideoThreadOrchestrator {
 	float timestamp;
 	size_t framerate;
@@ -18,28 +48,135 @@ typedef struct VideoThreadOrchestrator {
 
 	VideoStream* stream;
 	Display* display;
+	// Window captured through XComposite, None captures the configured rectangle of the root window
+	Window window;
+	volatile int windowLost;
+	// Set instead of the display and workers for streams fed by an embedding application
+	VideoInjector *injector;
+	// Cut from every grab, NULL without a focus crop
+	FocusCrop *crop;
+	// Set for a focus crop's stream instead of workers, its frames are written by the feeder's workers
+	struct VideoThreadOrchestrator *feeder;
 } VideoThreadOrchestrator;
 
 typedef struct VideoThreadContext {
 	int id;
 	VideoThreadOrchestrator* sync;
 	sem_t active;
-	XImage* shmImage;
-	XShmSegmentInfo* shmInfo;
+	// Own X connection, grabs of different workers don't wait for each other
+	xcb_connection_t *connection;
+	xcb_window_t root;
+	xcb_shm_seg_t segment;
+	int shmid;
+	uint8_t *image;
+	int imageWidth, imageHeight;
+	int bytesPerLine;
+	// Requests of the grab in flight
+	xcb_shm_get_image_cookie_t imageCookie;
+	xcb_get_geometry_cookie_t geometryCookie;
+	xcb_query_pointer_cookie_t pointerCookie;
+	// Last known geometry of the captured window
+	int windowWidth, windowHeight, windowBorder;
+	int resizeFailed; // The image couldn't follow the window's last size change, it keeps its old size
 	struct SwsContext *formatter;
+	struct SwsContext *cropFormatter; // Converts the focus crop, which keeps its size
 	volatile int ready; // Flag to indicate whether this thread has set up all thread local variables.
 } VideoThreadContext;
 
+// Frames that aged out of the ring, kept at a lower framerate and size.
+// Each frame's pts is its capture time in microseconds, see video_frame_time().
+typedef struct HistoryTier {
+	AVFrame **frames;
+	size_t bufferSize;
+	size_t writeIndex;
+	size_t frameCount;
+	size_t width, height;
+	size_t framerate;
+
+	// Converts ring frames of sourceWidth x sourceHeight into history frames
+	struct SwsContext *scaler;
+	size_t sourceWidth, sourceHeight;
+	int64_t nextTime; // Frames captured before this are skipped
+
+	pthread_t thread;
+	volatile int stop;
+} HistoryTier;
+
+// How plan_video_export() has a frame of the ring exported, stored in VideoStream.plan
+enum FramePlan {
+	PLAN_ENCODE,
+	PLAN_KEYFRAME,
+	PLAN_DROP, // Duplicate of the previous frame, left out and covered by its duration
+};
+
+// Encodes a VideoStream's ring into one rendition
+typedef struct VideoEncoder {
+	VideoStream *source;
+	struct Rendition *rendition;
+
+	AVCodecContext *codecContext;
+	const AVCodec *codec;
+	AVStream *stream;
+	AVPacket *packet;
+	AVFrame *frame;
+
+	// Only set if the rendition has a different size than the ring
+	struct SwsContext *scaler;
+	AVFrame *scaledFrame;
+
+	// Encoding ahead of time, frames are numbered by their index in the capture (frameCount)
+	int preEncoding;
+	volatile int stopPreEncoding;
+	pthread_t preEncoder;
+	size_t chunkFrames; // Keyframe interval, the cache is cut at these
+	size_t generation; // Ring generation the indices refer to
+	int64_t ptsBase; // Added to indices, keeps timestamps increasing when indices start over
+	size_t validStart; // First frame of the cached run, always a keyframe
+	size_t nextFrame; // Next frame to hand to the encoder
+	AVPacket **cached; // Packets encoded ahead of time, in decoding order
+	size_t nb_cached;
+	size_t cachedCapacity;
+
+	// Set while exporting, packets of frames before exportStart are dropped
+	int exporting;
+	size_t exportStart;
+	int64_t exportOrigin; // pts that becomes 0 in the output, earlier with history
+	size_t historyStart; // History frames exported in front of the ring, by index in the tier
+	size_t historyCount;
+	struct SwsContext *historyScaler;
+	AVFrame *historyFrame;
+	double exportedDuration; // Seconds of video written by the last export
+} VideoEncoder;
+
 VideoStream *default_video(struct Capture*);
+VideoStream *injected_video(struct Capture*, size_t, size_t);
+int focus_crop_size(size_t*, size_t*);
+VideoStream *focus_video(VideoStream*);
+size_t video_write_margin(VideoStream*);
+int push_video_frame(VideoStream*, enum AVPixelFormat, const uint8_t *const[], const int[], int64_t);
+void configured_frame_size(size_t*, size_t*);
+size_t video_slot_size(size_t, size_t, enum AVPixelFormat);
+int ring_format_supported(enum AVPixelFormat);
+enum AVPixelFormat negotiate_ring_format();
+int video_plane_height(enum AVPixelFormat, int, int);
 
 void free_video_stream(VideoStream*);
-void flush_video_stream(VideoStream*);
+int64_t video_frame_time(VideoStream*, size_t);
+void restart_video_time(VideoStream*, size_t, size_t);
+size_t history_memory(enum AVPixelFormat);
 void reset_video_stream(VideoStream*);
+int resize_video_stream(VideoStream*, size_t, size_t);
 
-// TODO: This function name is misleading
-int open_video_stream(Capture*, VideoStream*);
+AVDictionary* parse_codec_options(cfg_t*);
+VideoEncoder *open_video_encoder(struct Rendition*, VideoStream*);
+int adaptive_export(VideoStream*);
+void plan_video_export(VideoStream*);
+double prepare_video_export(VideoEncoder*);
+size_t flush_video_encoder(VideoEncoder*);
+void free_video_encoder(VideoEncoder*);
 
-void video_encode_ximage(VideoStream*, XImage*, struct SwsContext*);
+AVFrame *claim_video_frame(VideoStream*);
+void video_encode_image(AVFrame*, const uint8_t*, int, int, struct SwsContext*);
 uint32_t correct_video_drift(VideoStream*, int64_t);
 
 
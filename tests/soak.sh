@@ -0,0 +1,245 @@
+#!/usr/bin/env bash
+# Soak test: captures a test pattern and a tone on a virtual display for hours,
+# saves at random intervals and checks every file and the save log.
+#
+# Every file has to hold the whole window: the video within one frame of `window-size`, with fps x duration frames,
+# and the audio track starting and ending within SOAK_AV_TOLERANCE_MS of the video. Across the run, the RSS after
+# the last saves may not exceed the RSS after the first ones by more than SOAK_RSS_GROWTH_MIB, and saves may not get
+# more than SOAK_LATENCY_FACTOR times slower.
+#
+# Needs Xvfb, ffplay, ffprobe, stdbuf and PulseAudio (pactl). Run through `make soak`, or directly after `make build`.
+# The defaults take about 4 hours: SOAK_SAVES saves, SOAK_MIN_INTERVAL to SOAK_MAX_INTERVAL seconds apart.
+# SOAK_DISPLAY sets the display it runs on and SPOTLIGHT the binary under test.
+#
+# `tests/soak.sh --check <directory>` checks the log and files of an earlier run again, with the same settings.
+set -u
+
+cd "$(dirname "$0")/.."
+SPOTLIGHT=${SPOTLIGHT:-build/spotlight}
+SAVES=${SOAK_SAVES:-240}
+MIN_INTERVAL=${SOAK_MIN_INTERVAL:-30}
+MAX_INTERVAL=${SOAK_MAX_INTERVAL:-90}
+SOAK_DISPLAY=${SOAK_DISPLAY:-:99}
+AV_TOLERANCE_MS=${SOAK_AV_TOLERANCE_MS:-50}
+RSS_GROWTH_MIB=${SOAK_RSS_GROWTH_MIB:-64}
+LATENCY_FACTOR=${SOAK_LATENCY_FACTOR:-2}
+WINDOW=10
+FRAMERATE=30
+WIDTH=1280
+HEIGHT=720
+
+fail() {
+	echo "[SOAK] $*" >&2
+	exit 1
+}
+
+# Checks every output against the window, prints one line per file and counts the failed ones in BAD_FILES
+check_outputs() {
+	local file
+	BAD_FILES=0
+	for file in "$1"/output-*.mp4; do
+		[ -e "$file" ] || continue
+		if ! ffprobe -v error -count_frames -show_entries stream=codec_type,start_time,duration,nb_read_frames \
+				-of compact=p=0 "$file" > "$1/ffprobe.out" 2> "$1/ffprobe.err" || [ -s "$1/ffprobe.err" ]; then
+			echo "[SOAK] $(basename "$file"): doesn't probe: $(tr '\n' ' ' < "$1/ffprobe.err")"
+			BAD_FILES=$((BAD_FILES + 1))
+			continue
+		fi
+		# The first video and audio track, later ones (renditions' crops) aren't checked
+		awk -F'|' -v name="$(basename "$file")" -v window="$WINDOW" -v fps="$FRAMERATE" -v tolerance="$AV_TOLERANCE_MS" '
+			function abs(x) { return x < 0 ? -x : x }
+			{
+				delete field
+				for(i = 1; i <= NF; i++) {
+					split($i, pair, "=")
+					field[pair[1]] = pair[2]
+				}
+				if(field["codec_type"] == "video" && !video) {
+					video = 1; videoStart = field["start_time"]; videoDuration = field["duration"]; frames = field["nb_read_frames"]
+				} else if(field["codec_type"] == "audio" && !audio) {
+					audio = 1; audioStart = field["start_time"]; audioDuration = field["duration"]
+				}
+			}
+			END {
+				if(!video || !audio) {
+					printf("[SOAK] %s: missing its %s track\n", name, video ? "audio" : "video")
+					exit 1
+				}
+				error = ""
+				if(abs(videoDuration - window) > 1.0 / fps + 0.0005)
+					error = error sprintf(", video isn'\''t %d s long", window)
+				if(frames != int(videoDuration * fps + 0.5))
+					error = error sprintf(", %d frames in %.3f s at %d fps", frames, videoDuration, fps)
+				startOffset = (audioStart - videoStart) * 1000
+				durationOffset = (audioDuration - videoDuration) * 1000
+				if(abs(startOffset) > tolerance || abs(durationOffset) > tolerance)
+					error = error sprintf(", A/V apart by more than %d ms", tolerance)
+				printf("[SOAK] %s: video %.3f s, %d frames, audio %.3f s, A/V start %+.0f ms, duration %+.0f ms%s\n",
+						name, videoDuration, frames, audioDuration, startOffset, durationOffset, error == "" ? "" : " FAILED" error)
+				exit error != ""
+			}' "$1/ffprobe.out" || BAD_FILES=$((BAD_FILES + 1))
+	done
+}
+
+# Compares the saves of the first quarter of the run with those of the last one, returns 1 on a trend
+check_trend() {
+	awk -v growth="$RSS_GROWTH_MIB" -v factor="$LATENCY_FACTOR" '
+		function median(values, from, to,    sorted, n, i, j, swap) {
+			n = 0
+			for(i = from; i <= to; i++)
+				sorted[++n] = values[i]
+			for(i = 2; i <= n; i++) {
+				for(j = i; j > 1 && sorted[j - 1] > sorted[j]; j--) {
+					swap = sorted[j]; sorted[j] = sorted[j - 1]; sorted[j - 1] = swap
+				}
+			}
+			return n % 2 ? sorted[(n + 1) / 2] : (sorted[n / 2] + sorted[n / 2 + 1]) / 2
+		}
+		/\[CAPTURE\] Save #[0-9]+ took [0-9]+ ms, RSS [0-9]+ MiB/ {
+			for(i = 1; i <= NF; i++) {
+				if($i == "took") latency[++saves] = $(i + 1)
+				if($i == "RSS") rss[saves] = $(i + 1)
+			}
+		}
+		END {
+			if(saves < 4) {
+				printf("[SOAK] Only %d saves logged, too few to see a trend\n", saves)
+				exit 1
+			}
+			quarter = int(saves / 4)
+			firstLatency = median(latency, 1, quarter)
+			lastLatency = median(latency, saves - quarter + 1, saves)
+			firstRss = median(rss, 1, quarter)
+			lastRss = median(rss, saves - quarter + 1, saves)
+			printf("[SOAK] Median of the first and last %d saves: %.0f -> %.0f ms, RSS %.0f -> %.0f MiB\n",
+					quarter, firstLatency, lastLatency, firstRss, lastRss)
+			failed = 0
+			if(lastRss - firstRss > growth) {
+				printf("[SOAK] RSS grew by more than %d MiB\n", growth)
+				failed = 1
+			}
+			# Small latencies vary a lot relative to themselves, 100 ms either way is noise
+			if(lastLatency > firstLatency * factor && lastLatency - firstLatency > 100) {
+				printf("[SOAK] Saves got more than %sx slower\n", factor)
+				failed = 1
+			}
+			exit failed
+		}' "$1/spotlight.log"
+}
+
+# Checks a finished run, the number of files has to match the number of saves
+check_run() {
+	local files failed=0
+	files=$(find "$1/out" -name 'output-*.mp4' | wc -l)
+	check_outputs "$1/out"
+	check_trend "$1" || failed=1
+	[ "$files" -eq "$SAVES" ] || { echo "[SOAK] $files of $SAVES saves were written"; failed=1; }
+	[ "$BAD_FILES" -eq 0 ] || { echo "[SOAK] $BAD_FILES of $files files failed the check"; failed=1; }
+	[ "$failed" -eq 0 ] || return 1
+	echo "[SOAK] $files saves, all of them hold the window"
+}
+
+if [ "${1:-}" = "--check" ]; then
+	[ -d "${2:-}" ] || fail "usage: $0 --check <directory of an earlier run>"
+	command -v ffprobe > /dev/null || fail "ffprobe is missing"
+	check_run "$2"
+	exit $?
+fi
+
+for tool in Xvfb ffplay ffprobe pactl stdbuf; do
+	command -v "$tool" > /dev/null || fail "$tool is missing"
+done
+[ -x "$SPOTLIGHT" ] || fail "$SPOTLIGHT isn't built, run make build first"
+[ "$MIN_INTERVAL" -ge 1 ] && [ "$MAX_INTERVAL" -ge "$MIN_INTERVAL" ] || fail "SOAK_MIN_INTERVAL has to be at least 1 and at most SOAK_MAX_INTERVAL"
+[ "$SAVES" -ge 4 ] || fail "SOAK_SAVES has to be at least 4 to see a trend"
+
+WORK=$(mktemp -d)
+PIDS=()
+SINK_MODULE=""
+cleanup() {
+	for pid in "${PIDS[@]}"; do
+		kill "$pid" 2> /dev/null
+	done
+	wait 2> /dev/null
+	[ -n "$SINK_MODULE" ] && pactl unload-module "$SINK_MODULE"
+	echo "[SOAK] Log and outputs are in $WORK, check them again with $0 --check $WORK"
+}
+trap cleanup EXIT
+
+# Display with a moving test pattern, the tone is played into a null sink the capture records from
+Xvfb "$SOAK_DISPLAY" -screen 0 "${WIDTH}x${HEIGHT}x24" -nolisten tcp > "$WORK/xvfb.log" 2>&1 &
+PIDS+=($!)
+for _ in $(seq 50); do
+	[ -e "/tmp/.X11-unix/X${SOAK_DISPLAY#:}" ] && break
+	sleep 0.1
+done
+[ -e "/tmp/.X11-unix/X${SOAK_DISPLAY#:}" ] || fail "Xvfb didn't start on $SOAK_DISPLAY"
+
+pactl info > /dev/null 2>&1 || pulseaudio --daemonize --exit-idle-time=-1 || fail "no PulseAudio server"
+SINK_MODULE=$(pactl load-module module-null-sink sink_name=spotlight_soak) || fail "can't load a null sink"
+
+# The tone never stops, so the audio track is never left out as silent
+DISPLAY=$SOAK_DISPLAY PULSE_SINK=spotlight_soak ffplay -loglevel error -fs -f lavfi \
+	-i "testsrc2=size=${WIDTH}x${HEIGHT}:rate=${FRAMERATE}[out0];sine=frequency=440[out1]" > "$WORK/ffplay.log" 2>&1 &
+PIDS+=($!)
+
+mkdir -p "$WORK/out"
+cat > "$WORK/config.cfg" << CONFIG
+spotlight {
+	framerate = $FRAMERATE
+	window-size = $WINDOW
+	threads = 2
+	capture {
+		width = $WIDTH
+		height = $HEIGHT
+	}
+	audio {
+		device soak {
+			name = "spotlight_soak.monitor"
+		}
+	}
+}
+codec {
+	name = "libx264"
+	container = "mp4"
+	options {
+		preset = ultrafast
+	}
+	bitrate = 2000000
+}
+export {
+	directory = "$WORK/out"
+}
+CONFIG
+
+# Line buffered, so the log can be followed while it runs
+DISPLAY=$SOAK_DISPLAY stdbuf -oL "$SPOTLIGHT" --config "$WORK/config.cfg" > "$WORK/spotlight.log" 2>&1 &
+SPOTLIGHT_PID=$!
+PIDS+=($SPOTLIGHT_PID)
+for _ in $(seq 300); do
+	grep -q "^Ready" "$WORK/spotlight.log" && break
+	kill -0 "$SPOTLIGHT_PID" 2> /dev/null || fail "spotlight exited on startup, see $WORK/spotlight.log"
+	sleep 0.1
+done
+grep -q "^Ready" "$WORK/spotlight.log" || fail "spotlight didn't start within 30 s"
+
+# Every save has to hold the whole window, so the first one waits until it's filled
+echo "[SOAK] Saving $SAVES times, every $MIN_INTERVAL to $MAX_INTERVAL s, follow $WORK/spotlight.log"
+sleep $((WINDOW + 2))
+for i in $(seq "$SAVES"); do
+	[ "$i" -gt 1 ] && sleep $((MIN_INTERVAL + RANDOM % (MAX_INTERVAL - MIN_INTERVAL + 1)))
+	kill -0 "$SPOTLIGHT_PID" 2> /dev/null || fail "spotlight died before save $i, see $WORK/spotlight.log"
+	kill -USR1 "$SPOTLIGHT_PID"
+done
+
+# The last save may still be encoding, files are only renamed to .mp4 once they're complete
+for _ in $(seq 120); do
+	[ "$(find "$WORK/out" -name 'output-*.mp4' | wc -l)" -ge "$SAVES" ] && break
+	sleep 1
+done
+kill -TERM "$SPOTLIGHT_PID"
+wait "$SPOTLIGHT_PID"
+STATUS=$?
+[ "$STATUS" -eq 0 ] || fail "spotlight exited with $STATUS on SIGTERM, see $WORK/spotlight.log"
+
+check_run "$WORK"